@@ -12,6 +12,7 @@
  *  4) Uncomment the line that runs accept_request().
  *  5) Remove -lsocket from the Makefile.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -26,6 +27,28 @@
 #include <sys/wait.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <sys/sendfile.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
 
 #define ISspace(x) isspace((int)(x))
 
@@ -34,482 +57,9895 @@
 #define STDOUT  1
 #define STDERR  2
 
+/* Connection handling models, selected with -m on the command line */
+#define MODE_THREAD 0   /* one detached thread per accepted socket */
+#define MODE_EPOLL  1   /* single edge-triggered epoll event loop */
+#define MODE_POOL   2   /* fixed worker pool fed by a bounded queue */
+#define MODE_SHARD  3   /* one SO_REUSEPORT listener + epoll loop per CPU */
+#define MODE_URING  4   /* like MODE_SHARD, but an io_uring per CPU */
+
+/* What route_request() decided to do with a request */
+#define ROUTE_NOT_FOUND 0
+#define ROUTE_FILE      1
+#define ROUTE_CGI       2
+#define ROUTE_STATS     3   /* the /__stats page, see stats_response() */
+#define ROUTE_LIMITED   4   /* over a -r/-R request rate: 429 */
+#define ROUTE_H2        5   /* h2c preface or Upgrade: see h2_serve() */
+
+/* Closing a socket with input still unread makes the kernel reset the
+ * connection, which throws away whatever part of the response the
+ * client has not read yet.  Sockets that may have some are shut down
+ * for writing and drained for a while first, see linger_close(). */
+#define LINGER_SECS  2
+#define LINGER_MAX   4096   /* sockets draining at once; more just close */
+#define LINGER_READS 16     /* of 4 KB per wakeup, or the client floods */
+
+/* A whole small file held in memory together with its response
+ * headers up to, but not including, the Connection line.  Entries are
+ * reference counted so a connection can keep sending one after it has
+ * been evicted; the validators decide whether it is still current. */
+#define CACHE_BUCKETS  1024
+#define CACHE_MAX_FILE (1 << 20)   /* larger files are never cached */
+
+struct cache_entry {
+    struct cache_entry *hnext;    /* hash chain */
+    struct cache_entry *prev;     /* LRU list, most recent first */
+    struct cache_entry *next;
+    atomic_int refs;
+    unsigned hash;                /* bucket in cache_table */
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    char *data;                   /* headers, then the file bytes */
+    size_t hdr_len;
+    const char *coding;           /* a compressed variant in zip_table: */
+    int state;                    /* ZIP_ */
+    off_t src_size;               /* the size of the file it was made of */
+};
+
+/* Compressed variants of files without a precompressed sibling, made
+ * by a pool of zip_thread()s and kept in a table of their own, bounded
+ * by -z.  Entries are struct cache_entry, so they are sent just like
+ * hits in the hot-file cache. */
+#define ZIP_BUCKETS 1024
+#define ZIP_MIN     256         /* smaller files are not worth it */
+#define ZIP_MAX     (8 << 20)   /* larger ones take too long */
+#define ZIP_LEVEL   6
+#define ZIP_QUEUE   256         /* jobs waiting for a worker at most */
+#define ZIP_PENDING 0           /* a worker is on it */
+#define ZIP_READY   1
+#define ZIP_USELESS 2           /* did not shrink, or failed: send as is */
+
+struct zip_job {
+    struct zip_job *next;
+    struct cache_entry *e;        /* the pending entry, referenced */
+    int fd;                       /* a dup() of the file's descriptor */
+    const char *type;
+    struct stat st;
+};
+
+/* Resolved-url cache, see file_get() */
+#define FILE_BUCKETS 4096
+#define FILE_MAX     8192   /* entries, each holding up to three fds */
+
+/* A directory watched with inotify on behalf of the url cache */
+struct dir_watch {
+    struct dir_watch *next;
+    int wd;               /* -1 once the kernel has dropped the watch */
+    char *path;
+    atomic_uint gen;      /* bumped on every change in the directory */
+};
+
+/* A url resolved to a file under htdocs: where the directory-to-
+ * index.html resolution led, its stat, and open descriptors for it and
+ * its precompressed siblings, so a hit costs no path walk.  A directory
+ * without an index.html resolves to its listing instead, rendered once.
+ * An entry is good for as long as the directories it was resolved in
+ * are unchanged.
+ * Entries are reference counted; requests hold one while the
+ * descriptors are in use. */
+struct file_entry {
+    struct file_entry *hnext;   /* hash chain */
+    struct file_entry *prev;    /* LRU list, most recently used first */
+    struct file_entry *next;
+    atomic_int refs;
+    unsigned hash;
+    char *url;
+    char *path;
+    struct stat st;
+    int cgi;              /* executable: run it rather than send it */
+    int fd;               /* O_RDONLY, -1 for CGI programs */
+    int var_fd[2];        /* the codings[] siblings, -1 if absent */
+    struct stat var_st[2];
+    struct dir_watch *dirs[2];  /* holding the file, and the directory
+                                 * resolved to its index.html */
+    unsigned gens[2];     /* their generations when resolved */
+    unsigned gen;         /* file_gen when resolved */
+    struct cache_entry *listing[2]; /* of a directory: as HTML and as
+                                     * JSON, see listing_make() */
+};
+
+/* A snapshot image of the whole site, written by snap_pack() and served
+ * from a read-only mapping.  A minimal perfect hash (hash-and-displace:
+ * the url's bucket gives the seed of its slot hash) finds the entry of
+ * a url in one probe; each entry holds, for the file and for each
+ * precompressed sibling, the rendered 200 response head and where the
+ * body lies in the image.  Offsets count from the start of the image. */
+#define SNAP_MAGIC    "HTSNAP01"
+#define SNAP_VARIANTS 3         /* the file, then the codings[] siblings */
+#define SNAP_MAX_DISP 65536     /* seeds tried per bucket before giving up */
+
+struct snap_body {
+    uint64_t hdr_off;     /* response head, up to the Connection line */
+    uint64_t body_off;
+    uint64_t size;
+    uint64_t ino;         /* validators of the file that was packed */
+    int64_t mtime;
+    uint32_t mtime_nsec;
+    uint32_t hdr_len;     /* 0 if there is no such variant */
+};
+
+struct snap_entry {
+    uint64_t url_off;     /* 0 for an empty slot */
+    uint64_t path_off;    /* htdocs path of the file, NUL-terminated */
+    uint32_t url_len;
+    uint32_t vary;        /* a precompressed sibling exists */
+    struct snap_body var[SNAP_VARIANTS];
+};
+
+struct snap_header {
+    char magic[8];
+    uint64_t size;        /* of the whole image */
+    uint64_t seed;        /* of the bucket hash */
+    uint32_t nbuckets;
+    uint32_t nslots;
+    uint64_t disp_off;    /* uint32_t seed of the slot hash, per bucket */
+    uint64_t entries_off; /* struct snap_entry, per slot */
+};
+
+/* A mapped image.  The struct itself is never freed, so a reader can
+ * still take a reference on one that has just been replaced; the
+ * mapping goes away with the last reference. */
+struct snapshot {
+    const char *base;
+    size_t size;
+    int fd;               /* for sendfile() of byte ranges */
+    const struct snap_header *hdr;
+    const uint32_t *disp;
+    const struct snap_entry *entries;
+    atomic_int refs;
+    atomic_int unmapped;
+};
+
+/* An image being written by snap_pack() */
+struct snap_key {
+    char *url;
+    char *path;
+    struct snap_entry e;
+};
+
+struct snap_builder {
+    int fd;
+    uint64_t off;         /* where the next write goes */
+    struct snap_key *keys;
+    size_t nkeys;
+    size_t cap;
+    uint64_t seed;
+    uint32_t nbuckets;
+    uint32_t nslots;
+    uint32_t *disp;
+    int32_t *slots;       /* index into keys, -1 for an empty slot */
+};
+
+/* Live counters for /__stats.  Every thread that serves requests owns a
+ * struct stats and is the only one writing to it, so recording a
+ * request takes no lock and no atomic read-modify-write; the page adds
+ * up all of them.  Latencies are kept in log-linear (HDR-style)
+ * histograms of microseconds: every power of two is split in 16, so a
+ * percentile read off a bucket is within 1/16 of the truth.  There is
+ * one histogram per route class and one per status code. */
+#define STAT_PAGE      0  /* route classes: blog pages and the rest */
+#define STAT_DEB       1  /* .deb packages from the pool */
+#define STAT_DISTS     2  /* the dists/ indexes apt polls */
+#define STAT_CGI       3
+#define STAT_CLASSES   4
+#define STAT_CODES     10 /* the stat_codes[], then any other status */
+#define STAT_SERIES    (STAT_CLASSES + STAT_CODES)
+#define HIST_SUB_BITS  4
+#define HIST_MAX_EXP   36 /* latencies are capped at 2^36 us, 19 hours */
+#define HIST_BUCKETS   ((HIST_MAX_EXP - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct hist {
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[HIST_BUCKETS];
+};
+
+struct stats {
+    struct stats *next;   /* stats_list, guarded by stats_lock */
+    _Atomic uint64_t accepted;  /* connections */
+    _Atomic uint64_t closed;
+    _Atomic uint64_t requests;
+    _Atomic uint64_t bytes;     /* of responses, handed to the kernel */
+    struct hist hists[STAT_SERIES];   /* classes, then status codes */
+};
+
+/* A histogram added up over all threads, see stats_total() */
+struct hist_total {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+/* Where the body of a response came from, for the access log */
+#define FROM_NONE     0   /* no body: 304, 404, CGI */
+#define FROM_FILE     1   /* the file, not (yet) in the hot-file cache */
+#define FROM_CACHE    2   /* a hit in the hot-file cache */
+#define FROM_SNAPSHOT 3   /* the mapping of the snapshot image */
+#define FROM_ZIP      4   /* a variant compressed on the fly */
+#define FROM_LISTING  5   /* a directory listing kept by the url cache */
+
+/* The access log.  A thread that serves requests pushes a fixed-size
+ * record per request into its own single-producer ring; log_thread()
+ * drains all the rings into a buffer and writes it out in large
+ * batches, so serving threads never wait on the file or on each other.
+ * A full ring drops the record and counts it. */
+#define LOG_RING  512     /* records per thread, a power of two */
+#define LOG_BATCH 65536   /* bytes written at a time */
+
+struct log_record {
+    struct timespec when; /* CLOCK_REALTIME, when the response was out */
+    uint64_t usec;        /* since the request head was in */
+    long long bytes;
+    int status;
+    int from;             /* one of the FROM_ constants */
+    char method[8];
+    char range[64];
+    char path[256];       /* the url without its query, maybe cut */
+};
+
+struct log_ring {
+    struct log_ring *next;      /* log_rings or log_free */
+    _Atomic size_t head;        /* written by the owning thread only */
+    _Atomic size_t tail;        /* written by log_thread() only */
+    _Atomic uint64_t dropped;   /* records the owner could not push */
+    uint64_t reported;          /* of those, how many were logged */
+    atomic_int dead;            /* the owner has exited */
+    struct log_record recs[LOG_RING];
+};
+
+/* Phase tracing, compiled in with -DTRACE (make httpd-trace).  Of the
+ * requests accept_request() serves, one in every trace_every gets a
+ * timestamp at each phase it passes; the finished record replaces the
+ * oldest in trace_ring, and SIGUSR1 writes the ring out as Chrome
+ * trace_event JSON for Perfetto.  Without TRACE the TRACE_ macros are
+ * empty and none of it is compiled.  A phase a request skips (a url
+ * cache hit opens nothing) is folded into the next one. */
+#define TRACE_ACCEPT     0  /* connection taken up, or previous response out */
+#define TRACE_FIRST_BYTE 1  /* of the request head */
+#define TRACE_PARSED     2  /* the head is parsed */
+#define TRACE_RESOLVED   3  /* the url is mapped to a file and stat()ed */
+#define TRACE_OPENED     4  /* its descriptors are open */
+#define TRACE_FIRST_SEND 5
+#define TRACE_LAST_SEND  6  /* the response is out */
+#define TRACE_PHASES     7
+#define TRACE_RING       4096   /* records kept, a power of two */
+
+#ifdef TRACE
+struct trace_record {
+    uint64_t at[TRACE_PHASES];  /* CLOCK_MONOTONIC ns, 0 if not reached */
+    pid_t tid;
+    int status;
+    long long bytes;
+    char method[8];
+    char path[128];
+};
+
+/* A slot of trace_ring.  seq is 0 while the record is being written,
+ * then one more than the sequence number it was written under, so
+ * trace_dump() can tell a torn or stale copy. */
+struct trace_slot {
+    _Atomic uint64_t seq;
+    struct trace_record rec;
+};
+
+#define TRACE_BEGIN()     trace_begin()
+#define TRACE_MARK(phase) \
+    do { if (trace_cur != NULL) trace_mark(phase); } while (0)
+#define TRACE_END(req) \
+    do { if (trace_cur != NULL) trace_end(req); } while (0)
+#define TRACE_DROP()      (trace_cur = NULL)
+#define TRACE_OPTS        "x:X:"
+#define TRACE_USAGE       " [-x every] [-X file]"
+#else
+#define TRACE_BEGIN()     ((void)0)
+#define TRACE_MARK(phase) ((void)0)
+#define TRACE_END(req)    ((void)0)
+#define TRACE_DROP()      ((void)0)
+#define TRACE_OPTS        ""
+#define TRACE_USAGE       ""
+#endif
+
+/* Byte ranges asked for with a Range header */
+#define MAX_RANGES 16
+#define BOUNDARY   "jdbhttpd-3d6b6a416f9b"   /* multipart/byteranges */
+
+struct byterange {
+    off_t first;
+    off_t last;           /* inclusive, as in the header */
+};
+
+/* Error responses, indexes into error_pages[] */
+#define ERR_BAD_REQUEST  0
+#define ERR_NOT_FOUND    1
+#define ERR_TOO_LARGE    2
+#define ERR_INTERNAL     3
+#define ERR_UNIMPLEMENTED 4
+#define ERR_UNAVAILABLE  5
+#define ERR_LIMITED      6
+
+/* An error response, rendered once at startup by error_pages_init() */
+struct error_page {
+    const char *status;
+    const char *extra;    /* further header lines */
+    const char *title;
+    const char *text;
+    char *data;           /* status line and headers, then the body */
+    size_t head_len;      /* up to, not including, the Connection line */
+    size_t len;
+};
+
+/* FastCGI (version 1) records and roles used by execute_fcgi() */
+#define FCGI_VERSION_1      1
+#define FCGI_BEGIN_REQUEST  1
+#define FCGI_END_REQUEST    3
+#define FCGI_PARAMS         4
+#define FCGI_STDIN          5
+#define FCGI_STDOUT         6
+#define FCGI_STDERR         7
+#define FCGI_RESPONDER      1
+#define FCGI_MAX_WORKERS    64
+
+/* Variables passed to a CGI program, see cgi_env() */
+#define CGI_ENV_MAX 16
+
+/* Largest request head (request line plus headers) that is accepted */
+#define HEAD_MAX 8192
+
+/* The parsed request line plus the headers the server acts upon.  The
+ * head is split up in place, so the strings point into the buffer it
+ * was read into and are only valid while that request is served. */
+struct request {
+    char *method;
+    char *url;
+    char path[512];
+    char *query_string;
+    struct stat st;       /* of path, as found by route_request() */
+    struct file_entry *file;    /* referenced by route_request() */
+    struct snapshot *snap;      /* referenced instead when the url is in
+                                 * the snapshot image */
+    const struct snap_body *snap_body;  /* the variant being sent */
+    int fd;               /* open descriptor of path, owned by file or
+                           * snap */
+    off_t base;           /* where the file starts in fd */
+    int cgi;              /* becomes true if server decides this is a CGI
+                           * program */
+    int version;          /* 10 for HTTP/1.0, 11 for HTTP/1.1 */
+    int keep_alive;       /* the connection may carry another request */
+    int content_length;
+    const char *body;     /* POST body bytes already read off the socket */
+    size_t body_len;
+    const char *range;    /* the Range header, "" if none */
+    const char *accept_encoding;
+    const char *type;     /* Content-Type of the file */
+    const char *encoding; /* Content-Encoding of a precompressed sibling */
+    int vary;             /* a precompressed sibling exists */
+    const char *if_none_match;
+    const char *if_range;
+    time_t if_modified_since;   /* -1 if absent or unparsable */
+    int not_modified;     /* the client's copy is current: send a 304 */
+    struct byterange ranges[MAX_RANGES];
+    int nranges;          /* 0: whole file, -1: unsatisfiable (416) */
+    off_t length;         /* Content-Length of the response */
+    uint64_t start;       /* when the head was in, for the stats */
+    int status;           /* of the response, for the stats */
+    off_t sent;           /* bytes of the response handed to the socket */
+    int from;             /* where the body came from, FROM_ */
+    in_addr_t peer;       /* client address for the rate limits, or
+                           * INADDR_ANY */
+    struct cache_entry *zip;    /* the compressed variant to send, with
+                                 * encoding its coding; referenced */
+    struct cache_entry *listing;    /* the directory listing to send;
+                                     * referenced */
+    const char *upgrade;  /* the Upgrade header, "" if none */
+    const char *http2_settings; /* the HTTP2-Settings header, or NULL */
+};
+
+/* The output of a CGI program on its way to the client.  The headers
+ * the program writes are collected and turned into the response head;
+ * the rest is relayed as the body, chunked for HTTP/1.1 clients. */
+struct cgi_out {
+    int client;
+    int chunked;          /* Transfer-Encoding: chunked */
+    int keep_alive;       /* the connection survives the response */
+    int started;          /* the response head has been sent */
+    int status;           /* its status code */
+    off_t sent;           /* bytes sent so far */
+    char buf[HEAD_MAX];   /* the program's headers until then */
+    size_t len;
+    size_t scan;          /* for head_length() */
+};
+
+/* A FastCGI program kept running by the server, see fcgi_connect() */
+struct fcgi_app {
+    struct fcgi_app *next;
+    char *path;
+    struct sockaddr_un addr;    /* abstract socket its workers accept on */
+    socklen_t addr_len;
+    pid_t pids[FCGI_MAX_WORKERS];
+};
+
+/* A hashed timer wheel: a timer hangs off the slot of the tick it
+ * expires at, modulo the number of slots, so arming and cancelling are
+ * O(1) list operations and each tick looks at one slot only.  Timers
+ * due in a later lap of the wheel stay in their slot until then. */
+#define WHEEL_SLOTS   256   /* a power of two */
+#define WHEEL_TICK_MS 250
+
+struct timer {
+    struct timer *prev;   /* slot list, NULL while not armed */
+    struct timer *next;
+    uint64_t expires;     /* the tick it fires at */
+};
+
+struct wheel {
+    uint64_t now;         /* the last tick run */
+    size_t armed;
+    struct timer slots[WHEEL_SLOTS];    /* list sentinels */
+};
+
+/* What a connection is waiting for, which decides its deadline */
+#define TIMING_NONE 0
+#define TIMING_HEAD 1     /* the rest of a request head: -t */
+#define TIMING_IDLE 2     /* the next request on a kept-alive one: -k */
+#define TIMING_SEND 3     /* room to send more of the response: -T */
+#define TIMING_PACE 4     /* a send held back by -r/-R may go on */
+
+/* A deadline on a blocking connection of the thread and pool models:
+ * guard_thread() shuts the socket down once it passes, which makes the
+ * blocked recv() of the connection's thread return. */
+struct guard {
+    struct timer timer;   /* first, so the wheel hands back the guard */
+    int fd;
+    int timing;
+};
+
+/* Connections open per client address, for the -i cap */
+#define IP_BITS 10
+
+struct ip_count {
+    struct ip_count *next;
+    in_addr_t addr;
+    int count;
+};
+
+/* Token buckets for the -r and -R rate limits.  A bucket is kept as
+ * the time it will be full again (the "theoretical arrival time" of
+ * GCRA), so an idle bucket needs no refilling and taking from one is a
+ * single compare-and-swap.  The buckets of an address, or of a prefix,
+ * share a slot of a fixed table that is probed without locks; a key
+ * not found in its RATE_PROBE slots takes over a free one or the one
+ * used longest ago. */
+#define RATE_BITS   12
+#define RATE_SLOTS  (1 << RATE_BITS)
+#define RATE_PROBE  8
+#define RATE_BURST  1000000000ULL   /* bucket depth: a second, in ns */
+#define RATE_CHUNK  16384   /* pacing waits rather than send less */
+#define RATE_LIMITS 2       /* -r, then -R */
+
+struct rate_limit {
+    int bits;             /* of the address that make up the key */
+    uint64_t reqs;        /* requests per second, 0: no limit */
+    uint64_t bytes;       /* bytes per second, 0: no limit */
+};
+
+struct rate_slot {
+    _Atomic uint64_t key;       /* bits + 1 << 32 | prefix, 0: free */
+    _Atomic uint64_t used;      /* ns of the last lookup */
+    _Atomic uint64_t reqs;      /* ns at which the request bucket is full */
+    _Atomic uint64_t bytes;     /* ns at which the byte bucket is full */
+};
+
+/* Per-connection state for the epoll event loop */
+#define CONN_READ   0     /* collecting the request line and headers */
+#define CONN_WRITE  1     /* streaming the response out */
+
+struct conn {
+    struct timer timer;   /* first, so the wheel hands back the conn */
+    int timing;           /* what the timer is armed for, TIMING_ */
+    off_t timer_sent;     /* req.sent when a TIMING_SEND timer was armed */
+    in_addr_t peer;       /* counted by ip_admit(), or INADDR_ANY */
+    int fd;
+    int state;
+    int requests;         /* requests served on this connection */
+    size_t head_len;      /* bytes of rbuf taken by the current request
+                           * head, 0 until it is complete */
+    size_t scan;          /* where head_length() resumes looking */
+    int file;             /* file being sent, or -1 */
+    off_t offset;         /* next byte of the file to send */
+    off_t end;            /* offset just past the last byte to send */
+    int copy;             /* sendfile() unsupported, copy through wbuf */
+    int part;             /* next part of a multipart/byteranges body */
+    struct cache_entry *entry;  /* cached response being sent, or NULL */
+    int vec;              /* entry or req.snap_body is being sent */
+    struct iovec iov[3];  /* what is left of it, see conn_iov() */
+    struct request req;
+    char rbuf[HEAD_MAX];
+    size_t rlen;
+    char wbuf[8192];
+    size_t wlen;
+    size_t woff;
+};
+
+/* HTTP/2 over cleartext TCP (h2c), reached with the prior knowledge
+ * preface or an Upgrade from HTTP/1.1.  An h2c connection gets a thread
+ * of its own running h2_serve(); the requests on its streams are turned
+ * back into HTTP/1.1 heads and go through parse_request(),
+ * route_request() and the same file, cache, compression and snapshot
+ * layers as any other. */
+#define H2_PREFACE  "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PRI_LEN  18          /* the part of it that looks like a head */
+#define H2_STREAMS  100         /* streams a client may have open at once */
+#define H2_FRAME    16384       /* frame payloads taken and sent, at most */
+#define H2_WINDOW   65535       /* initial flow control windows */
+#define H2_TABLE    4096        /* HPACK dynamic tables, both ways */
+#define H2_BLOCK    65536       /* a header block with its CONTINUATIONs */
+#define H2_OUT      (4 * (H2_FRAME + 9))   /* frames waiting to be sent */
+#define H2_RESERVE  8192        /* room kept for what one frame provokes */
+
+#define H2_DATA          0      /* frame types */
+#define H2_HEADERS       1
+#define H2_PRIORITY      2
+#define H2_RST_STREAM    3
+#define H2_SETTINGS      4
+#define H2_PUSH_PROMISE  5
+#define H2_PING          6
+#define H2_GOAWAY        7
+#define H2_WINDOW_UPDATE 8
+#define H2_CONTINUATION  9
+
+#define H2_END_STREAM  0x01     /* frame flags */
+#define H2_ACK         0x01
+#define H2_END_HEADERS 0x04
+#define H2_PADDED      0x08
+#define H2_PRIO        0x20
+
+#define H2_NO_ERROR           0x0   /* error codes */
+#define H2_PROTOCOL_ERROR     0x1
+#define H2_INTERNAL_ERROR     0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_FRAME_SIZE_ERROR   0x6
+#define H2_REFUSED_STREAM     0x7
+#define H2_COMPRESSION_ERROR  0x9
+#define H2_ENHANCE_YOUR_CALM  0xb
+#define H2_HTTP_1_1_REQUIRED  0xd
+
+/* An HPACK dynamic table: a ring of fields, newest first, evicted from
+ * the oldest end to stay within max.  Every field counts 32 bytes on
+ * top of its name and value, so H2_TABLE / 32 of them always fit. */
+struct hpack_field {
+    char *name;           /* one allocation, the value follows */
+    char *value;
+    size_t size;          /* as the table counts it */
+};
+
+struct hpack_table {
+    struct hpack_field fields[H2_TABLE / 32];
+    int first;            /* the newest field */
+    int count;
+    size_t size;
+    size_t max;
+};
+
+/* A stream of an h2c connection, from its HEADERS until its response
+ * has been queued completely or it was reset. */
+struct h2_stream {
+    struct h2_stream *next;     /* of the connection, oldest first */
+    uint32_t id;
+    int64_t window;       /* what the client lets us send on it */
+    int body;             /* the request body is still coming */
+    int sending;          /* headers are out, DATA frames follow */
+    struct request req;
+    struct cache_entry *entry;  /* the response, if cached; referenced */
+    const char *data;     /* the body in memory, or NULL to pread() */
+    int file;             /* it from this descriptor */
+    off_t offset;         /* next byte to send, of data or in file */
+    off_t end;
+    char *buf;            /* a response rendered for this stream */
+    char head[HEAD_MAX];  /* the request as an HTTP/1.1 head */
+};
+
+struct h2_conn {
+    int fd;
+    in_addr_t peer;
+    struct h2_stream *streams;
+    int nstreams;
+    uint32_t last_id;     /* highest stream the client opened */
+    int requests;         /* streams taken, for -n */
+    int goaway;           /* no more streams: GOAWAY sent or received */
+    int settings;         /* the client's first SETTINGS arrived */
+    int64_t window;       /* what the client lets us send, all streams */
+    uint32_t initial;     /* its SETTINGS_INITIAL_WINDOW_SIZE */
+    int table_update;     /* our next header block resizes enc */
+    size_t table_want;    /* to this */
+    struct hpack_table dec;     /* what the client's header blocks use */
+    struct hpack_table enc;     /* what ours use */
+    uint32_t block_id;    /* stream a header block is arriving for */
+    int block_flags;      /* of the HEADERS frame that began it */
+    size_t block_len;
+    const char *expect;   /* preface bytes still to come */
+    size_t expect_len;
+    size_t in_len;
+    size_t out_len;
+    size_t out_off;       /* sent so far of out */
+    unsigned char in[H2_FRAME + 9 + HEAD_MAX];
+    unsigned char out[H2_OUT];
+    unsigned char block[H2_BLOCK];
+    char name[HEAD_MAX];  /* scratch for hpack_decode() */
+    char value[HEAD_MAX];
+    char path[HEAD_MAX];
+    char lines[HEAD_MAX];
+};
+
+/* Bounded lock-free MPMC queue of accepted sockets (Vyukov's array
+ * queue).  Each cell carries a sequence number that tells producers and
+ * consumers whether it is free for the lap they are on; the semaphore
+ * counts published sockets so idle workers can sleep. */
+struct sockq_cell {
+    atomic_size_t seq;
+    int fd;
+};
+
+struct sockq {
+    struct sockq_cell *cells;
+    size_t mask;
+    atomic_size_t enqueue_pos;
+    atomic_size_t dequeue_pos;
+    sem_t items;
+};
+
+/* One acceptor of the sharded models: its own listener, CPU and loop */
+struct shard {
+    int sock;
+    int cpu;
+    void (*loop)(int);
+};
+
+/* Restarts without dropping a connection, on SIGQUIT: the server forks
+ * and execs its binary afresh, with the listening sockets as descriptors
+ * 3 and up, their number in RESTART_ENV, and the write end of a pipe
+ * right after them.  The new server takes those sockets over instead of
+ * binding its own and writes a byte to the pipe once it is about to
+ * accept.  Only then does the old one stop accepting; the sockets stay
+ * open in the new server, so whatever is in their queues is accepted
+ * there.  The old server then drains: responses go out with
+ * "Connection: close", and it exits once its connections are gone or
+ * after -D seconds. */
+#define RESTART_ENV  "HTTPD_LISTEN_FDS"
+#define RESTART_WAIT 60     /* seconds the new server may take to start */
+
+/* A raw io_uring: the mmap()ed submission and completion rings.  Every
+ * conn has at most one operation in flight, so the user_data of an SQE
+ * is the conn pointer with the operation kept in its low bits (calloc
+ * returns 16-byte aligned memory). */
+#define URING_ENTRIES 256
+#define URING_ACCEPTS 8     /* accept SQEs kept in flight per ring */
+#define URING_ACCEPT  0
+#define URING_RECV    1
+#define URING_SEND    2
+#define URING_READ    3
+#define URING_TICK    4     /* timeout that runs the timer wheel */
+#define URING_WRITEV  5     /* a cached response */
+#define URING_CANCEL  6     /* of the accepts, once the server drains */
+#define URING_OPMASK  7
+
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned pending;       /* SQEs queued since the last submit */
+};
+
 void accept_request(void *);
+void acceptor_add(void);
+void acceptor_stop(void);
+int accepts_encoding(const char *, const char *);
+void access_log(const struct request *);
 void bad_request(int);
-void cat(int, FILE *);
+const char *cache_connection(const struct request *);
+void cache_evict(struct cache_entry *);
+struct cache_entry *cache_get(const struct request *, int *);
+struct cache_entry *cache_load(const struct request *);
+void cache_put(struct cache_entry *);
+int cat(int, int, off_t *, off_t);
 void cannot_execute(int);
+int cgi_body(int, const struct request *, int);
+int cgi_chunk(struct cgi_out *, const char *, size_t);
+int cgi_env(const struct request *, char *, size_t, char **);
+void cgi_exec(char *, char **);
+int cgi_finish(struct cgi_out *, int);
+int cgi_head(struct cgi_out *, size_t);
+void cgi_out_init(struct cgi_out *, int, const struct request *);
+int cgi_splice(struct cgi_out *, int);
+void cgi_thread(void *);
+int cgi_wait(int);
+int cgi_write(struct cgi_out *, const char *, size_t);
+void check_conditions(struct request *);
+void conn_close(struct conn *);
+int conn_dispatch(struct conn *);
+void conn_expire(struct timer *);
+int conn_finish(struct conn *);
+int conn_head_done(struct conn *);
+int conn_iov(struct conn *);
+int conn_next_part(struct conn *);
+int conn_pace(struct conn *, size_t *);
+int conn_prepare(struct conn *);
+void conn_read(struct conn *);
+void conn_start_cgi(struct conn *);
+void conn_start_h2(struct conn *);
+void conn_timer(struct conn *);
+int conn_write(struct conn *);
+int conn_write_entry(struct conn *);
+const char *connection_line(int);
+const char *content_type(const char *);
+uint64_t drain_count(void);
+void drain_wake(int);
 void error_die(const char *);
-void execute_cgi(int, const char *, const char *, const char *);
-int get_line(int, char *, int);
-void headers(int, const char *);
+void error_pages_init(void);
+int etag_match(const char *, const char *, int);
+int execute_cgi(int, struct request *);
+int execute_fcgi(int, struct request *);
+int fcgi_connect(const char *);
+int fcgi_record(int, int, const void *, size_t);
+int fcgi_spawn(struct fcgi_app *);
+void fcgi_stop(void);
+int fcgi_try(struct fcgi_app *);
+void file_cache_init(void);
+void file_evict(struct file_entry *);
+struct file_entry *file_get(const char *);
+void file_put(struct file_entry *);
+struct file_entry *file_resolve(const char *);
+int file_valid(const struct file_entry *);
+int format_entity(char *, size_t, const struct request *);
+size_t format_error(char *, size_t, int, int);
+void format_etag(char *, const struct request *);
+int format_headers(char *, size_t, const struct request *);
+int format_part(char *, size_t, const struct request *, int);
+size_t format_stats(char *, size_t, int);
+void guard_arm(struct guard *, int, int);
+void guard_cancel(struct guard *);
+void guard_expire(struct timer *);
+void guard_start(void);
+void guard_thread(void *);
+int h2_base64(const char *, unsigned char *, size_t);
+int h2_block(struct h2_conn *, int, const unsigned char *, size_t);
+void h2_close(struct h2_conn *, struct h2_stream *, int);
+int h2_data(struct h2_conn *, uint32_t, int, size_t);
+void h2_end(struct h2_conn *, struct h2_stream *);
+void h2_error(struct h2_conn *, struct h2_stream *, int);
+struct h2_stream *h2_find(struct h2_conn *, uint32_t);
+int h2_flush(struct h2_conn *);
+int h2_frame(struct h2_conn *, int, int, uint32_t, const unsigned char *,
+        size_t);
+uint32_t h2_get32(const unsigned char *);
+int h2_goaway(struct h2_conn *, int);
+int h2_input(struct h2_conn *);
+struct h2_stream *h2_open(struct h2_conn *, uint32_t);
+int h2_preface(const char *, size_t);
+int h2_pump(struct h2_conn *);
+void h2_put32(unsigned char *, uint32_t);
+void h2_queue(struct h2_conn *, int, int, uint32_t, const void *, size_t);
+void h2_reply(struct h2_conn *, struct h2_stream *, const char *, size_t);
+int h2_request(struct h2_conn *, uint32_t, int);
+void h2_reset(struct h2_conn *, uint32_t, int);
+void h2_respond(struct h2_conn *, struct h2_stream *);
+size_t h2_room(struct h2_conn *);
+void h2_serve(int, in_addr_t, const struct request *, const char *, size_t);
+int h2_settings(struct h2_conn *, const unsigned char *, size_t);
+void h2_thread(void *);
+int h2_upgrade(const struct request *);
+size_t head_length(const char *, size_t, size_t *);
+int headers(int, const struct request *);
+void hist_add(struct hist *, uint64_t);
+int hist_bucket(uint64_t);
+uint64_t hist_percentile(const struct hist_total *, double);
+uint64_t hist_value(int);
+int hpack_add(struct hpack_table *, const char *, const char *);
+void hpack_clear(struct hpack_table *);
+int hpack_decode(struct h2_conn *, char *, size_t, size_t *);
+size_t hpack_encode(struct h2_conn *, unsigned char *, const char *,
+        const char *);
+int hpack_huffman(const unsigned char *, size_t, char *, size_t);
+void hpack_init(void);
+int hpack_int(const unsigned char **, const unsigned char *, int,
+        uint32_t *);
+int hpack_lookup(const struct hpack_table *, uint32_t, const char **,
+        const char **);
+size_t hpack_put_int(unsigned char *, int, int, uint32_t);
+void hpack_resize(struct hpack_table *, size_t);
+int hpack_string(const unsigned char **, const unsigned char *, char *,
+        size_t);
+size_t html_escape(char *, const char *);
+int iov_clamp(struct iovec *, int, size_t, size_t *);
+size_t iov_length(const struct iovec *, int);
+int ip_admit(int, in_addr_t *);
+void ip_release(in_addr_t);
+void linger_close(int);
+void linger_start(void);
+void linger_thread(void *);
+void listen_inherit(void);
+void listen_ready(void);
+int listen_take(u_short *);
+int listing_make(struct file_entry *);
+void listing_pick(struct request *);
+struct cache_entry *listing_render(const char *, const struct stat *,
+        struct dirent **, const struct stat *, int, int);
+size_t log_drain(struct log_ring *, char *, size_t *);
+size_t log_escape(char *, const char *);
+void log_open(const char *);
+void log_retire(void *);
+struct log_ring *log_self(void);
+void log_start(const char *);
+void log_sync(void);
+void log_thread(void *);
+uint64_t monotonic_usec(void);
 void not_found(int);
-void serve_file(int, const char *);
-int startup(u_short *);
+void parse_header(struct request *, char *);
+time_t parse_http_date(const char *);
+void parse_ranges(struct request *);
+int parse_request(struct request *, char *, size_t);
+int parse_request_line(struct request *, char *);
+void pick_encoding(struct request *);
+void pool_worker(void *);
+int query_param(const char *, const char *);
+int rate_option(struct rate_limit *, const char *, int);
+uint64_t rate_pace(in_addr_t, size_t *);
+int rate_request(in_addr_t);
+struct rate_slot *rate_slot(const struct rate_limit *, in_addr_t, uint64_t);
+void rate_wait(size_t *);
+int read_full(int, void *, size_t);
+ssize_t recv_head(int, char *, size_t, size_t *, struct guard *);
+void request_release(struct request *);
+void request_too_large(int);
+int response_status(const struct request *);
+void restart(sigset_t *);
+void restart_drain(sigset_t *);
+void restart_exec(const char *, char **, char **, int);
+int restart_path(char *, size_t);
+int route_request(struct request *);
+void run_epoll(int);
+void run_pool(int, int, size_t);
+void run_shards(int, u_short, int, void (*)(int));
+void run_threads(int);
+void run_uring(int);
+int send_error(int, int, int);
+int send_iov(int, struct iovec *, int);
+int send_stats(int, struct request *);
+off_t serve_file(int, struct request *);
+void service_unavailable(int);
+int set_nonblocking(int);
+void shard_thread(void *);
+void signal_thread(void *);
+struct snapshot *snap_get(void);
+uint64_t snap_hash(const char *, size_t, uint64_t);
+int snap_index(struct snap_builder *);
+struct snapshot *snap_load(const char *);
+const struct snap_entry *snap_lookup(const struct snapshot *, const char *);
+int snap_order(const void *, const void *);
+int snap_pack(const char *);
+int snap_pack_dir(struct snap_builder *, const char *, const char *);
+int snap_pack_file(struct snap_builder *, const char *, const char *);
+void snap_put(struct snapshot *);
+int snap_reload(const char *);
+int snap_route(struct request *);
+int sockq_init(struct sockq *, size_t);
+int sockq_pop(struct sockq *);
+int sockq_push(struct sockq *, int);
+char *split_line(char *, char *);
+int startup(u_short *, int, int);
+void stat_add(_Atomic uint64_t *, uint64_t);
+int stats_class(const struct request *);
+void stats_init(void);
+void stats_record(const struct request *);
+size_t stats_response(char *, size_t, const struct request *);
+void stats_retire(void *);
+struct stats *stats_self(void);
+size_t stats_series(char *, size_t, const char *, const char *, int, int);
+void stats_total(int, struct hist_total *);
+void timer_arm(struct wheel *, struct timer *, uint64_t);
+void timer_cancel(struct wheel *, struct timer *);
+#ifdef TRACE
+void trace_begin(void);
+void trace_dump(const char *);
+void trace_end(const struct request *);
+void trace_mark(int);
+#endif
 void unimplemented(int);
+void uring_complete(struct uring *, int, uint64_t, int);
+int uring_enter(struct uring *, unsigned);
+void uring_expire(struct timer *);
+int uring_init(struct uring *, unsigned);
+void uring_prep(struct uring *, int, int, void *, unsigned, off_t, uint64_t);
+void uring_request(struct uring *, struct conn *);
+void uring_send(struct uring *, struct conn *);
+int url_decode(char *);
+size_t url_escape(char *, const char *);
+int url_safe(const char *);
+struct dir_watch *watch_dir(const char *);
+void watch_thread(void *);
+void wheel_init(struct wheel *);
+void wheel_run(struct wheel *, void (*)(struct timer *));
+uint64_t wheel_tick(void);
+int write_full(int, const void *, size_t);
+void zip_evict(struct cache_entry *);
+struct cache_entry *zip_get(const struct request *, const char *);
+int zip_make(struct zip_job *, char **, size_t *, size_t *);
+void zip_pick(struct request *);
+void zip_start(void);
+void zip_thread(void *);
+int zip_type(const char *);
+
+static __thread int epoll_fd = -1;  /* per thread: shards run own loops */
+static int keepalive_timeout = 5;   /* seconds a connection may sit idle */
+static int keepalive_max = 100;     /* requests served per connection */
+static int linger_epoll = -1;       /* of linger_thread(), -1: not running */
+static int linger_fds[LINGER_MAX];  /* in deadline order, -1 once closed */
+static time_t linger_until[LINGER_MAX];
+static unsigned linger_head, linger_count;
+static pthread_mutex_t linger_lock = PTHREAD_MUTEX_INITIALIZER;
+static int request_timeout = 10;    /* seconds to receive a request head */
+static int io_timeout = 30;         /* seconds a body read or send may stall */
+static int ip_max = 64;             /* connections per client address */
+
+static __thread struct wheel *conn_wheel;   /* of the thread's event loop */
+static __thread struct uring *conn_ring;    /* of a run_uring() thread */
+static struct wheel guard_wheel;
+static pthread_mutex_t guard_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ip_count *ip_table[1 << IP_BITS];
+static pthread_mutex_t ip_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic uint64_t conn_timeouts;     /* closed by a deadline */
+static _Atomic uint64_t conn_refused;      /* over the -i cap */
+
+static char **restart_argv;         /* what the server was started with */
+static int drain_timeout = 300;     /* -D: seconds to finish up after one */
+static atomic_int draining;         /* the restarted server has taken over */
+static pthread_t acceptors[CPU_SETSIZE + 1];
+static int nacceptors;
+static atomic_int acceptors_stopped;
+static pthread_mutex_t acceptor_lock = PTHREAD_MUTEX_INITIALIZER;
+static int inherit_next = -1;       /* listeners handed over by the old */
+static int inherit_end = -1;        /* server, see listen_take() */
+static int ready_fd = -1;           /* tell it we are up, see listen_ready() */
+
+static struct rate_limit rate_limits[RATE_LIMITS];
+static int rate_count;                      /* limits in use */
+static struct rate_slot rate_table[RATE_SLOTS];
+static __thread in_addr_t rate_peer;        /* client of a blocking thread */
+static _Atomic uint64_t rate_limited;       /* requests answered with 429 */
+static _Atomic uint64_t rate_paced;         /* sends held back */
+
+static _Atomic uint64_t h2_conns;           /* h2c connections taken */
+static _Atomic uint64_t h2_streams;         /* streams opened on them */
+static pthread_once_t hpack_once = PTHREAD_ONCE_INIT;
+static uint32_t hpack_first[31];    /* the Huffman code, by code length: */
+static int hpack_count[31];         /* see hpack_init() */
+static int hpack_offset[31];
+static short hpack_sorted[257];
+
+static size_t cache_limit = 32 << 20;   /* bytes of file data cached */
+static size_t cache_bytes;
+static unsigned long long cache_hits, cache_misses;
+static struct cache_entry *cache_table[CACHE_BUCKETS];
+static struct cache_entry cache_lru =
+    { .prev = &cache_lru, .next = &cache_lru };
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t file_max = FILE_MAX;     /* url cache entries, 0: off */
+static size_t file_count;
+static unsigned long long file_hits, file_misses;
+static struct file_entry *file_table[FILE_BUCKETS];
+static struct file_entry file_lru = { .prev = &file_lru, .next = &file_lru };
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t zip_limit = 16 << 20;    /* -z: bytes of variants kept */
+static int zip_workers = 2;            /* -Z */
+static size_t zip_bytes;
+static int zip_queued;
+static struct cache_entry *zip_table[ZIP_BUCKETS];
+static struct cache_entry zip_lru = { .prev = &zip_lru, .next = &zip_lru };
+static struct zip_job *zip_jobs, **zip_tail = &zip_jobs;
+static pthread_mutex_t zip_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t zip_wake = PTHREAD_COND_INITIALIZER;
+static _Atomic uint64_t zip_files;     /* variants made */
+static _Atomic uint64_t zip_hits;      /* responses sent from them */
+static _Atomic uint64_t zip_in;        /* bytes compressed */
+static _Atomic uint64_t zip_out;       /* bytes they came out as */
+static _Atomic uint64_t zip_cpu;       /* ns of CPU time it took */
+static atomic_uint file_gen;    /* bumped when every entry must go */
+static int inotify_fd = -1;
+static struct dir_watch *watches;
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Precompressed siblings, in order of preference */
+static const char *codings[][2] = {
+    { ".br", "br" },
+    { ".gz", "gzip" },
+};
+
+/* Content-Type of a directory listing, by listing_pick()'s format */
+static const char *listing_types[2] = {
+    "text/html; charset=utf-8",
+    "application/json",
+};
+
+static const char *snap_path;          /* -S: the image to serve from */
+static struct snapshot *_Atomic snap;   /* the image mapped from it */
+
+static struct stats stats_retired;     /* threads that have exited */
+static struct stats *stats_list = &stats_retired;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;        /* retires a thread's stats */
+static __thread struct stats *stats_mine;
+static const int stat_codes[STAT_CODES - 1] = {
+    200, 206, 302, 304, 400, 404, 416, 429, 500
+};
+static int listeners[CPU_SETSIZE];     /* for the accept queue depth */
+static int nlisteners;
+static struct sockq *pool_queue;
+
+static const char *log_path;           /* -l: the access log, or NULL */
+static int log_fd = -1;                /* written by log_thread() only */
+static struct log_ring *log_rings;     /* of live threads, and of dead
+                                        * ones until they are drained */
+static struct log_ring *log_free;      /* drained, for new threads */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t log_key;          /* marks a thread's ring dead */
+static __thread struct log_ring *log_mine;
+static atomic_int log_reopen;          /* set by SIGUSR2 */
+static _Atomic uint64_t log_dropped;   /* reported so far */
+static _Atomic uint64_t log_passes;    /* by log_thread(), for log_sync() */
+
+#ifdef TRACE
+static unsigned trace_every = 100;     /* -x: sample one request in so many */
+static const char *trace_path = "httpd-trace.json";  /* -X */
+static _Atomic uint64_t trace_count;   /* requests begun */
+static _Atomic uint64_t trace_next;    /* records written to trace_ring */
+static struct trace_slot trace_ring[TRACE_RING];
+static __thread struct trace_record trace_rec;
+static __thread struct trace_record *trace_cur;    /* &trace_rec while
+                                                    * sampled, or NULL */
+static const char *trace_names[TRACE_PHASES] = {
+    [TRACE_FIRST_BYTE] = "wait", [TRACE_PARSED] = "head",
+    [TRACE_RESOLVED] = "resolve", [TRACE_OPENED] = "open",
+    [TRACE_FIRST_SEND] = "prepare", [TRACE_LAST_SEND] = "send",
+};
+#endif
+
+static int fcgi_workers;    /* processes per .fcgi program, 0: plain CGI */
+static struct fcgi_app *fcgi_apps;
+static pthread_mutex_t fcgi_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct error_page error_pages[] = {
+    [ERR_BAD_REQUEST] = { .status = "400 Bad Request", .extra = "",
+        .title = "Bad Request",
+        .text = "Your browser sent a bad request, "
+            "such as a POST without a Content-Length." },
+    [ERR_NOT_FOUND] = { .status = "404 Not Found", .extra = "",
+        .title = "Not Found",
+        .text = "The server could not fulfill your request because the "
+            "resource specified is unavailable or nonexistent." },
+    [ERR_TOO_LARGE] = { .status = "431 Request Header Fields Too Large",
+        .extra = "", .title = "Request Too Large",
+        .text = "The request head is too long." },
+    [ERR_INTERNAL] = { .status = "500 Internal Server Error", .extra = "",
+        .title = "Internal Server Error",
+        .text = "Error prohibited CGI execution." },
+    [ERR_UNIMPLEMENTED] = { .status = "501 Method Not Implemented",
+        .extra = "", .title = "Method Not Implemented",
+        .text = "HTTP request method not supported." },
+    [ERR_UNAVAILABLE] = { .status = "503 Service Unavailable",
+        .extra = "Retry-After: 1\r\n", .title = "Service Unavailable",
+        .text = "The server is too busy, try again later." },
+    [ERR_LIMITED] = { .status = "429 Too Many Requests",
+        .extra = "Retry-After: 1\r\n", .title = "Too Many Requests",
+        .text = "You are sending requests faster than this server "
+            "allows, try again later." },
+};
+
+/* The HPACK static table (RFC 7541 Appendix A); index 1 is the first */
+static const char *hpack_static[61][2] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" }
+};
+
+/* The bit lengths of the HPACK Huffman code of each byte and of EOS
+ * (RFC 7541 Appendix B).  The code is canonical, so they define it. */
+static const unsigned char hpack_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
 
 /**********************************************************************/
 /* A request has caused a call to accept() on the server port to
- * return.  Process the request appropriately.
+ * return.  Process the request appropriately, and keep doing so for
+ * as long as the client keeps the connection alive.
  * Parameters: the socket connected to the client */
 /**********************************************************************/
-void accept_request(void *arg)
+void accept_request(void *arg)
+{
+    int client = (intptr_t)arg;
+    char buf[HEAD_MAX];
+    size_t len = 0;
+    ssize_t head;
+    struct request req;
+    struct guard guard = { .fd = client };
+    struct timeval tv;
+    in_addr_t peer;
+    int served = 0;
+
+    if (ip_admit(client, &peer) == -1)
+    {
+        service_unavailable(client);
+        linger_close(client);
+        return;
+    }
+    rate_peer = peer;
+    /* stalls while reading a body or sending are left to the kernel;
+     * the deadlines for request heads need the guard */
+    tv.tv_sec = io_timeout;
+    tv.tv_usec = 0;
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (stats_self() != NULL)
+        stat_add(&stats_mine->accepted, 1);
+    guard_arm(&guard, TIMING_HEAD, request_timeout);
+
+    do
+    {
+        TRACE_BEGIN();
+        head = recv_head(client, buf, sizeof(buf), &len, &guard);
+        guard_cancel(&guard);
+        if (head == 0)  /* closed, or past its deadline */
+            break;
+        if (head == -1)
+        {
+            request_too_large(client);
+            break;
+        }
+        if (h2_preface(buf, head))
+        {
+            h2_serve(client, peer, NULL, buf + head, len - head);
+            break;
+        }
+        if (parse_request(&req, buf, head) < 0)
+        {
+            unimplemented(client);
+            break;
+        }
+        TRACE_MARK(TRACE_PARSED);
+        if (h2_upgrade(&req))
+        {
+            h2_serve(client, peer, &req, buf + head, len - head);
+            break;
+        }
+        req.body = buf + head;
+        req.body_len = len - head;
+        req.start = monotonic_usec();
+        req.peer = peer;
+        if (++served >= keepalive_max || req.content_length > 0 ||
+                atomic_load(&draining))
+            req.keep_alive = 0;
+
+        switch (route_request(&req))
+        {
+            case ROUTE_NOT_FOUND:
+                req.status = 404;
+                req.sent = send_error(client, ERR_NOT_FOUND, req.keep_alive);
+                break;
+            case ROUTE_FILE:
+                req.status = response_status(&req);
+                req.sent = serve_file(client, &req);
+                break;
+            case ROUTE_CGI:
+                if (execute_cgi(client, &req) == -1)
+                    req.keep_alive = 0;
+                break;
+            case ROUTE_STATS:
+                req.sent = send_stats(client, &req);
+                break;
+            case ROUTE_LIMITED:
+                req.status = 429;
+                req.sent = send_error(client, ERR_LIMITED, req.keep_alive);
+                break;
+        }
+        TRACE_MARK(TRACE_LAST_SEND);
+        if (req.sent == -1)
+        {
+            req.sent = 0;
+            req.keep_alive = 0;
+        }
+        stats_record(&req);
+        access_log(&req);
+        TRACE_END(&req);
+        request_release(&req);
+        /* keep whatever the client pipelined behind this request */
+        len -= head;
+        memmove(buf, buf + head, len);
+        if (req.keep_alive)
+            guard_arm(&guard, len > 0 ? TIMING_HEAD : TIMING_IDLE,
+                    len > 0 ? request_timeout : keepalive_timeout);
+    } while (req.keep_alive);
+
+    TRACE_DROP();
+    guard_cancel(&guard);
+    ip_release(peer);
+    rate_peer = INADDR_ANY;
+    if (stats_mine != NULL)
+        stat_add(&stats_mine->closed, 1);
+    linger_close(client);
+}
+
+/**********************************************************************/
+/* Register the calling thread as one that accepts connections, so that
+ * restart_drain() can wake it to stop. */
+/**********************************************************************/
+void acceptor_add(void)
+{
+    pthread_mutex_lock(&acceptor_lock);
+    if (nacceptors < CPU_SETSIZE + 1)
+        acceptors[nacceptors++] = pthread_self();
+    pthread_mutex_unlock(&acceptor_lock);
+}
+
+/**********************************************************************/
+/* An acceptor has seen the server draining and accepts nothing more
+ * from now on: count it, so the drain knows when no connection can
+ * come in any longer. */
+/**********************************************************************/
+void acceptor_stop(void)
+{
+    atomic_fetch_add(&acceptors_stopped, 1);
+}
+
+/**********************************************************************/
+/* Check whether an Accept-Encoding header allows a content coding.
+ * Codings listed with q=0 count as refused.
+ * Parameters: the value of the header
+ *             the coding, such as "gzip"
+ * Returns: true if the coding is acceptable */
+/**********************************************************************/
+int accepts_encoding(const char *header, const char *name)
+{
+    size_t len = strlen(name);
+    const char *p = header;
+    const char *q;
+
+    while (*p != '\0')
+    {
+        while (ISspace(*p) || *p == ',')
+            p++;
+        if (strncasecmp(p, name, len) == 0 &&
+                (p[len] == '\0' || p[len] == ',' || p[len] == ';' ||
+                 ISspace(p[len])))
+        {
+            q = strchr(p, ',');
+            p = strstr(p, "q=");
+            if (p == NULL || (q != NULL && p > q))
+                return(1);
+            return(strtod(p + 2, NULL) > 0);
+        }
+        p = strchr(p, ',');
+        if (p == NULL)
+            break;
+    }
+    return(0);
+}
+
+/**********************************************************************/
+/* Push the access log record of a request whose response is out (or
+ * was cut short) onto the calling thread's ring.  This never blocks:
+ * with the ring full, the record is dropped and counted.
+ * Parameter: the request, with its start, status, sent and from */
+/**********************************************************************/
+void access_log(const struct request *req)
+{
+    struct log_ring *r;
+    struct log_record *rec;
+    size_t head;
+
+    if (log_path == NULL || (r = log_self()) == NULL)
+        return;
+    head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&r->tail, memory_order_acquire) ==
+            LOG_RING)
+    {
+        stat_add(&r->dropped, 1);
+        return;
+    }
+    rec = &r->recs[head & (LOG_RING - 1)];
+    clock_gettime(CLOCK_REALTIME, &rec->when);
+    rec->usec = monotonic_usec() - req->start;
+    rec->bytes = req->sent;
+    rec->status = req->status;
+    rec->from = req->from;
+    snprintf(rec->method, sizeof(rec->method), "%s", req->method);
+    snprintf(rec->range, sizeof(rec->range), "%s", req->range);
+    snprintf(rec->path, sizeof(rec->path), "%s", req->url);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+/**********************************************************************/
+/* Inform the client that a request it has made has a problem.
+ * Parameters: client socket */
+/**********************************************************************/
+void bad_request(int client)
+{
+    send_error(client, ERR_BAD_REQUEST, 0);
+}
+
+/**********************************************************************/
+/* The end of the headers of a cached response: the Connection line
+ * and the blank line, which depend on the request rather than the file.
+ * Parameter: the request
+ * Returns: a static string */
+/**********************************************************************/
+const char *cache_connection(const struct request *req)
+{
+    return(connection_line(req->keep_alive));
+}
+
+/**********************************************************************/
+/* Take an entry out of the hash table and the LRU list and drop the
+ * table's reference to it.  Call with cache_lock held.
+ * Parameter: the entry */
+/**********************************************************************/
+void cache_evict(struct cache_entry *e)
+{
+    struct cache_entry **pp;
+
+    for (pp = &cache_table[e->hash]; *pp != e; pp = &(*pp)->hnext)
+        ;
+    *pp = e->hnext;
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    cache_bytes -= e->size;
+    cache_put(e);
+}
+
+/**********************************************************************/
+/* Look a file up in the hot-file cache, loading it on a miss.  An
+ * entry whose validators no longer match the stat of the request is
+ * dropped and loaded again.
+ * Parameters: the request, with the path and stat of the file
+ *             set to true if the entry was in the cache already
+ * Returns: a referenced entry, to be released with cache_put(), or
+ *          NULL if the file is not cacheable */
+/**********************************************************************/
+struct cache_entry *cache_get(const struct request *req, int *hit)
+{
+    struct cache_entry *e, *old;
+    unsigned h = 2166136261u;   /* FNV-1a */
+    const char *p;
+
+    *hit = 0;
+    if (cache_limit == 0 || req->st.st_size > CACHE_MAX_FILE ||
+            (size_t)req->st.st_size > cache_limit)
+        return(NULL);
+    for (p = req->path; *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    h %= CACHE_BUCKETS;
+
+    pthread_mutex_lock(&cache_lock);
+    for (e = cache_table[h]; e != NULL; e = e->hnext)
+        if (strcmp(e->path, req->path) == 0)
+            break;
+    if (e != NULL && e->ino == req->st.st_ino && e->dev == req->st.st_dev &&
+            e->size == req->st.st_size &&
+            e->mtime.tv_sec == req->st.st_mtim.tv_sec &&
+            e->mtime.tv_nsec == req->st.st_mtim.tv_nsec)
+    {
+        cache_hits++;
+        *hit = 1;
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+    }
+    else
+    {
+        cache_misses++;
+        pthread_mutex_unlock(&cache_lock);
+        e = cache_load(req);
+        if (e == NULL)
+            return(NULL);
+        pthread_mutex_lock(&cache_lock);
+        for (old = cache_table[h]; old != NULL; old = old->hnext)
+            if (strcmp(old->path, req->path) == 0)
+                break;
+        if (old != NULL)
+            cache_evict(old);
+        while (cache_bytes + e->size > cache_limit)
+            cache_evict(cache_lru.prev);
+        e->hash = h;
+        e->hnext = cache_table[h];
+        cache_table[h] = e;
+        cache_bytes += e->size;
+        atomic_init(&e->refs, 1);   /* the table's reference */
+    }
+    e->next = cache_lru.next;
+    e->prev = &cache_lru;
+    cache_lru.next->prev = e;
+    cache_lru.next = e;
+    atomic_fetch_add(&e->refs, 1);
+    pthread_mutex_unlock(&cache_lock);
+    return(e);
+}
+
+/**********************************************************************/
+/* Read a file into a new cache entry and render its headers.  The
+ * validators come from the open descriptor so they match the bytes.
+ * Parameter: the request, with the path and descriptor of the file
+ * Returns: an unreferenced, unlinked entry, or NULL on error */
+/**********************************************************************/
+struct cache_entry *cache_load(const struct request *req)
+{
+    struct cache_entry *e;
+    struct request hdr;
+    char buf[1024];
+    struct stat st;
+    ssize_t n;
+    off_t got = 0;
+    int fd = req->fd;
+
+    if (fstat(fd, &st) == -1 || st.st_size > CACHE_MAX_FILE)
+        return(NULL);
+    hdr = *req;
+    hdr.st = st;
+    hdr.nranges = 0;
+    hdr.length = st.st_size;
+
+    e = calloc(1, sizeof(*e));
+    if (e != NULL)
+    {
+        e->hdr_len = format_entity(buf, sizeof(buf), &hdr);
+        e->path = strdup(req->path);
+        e->data = malloc(e->hdr_len + st.st_size);
+    }
+    if (e == NULL || e->path == NULL || e->data == NULL)
+        goto fail;
+    memcpy(e->data, buf, e->hdr_len);
+    while (got < st.st_size)
+    {
+        n = pread(fd, e->data + e->hdr_len + got, st.st_size - got, got);
+        if (n <= 0)
+            goto fail;
+        got += n;
+    }
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->size = st.st_size;
+    e->mtime = st.st_mtim;
+    return(e);
+
+fail:
+    if (e != NULL)
+    {
+        free(e->path);
+        free(e->data);
+        free(e);
+    }
+    return(NULL);
+}
+
+/**********************************************************************/
+/* Drop a reference to a cache entry, freeing it with the last one.
+ * Parameter: the entry */
+/**********************************************************************/
+void cache_put(struct cache_entry *e)
+{
+    if (atomic_fetch_sub(&e->refs, 1) == 1)
+    {
+        free(e->path);
+        free(e->data);
+        free(e);
+    }
+}
+
+/**********************************************************************/
+/* Put the entire contents of a file out on a socket.  This function
+ * is named after the UNIX "cat" command, because it might have been
+ * easier just to do something like pipe, fork, and exec("cat").
+ * The bytes go from the page cache to the socket with sendfile(), or
+ * through a pipe with splice() where sendfile() is not supported, so
+ * they never pass through user space and binary files stay intact.
+ * The socket is non-blocking for the duration and we poll() between
+ * writes: a blocking sendfile() only honours SO_SNDTIMEO on its first
+ * wait, so a reader that stops draining could otherwise hold the
+ * thread for as long as it likes.  -T bounds each wait instead.  A
+ * client over a -r/-R byte rate is paced by sleeping between chunks.
+ * Parameters: the client socket descriptor
+ *             the descriptor of the file to cat
+ *             in/out offset of the next byte to send
+ *             the number of bytes to send
+ * Returns: 0 when everything was sent, -1 on error or timeout */
+/**********************************************************************/
+int cat(int client, int fd, off_t *offset, off_t count)
+{
+    struct pollfd pfd;
+    int pipefd[2] = {-1, -1};
+    int flags;
+    size_t chunk;
+    ssize_t n, m = 0;
+
+    flags = fcntl(client, F_GETFL);
+    if (flags == -1 || fcntl(client, F_SETFL, flags | O_NONBLOCK) == -1)
+        return(-1);
+    pfd.fd = client;
+    pfd.events = POLLOUT;
+
+    while (count > 0)
+    {
+        chunk = count;
+        rate_wait(&chunk);
+        n = sendfile(client, fd, offset, chunk);
+        if (n > 0)
+            count -= n;
+        else if (n == 0)
+            goto out;     /* file shrank under us */
+        else if (errno == EINTR)
+            continue;
+        else if (errno == EAGAIN)
+        {
+            if (poll(&pfd, 1, io_timeout * 1000) <= 0)
+                goto out;
+        }
+        else if (errno == EINVAL || errno == ENOSYS)
+            break;
+        else
+            goto out;
+    }
+    if (count == 0 || pipe(pipefd) == -1)
+        goto out;
+    while (count > 0 && m >= 0)
+    {
+        chunk = count;
+        rate_wait(&chunk);
+        n = splice(fd, offset, pipefd[1], NULL, chunk, SPLICE_F_MOVE);
+        if (n <= 0)
+            break;
+        count -= n;
+        while (n > 0)
+        {
+            m = splice(pipefd[0], NULL, client, NULL, n,
+                    SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m > 0)
+                n -= m;
+            else if (m == -1 && errno == EAGAIN &&
+                    poll(&pfd, 1, io_timeout * 1000) > 0)
+                continue;
+            else
+            {
+                m = -1;
+                break;
+            }
+        }
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+out:
+    fcntl(client, F_SETFL, flags);
+    return(count == 0 && m >= 0 ? 0 : -1);
+}
+
+/**********************************************************************/
+/* Inform the client that a CGI script could not be executed.
+ * Parameter: the client socket descriptor. */
+/**********************************************************************/
+void cannot_execute(int client)
+{
+    send_error(client, ERR_INTERNAL, 0);
+}
+
+/**********************************************************************/
+/* Feed the body of a POST to a CGI program: first what was read along
+ * with the request head, then the rest straight from the socket into
+ * the program's pipe with splice().
+ * Parameters: the client socket
+ *             the request
+ *             the write end of the program's standard input
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int cgi_body(int client, const struct request *req, int fd)
+{
+    size_t have = req->body_len;
+    ssize_t n;
+    off_t left;
+
+    if (req->content_length <= 0)
+        return(0);
+    if (have > (size_t)req->content_length)
+        have = req->content_length;
+    if (have > 0 && write(fd, req->body, have) != (ssize_t)have)
+        return(-1);
+    left = req->content_length - have;
+    while (left > 0)
+    {
+        n = splice(client, NULL, fd, NULL, left, SPLICE_F_MOVE);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return(-1);
+        left -= n;
+    }
+    return(0);
+}
+
+/**********************************************************************/
+/* Send a piece of the body of a CGI response, as one chunk if the
+ * response is chunked, with a single writev().
+ * Parameters: the CGI output
+ *             the bytes and how many there are
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int cgi_chunk(struct cgi_out *o, const char *data, size_t len)
+{
+    char size[32];
+    struct iovec iov[3];
+
+    if (len == 0)
+        return(0);
+    if (!o->chunked)
+    {
+        iov[0].iov_base = (char *)data;
+        iov[0].iov_len = len;
+        o->sent += len;
+        return(send_iov(o->client, iov, 1));
+    }
+    iov[0].iov_base = size;
+    iov[0].iov_len = sprintf(size, "%zx\r\n", len);
+    iov[1].iov_base = (char *)data;
+    iov[1].iov_len = len;
+    iov[2].iov_base = "\r\n";
+    iov[2].iov_len = 2;
+    o->sent += iov[0].iov_len + len + 2;
+    return(send_iov(o->client, iov, 3));
+}
+
+/**********************************************************************/
+/* Build the environment of a CGI program, which doubles as the
+ * parameters of a FastCGI request, as NAME=value strings.
+ * Parameters: the request
+ *             a buffer for the strings and its size
+ *             an array of CGI_ENV_MAX pointers to the strings
+ * Returns: the number of strings; the array is NULL terminated */
+/**********************************************************************/
+int cgi_env(const struct request *req, char *buf, size_t size, char **env)
+{
+    char length[32];
+    const char *vars[][2] = {
+        { "GATEWAY_INTERFACE", "CGI/1.1" },
+        { "SERVER_SOFTWARE", "jdbhttpd/0.1.0" },
+        { "SERVER_PROTOCOL", req->version >= 11 ? "HTTP/1.1" : "HTTP/1.0" },
+        { "REQUEST_METHOD", req->method },
+        { "SCRIPT_NAME", req->url },
+        { "SCRIPT_FILENAME", req->path },
+        { "QUERY_STRING", req->query_string ? req->query_string : "" },
+        { "CONTENT_LENGTH", req->content_length >= 0 ? length : NULL },
+        { "PATH", getenv("PATH") },
+    };
+    size_t used = 0;
+    size_t i;
+    int n = 0;
+    int len;
+
+    sprintf(length, "%d", req->content_length);
+    for (i = 0; i < sizeof(vars) / sizeof(vars[0]); i++)
+    {
+        if (vars[i][1] == NULL)
+            continue;
+        len = snprintf(buf + used, size - used, "%s=%s", vars[i][0],
+                vars[i][1]);
+        if (len < 0 || used + len >= size || n == CGI_ENV_MAX - 1)
+            break;
+        env[n++] = buf + used;
+        used += len + 1;
+    }
+    env[n] = NULL;
+    return(n);
+}
+
+/**********************************************************************/
+/* Replace a freshly forked child with a CGI or FastCGI program.  Only
+ * async-signal-safe calls are made, the parent being multithreaded.
+ * The signal dispositions and mask of the server are undone, and every
+ * descriptor above stderr is closed so the program cannot hold client
+ * connections open.
+ * Parameters: the program
+ *             its environment */
+/**********************************************************************/
+void cgi_exec(char *path, char **env)
+{
+    struct sigaction sa;
+    sigset_t none;
+    char *argv[2];
+    int fd;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
+    sigaction(SIGPIPE, &sa, NULL);
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    if (syscall(SYS_close_range, STDERR + 1, ~0U, 0) == -1)
+        for (fd = STDERR + 1; fd < 1024; fd++)
+            close(fd);
+    argv[0] = path;
+    argv[1] = NULL;
+    execve(path, argv, env);
+    _exit(127);
+}
+
+/**********************************************************************/
+/* The program has finished its output.  Terminate a chunked body, or
+ * send a 500 if the program never got as far as its headers.
+ * Parameters: the CGI output
+ *             0 if the output was relayed without error
+ * Returns: 0 if the connection may carry another request, else -1 */
+/**********************************************************************/
+int cgi_finish(struct cgi_out *o, int ret)
+{
+    if (!o->started)
+    {
+        cannot_execute(o->client);
+        return(-1);
+    }
+    if (ret == 0 && o->chunked && send(o->client, "0\r\n\r\n", 5, 0) != 5)
+        ret = -1;
+    else if (ret == 0 && o->chunked)
+        o->sent += 5;
+    return(ret == 0 && o->keep_alive ? 0 : -1);
+}
+
+/**********************************************************************/
+/* The headers a CGI program wrote are complete.  Turn them into the
+ * response head: a Status header becomes the status line, a Location
+ * without one a 302, and the server adds its own framing headers.
+ * Whatever followed the headers goes out as the start of the body.
+ * Parameters: the CGI output
+ *             the length of the program's headers in its buffer
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int cgi_head(struct cgi_out *o, size_t hlen)
+{
+    char fields[HEAD_MAX];
+    char head[HEAD_MAX + 256];
+    const char *status = NULL;
+    char *end = o->buf + hlen;
+    char *line, *next;
+    size_t flen = 0;
+    size_t len;
+    int location = 0;
+    int n;
+
+    for (line = o->buf; line < end; line = next)
+    {
+        next = split_line(line, end);
+        if (*line == '\0')
+            break;
+        if (strncasecmp(line, "Status:", 7) == 0)
+        {
+            for (status = line + 7; ISspace(*status); status++)
+                ;
+            continue;
+        }
+        if (strncasecmp(line, "Content-Length:", 15) == 0 ||
+                strncasecmp(line, "Transfer-Encoding:", 18) == 0 ||
+                strncasecmp(line, "Connection:", 11) == 0)
+            continue;   /* the server frames the body itself */
+        if (strncasecmp(line, "Location:", 9) == 0)
+            location = 1;
+        len = strlen(line);
+        if (flen + len + 2 >= sizeof(fields))
+            break;
+        memcpy(fields + flen, line, len);
+        memcpy(fields + flen + len, "\r\n", 2);
+        flen += len + 2;
+    }
+    fields[flen] = '\0';
+    if (status == NULL)
+        status = location ? "302 Found" : "200 OK";
+
+    n = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\n" SERVER_STRING "%s%s%s",
+            status, fields,
+            o->chunked ? "Transfer-Encoding: chunked\r\n" : "",
+            connection_line(o->keep_alive));
+    if (n < 0 || (size_t)n >= sizeof(head) ||
+            send(o->client, head, n, MSG_MORE) != n)
+        return(-1);
+    o->started = 1;
+    o->status = atoi(status);
+    o->sent = n;
+    return(cgi_chunk(o, o->buf + hlen, o->len - hlen));
+}
+
+/**********************************************************************/
+/* Set up the relay of a CGI program's output.  HTTP/1.1 clients get
+ * a chunked body and may keep the connection; HTTP/1.0 clients get the
+ * body up to the close of the connection.
+ * Parameters: the CGI output to set up
+ *             the client socket
+ *             the request */
+/**********************************************************************/
+void cgi_out_init(struct cgi_out *o, int client, const struct request *req)
+{
+    o->client = client;
+    o->chunked = req->version >= 11;
+    o->keep_alive = req->keep_alive && o->chunked;
+    o->started = 0;
+    o->status = 500;
+    o->sent = 0;
+    o->len = 0;
+    o->scan = 0;
+}
+
+/**********************************************************************/
+/* Relay the rest of a CGI program's output, once its headers have
+ * been dealt with, from the pipe to the socket with splice() so the
+ * body never passes through user space.  Whatever is in the pipe when
+ * it becomes readable is sent as one chunk.
+ * Parameters: the CGI output
+ *             the read end of the program's standard output
+ * Returns: 0 when the program closed its output, -1 on error or when
+ *          it stalled for longer than -T */
+/**********************************************************************/
+int cgi_splice(struct cgi_out *o, int fd)
+{
+    char size[32];
+    int avail;
+    int len;
+    ssize_t n;
+
+    while (1)
+    {
+        if (cgi_wait(fd) == -1)
+            return(-1);
+        if (ioctl(fd, FIONREAD, &avail) == -1)
+            return(-1);
+        if (avail == 0)
+            return(0);  /* hung up with nothing left */
+        if (o->chunked)
+        {
+            len = sprintf(size, "%x\r\n", avail);
+            if (send(o->client, size, len, MSG_MORE) != len)
+                return(-1);
+            o->sent += len + 2;
+        }
+        while (avail > 0)
+        {
+            n = splice(fd, NULL, o->client, NULL, avail,
+                    SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return(-1);
+            avail -= n;
+            o->sent += n;
+        }
+        if (o->chunked && send(o->client, "\r\n", 2, MSG_MORE) != 2)
+            return(-1);
+    }
+}
+
+/**********************************************************************/
+/* Thread body for a CGI request handed off by the epoll loop.  CGI
+ * scripts run under blocking I/O, so the connection leaves the event
+ * loop for good and is closed here.
+ * Parameter: the struct conn of the connection */
+/**********************************************************************/
+void cgi_thread(void *arg)
+{
+    struct conn *c = arg;
+
+    c->req.keep_alive = 0;
+    execute_cgi(c->fd, &c->req);
+    stats_record(&c->req);
+    access_log(&c->req);
+    request_release(&c->req);
+    ip_release(c->peer);
+    if (stats_self() != NULL)
+        stat_add(&stats_mine->closed, 1);
+    linger_close(c->fd);
+    free(c);
+}
+
+/**********************************************************************/
+/* Wait for a CGI program to write more output or close it.  The pipe
+ * is not a socket, so SO_RCVTIMEO does not bound the wait; a program
+ * that stalls for longer than -T is given up on, as a client would be.
+ * Parameter: the read end of the program's standard output
+ * Returns: 0 once it is readable or hung up, -1 on a timeout or error */
+/**********************************************************************/
+int cgi_wait(int fd)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int n;
+
+    while ((n = poll(&pfd, 1, io_timeout * 1000)) == -1 && errno == EINTR)
+        ;
+    return(n > 0 ? 0 : -1);
+}
+
+/**********************************************************************/
+/* Take some output of a CGI program.  Until the program's headers are
+ * complete it is collected; after that it is sent on as body.
+ * Parameters: the CGI output
+ *             the bytes and how many there are
+ * Returns: 0 on success, -1 on error or if the headers are too long */
+/**********************************************************************/
+int cgi_write(struct cgi_out *o, const char *data, size_t len)
+{
+    size_t hlen;
+
+    if (o->started)
+        return(cgi_chunk(o, data, len));
+    if (len > sizeof(o->buf) - o->len)
+        return(-1);
+    memcpy(o->buf + o->len, data, len);
+    o->len += len;
+    hlen = head_length(o->buf, o->len, &o->scan);
+    if (hlen == 0)
+        return(0);
+    return(cgi_head(o, hlen));
+}
+
+/**********************************************************************/
+/* Evaluate the conditional headers of a request for a file against
+ * its validators.  If-None-Match (or, without it, If-Modified-Since)
+ * turns the response into a 304; an If-Range that does not match
+ * makes the Range header be ignored so the whole file is sent.
+ * Parameter: the request, with the stat of the file to be sent */
+/**********************************************************************/
+void check_conditions(struct request *req)
+{
+    char etag[80];
+    const char *p = req->if_range;
+
+    format_etag(etag, req);
+    if (req->if_none_match[0] != '\0')
+        req->not_modified = etag_match(req->if_none_match, etag, 1);
+    else if (req->if_modified_since != -1)
+        req->not_modified = req->st.st_mtime <= req->if_modified_since;
+
+    while (ISspace(*p))
+        p++;
+    if (*p == '\0')
+        return;
+    if ((*p == '"' || *p == 'W') ? !etag_match(p, etag, 0) :
+            parse_http_date(p) != req->st.st_mtime)
+        req->range = "";
+}
+
+/**********************************************************************/
+/* Release an event loop connection: take the client socket out of the
+ * epoll set and close it with linger_close(), as the client may have
+ * pipelined requests that will not be served, and let go of any file
+ * being streamed.
+ * Parameter: the connection */
+/**********************************************************************/
+void conn_close(struct conn *c)
+{
+    if (c->state == CONN_WRITE)
+    {
+        stats_record(&c->req);   /* cut short */
+        access_log(&c->req);
+    }
+    if (stats_self() != NULL)
+        stat_add(&stats_mine->closed, 1);
+    timer_cancel(conn_wheel, &c->timer);
+    ip_release(c->peer);
+    if (c->entry != NULL)
+        cache_put(c->entry);
+    request_release(&c->req);
+    if (epoll_fd != -1)
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    linger_close(c->fd);
+    free(c);
+}
+
+/**********************************************************************/
+/* A complete request head is sitting in the connection's read buffer.
+ * Hand it to conn_prepare() and carry on with whatever it decided.
+ * Parameter: the connection
+ * Returns: what conn_write() returns for a file, 0 for a CGI request
+ *          or an h2c connection now owned by its own thread, -1 if the
+ *          connection was closed */
+/**********************************************************************/
+int conn_dispatch(struct conn *c)
+{
+    switch (conn_prepare(c))
+    {
+        case ROUTE_FILE:
+            return(conn_write(c));
+        case ROUTE_CGI:
+            timer_cancel(conn_wheel, &c->timer);
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+            fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+            conn_start_cgi(c);
+            return(0);
+        case ROUTE_H2:
+            timer_cancel(conn_wheel, &c->timer);
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+            conn_start_h2(c);
+            return(0);
+    }
+    conn_close(c);
+    return(-1);
+}
+
+/**********************************************************************/
+/* The timer of an epoll loop connection fired: drop the connection,
+ * or, if it was only holding a paced send back, carry on sending.
+ * Parameter: the timer, the first member of the struct conn */
+/**********************************************************************/
+void conn_expire(struct timer *t)
+{
+    struct conn *c = (struct conn *)t;
+
+    if (c->timing == TIMING_PACE)
+    {
+        c->timing = TIMING_NONE;
+        if (conn_write(c) == 1)
+            conn_read(c);
+        return;
+    }
+    atomic_fetch_add(&conn_timeouts, 1);
+    conn_close(c);
+}
+
+/**********************************************************************/
+/* The response on a connection has been sent completely.  Close the
+ * connection, or keep it for the next request and move any pipelined
+ * bytes that followed the request to the front of the read buffer.
+ * Parameter: the connection
+ * Returns: 1 if the connection waits for another request, -1 if it
+ *          was closed */
+/**********************************************************************/
+int conn_finish(struct conn *c)
+{
+    stats_record(&c->req);
+    access_log(&c->req);
+    c->state = CONN_READ;
+    if (!c->req.keep_alive)
+    {
+        conn_close(c);
+        return(-1);
+    }
+    request_release(&c->req);
+    c->file = -1;
+    if (c->entry != NULL)
+        cache_put(c->entry);
+    c->entry = NULL;
+    c->vec = 0;
+    c->rlen -= c->head_len;
+    memmove(c->rbuf, c->rbuf + c->head_len, c->rlen);
+    c->head_len = 0;
+    c->scan = 0;
+    c->wlen = c->woff = 0;
+    c->offset = c->end = 0;
+    c->copy = 0;
+    c->part = 0;
+    c->timing = TIMING_NONE;    /* whatever comes next starts afresh */
+    return(1);
+}
+
+/**********************************************************************/
+/* Check whether the blank line ending the request head has arrived.
+ * Only the bytes received since the last call are looked at.
+ * Parameter: the connection; head_len is set once the head is complete
+ * Returns: true once the head is complete */
+/**********************************************************************/
+int conn_head_done(struct conn *c)
+{
+    if (c->head_len == 0)
+        c->head_len = head_length(c->rbuf, c->rlen, &c->scan);
+    return(c->head_len != 0);
+}
+
+/**********************************************************************/
+/* Point the connection's iovecs at the part of a cached or snapshot
+ * response that has not been sent yet (woff counts the bytes already
+ * sent).
+ * Parameter: the connection
+ * Returns: the number of iovecs in use, 0 when everything was sent */
+/**********************************************************************/
+int conn_iov(struct conn *c)
+{
+    struct cache_entry *e = c->entry;
+    const struct snap_body *b = c->req.snap_body;
+    const char *base[3];
+    size_t len[3];
+    size_t skip = c->woff;
+    int i, cnt = 0;
+
+    if (e != NULL)
+    {
+        base[0] = e->data;
+        len[0] = e->hdr_len;
+        base[2] = e->data + e->hdr_len;
+        len[2] = e->size;
+    }
+    else
+    {
+        base[0] = c->req.snap->base + b->hdr_off;
+        len[0] = b->hdr_len;
+        base[2] = c->req.snap->base + b->body_off;
+        len[2] = b->size;
+    }
+    base[1] = cache_connection(&c->req);
+    len[1] = strlen(base[1]);
+    for (i = 0; i < 3; i++)
+    {
+        if (skip >= len[i])
+        {
+            skip -= len[i];
+            continue;
+        }
+        c->iov[cnt].iov_base = (char *)base[i] + skip;
+        c->iov[cnt].iov_len = len[i] - skip;
+        skip = 0;
+        cnt++;
+    }
+    return(cnt);
+}
+
+/**********************************************************************/
+/* The current stretch of file on a connection has been sent.  For a
+ * multipart/byteranges response, load the next part header (or the
+ * closing boundary) into wbuf and point offset/end at the next range.
+ * Parameter: the connection
+ * Returns: 1 if there is more to send, 0 if the response is complete */
+/**********************************************************************/
+int conn_next_part(struct conn *c)
+{
+    const struct request *req = &c->req;
+
+    if (req->nranges < 2 || c->part > req->nranges)
+        return(0);
+    c->wlen = format_part(c->wbuf, sizeof(c->wbuf), req, c->part);
+    c->woff = 0;
+    if (c->part < req->nranges)
+    {
+        c->offset = req->base + req->ranges[c->part].first;
+        c->end = req->base + req->ranges[c->part].last + 1;
+    }
+    c->part++;
+    return(1);
+}
+
+/**********************************************************************/
+/* Hold a send of an event loop connection back while its client is
+ * over a -r/-R byte rate: the timer is armed to pick the response up
+ * again, in place of the send deadline.
+ * Parameters: the connection
+ *             in/out: the bytes about to be sent, cut down to what
+ *             may go now
+ * Returns: 0 to send, 1 if the connection now waits for its timer */
+/**********************************************************************/
+int conn_pace(struct conn *c, size_t *len)
+{
+    uint64_t ms;
+
+    if (rate_count == 0 || (ms = rate_pace(c->peer, len)) == 0)
+        return(0);
+    c->timing = TIMING_PACE;
+    timer_arm(conn_wheel, &c->timer, ms);
+    return(1);
+}
+
+/**********************************************************************/
+/* Parse the request head in the connection's read buffer, route it and
+ * set the connection up to write the response.  This is the event
+ * loops' counterpart to accept_request().
+ * Parameter: the connection
+ * Returns: ROUTE_FILE when wbuf holds the headers and file is the
+ *          descriptor to send from (not for a 304), wbuf holds a whole
+ *          404 response or the stats page, or vec is set for a cached
+ *          or snapshot response,
+ *          ROUTE_CGI when the request must be handed to conn_start_cgi(),
+ *          -1 when an error page has been sent and the connection is
+ *          done */
+/**********************************************************************/
+int conn_prepare(struct conn *c)
+{
+    int route;
+    int hit;
+
+    if (h2_preface(c->rbuf, c->head_len))
+        return(ROUTE_H2);
+    if (parse_request(&c->req, c->rbuf, c->head_len) < 0)
+    {
+        unimplemented(c->fd);
+        return(-1);
+    }
+    if (h2_upgrade(&c->req))
+        return(ROUTE_H2);
+    c->req.body = c->rbuf + c->head_len;
+    c->req.body_len = c->rlen - c->head_len;
+    c->req.start = monotonic_usec();
+    c->req.peer = c->peer;
+    if (++c->requests >= keepalive_max || c->req.content_length > 0 ||
+            atomic_load(&draining))
+        c->req.keep_alive = 0;
+
+    route = route_request(&c->req);
+    if (route == ROUTE_CGI)
+        return(ROUTE_CGI);
+    c->woff = 0;
+    if (route == ROUTE_STATS)
+    {
+        c->req.status = 200;
+        c->wlen = stats_response(c->wbuf, sizeof(c->wbuf), &c->req);
+        c->offset = c->end = 0;
+        c->state = CONN_WRITE;
+        return(ROUTE_FILE);
+    }
+    c->req.status = route == ROUTE_FILE ? response_status(&c->req) :
+        route == ROUTE_LIMITED ? 429 : 404;
+    if (route == ROUTE_FILE && !c->req.not_modified)
+    {
+        c->req.from = FROM_FILE;
+        if (c->req.zip != NULL)
+        {
+            c->entry = c->req.zip;      /* the reference goes along */
+            c->req.zip = NULL;
+            c->req.from = FROM_ZIP;
+        }
+        else if (c->req.listing != NULL)
+        {
+            c->entry = c->req.listing;
+            c->req.listing = NULL;
+            c->req.from = FROM_LISTING;
+        }
+        else if (c->req.nranges == 0 && c->req.snap_body != NULL)
+            c->req.from = FROM_SNAPSHOT;
+        else if (c->req.nranges == 0 &&
+                (c->entry = cache_get(&c->req, &hit)) != NULL && hit)
+            c->req.from = FROM_CACHE;
+        if (c->req.from == FROM_SNAPSHOT || c->entry != NULL)
+        {
+            c->vec = 1;
+            c->state = CONN_WRITE;
+            return(ROUTE_FILE);
+        }
+        c->file = c->req.fd;
+    }
+    c->offset = 0;
+    if (route != ROUTE_FILE || (c->file == -1 && !c->req.not_modified))
+    {
+        /* 404s and 429s go out like any other response held in wbuf,
+         * so a client probing for files can keep its connection */
+        c->req.nranges = 0;
+        c->req.from = FROM_NONE;
+        c->wlen = format_error(c->wbuf, sizeof(c->wbuf),
+                route == ROUTE_LIMITED ? ERR_LIMITED : ERR_NOT_FOUND,
+                c->req.keep_alive);
+        c->end = 0;
+        c->state = CONN_WRITE;
+        return(ROUTE_FILE);
+    }
+    c->wlen = format_headers(c->wbuf, sizeof(c->wbuf), &c->req);
+    c->offset = c->req.base;
+    c->end = c->req.base + c->req.st.st_size;
+    c->part = 0;
+    if (c->req.nranges < 0 || c->req.not_modified)
+        c->end = 0;
+    else if (c->req.nranges > 0)
+    {
+        c->offset = c->req.base + c->req.ranges[0].first;
+        c->end = c->req.base + c->req.ranges[0].last + 1;
+        if (c->req.nranges > 1)
+            c->wlen += format_part(c->wbuf + c->wlen,
+                    sizeof(c->wbuf) - c->wlen, &c->req, c->part++);
+    }
+    c->state = CONN_WRITE;
+    return(ROUTE_FILE);
+}
+
+/**********************************************************************/
+/* The socket of a connection in CONN_READ became readable.  Drain it
+ * (the loop is edge-triggered) and dispatch once the blank line that
+ * ends the request head has arrived.  Pipelined requests that are
+ * already buffered are served one after the other.
+ * Parameter: the connection */
+/**********************************************************************/
+void conn_read(struct conn *c)
+{
+    ssize_t n;
+
+    while (1)
+    {
+        while (!conn_head_done(c) && c->rlen < sizeof(c->rbuf))
+        {
+            n = recv(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen, 0);
+            if (n > 0)
+                c->rlen += n;
+            else if (n == -1 && errno == EINTR)
+                continue;
+            else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                conn_timer(c);
+                return;
+            }
+            else
+            {
+                conn_close(c);
+                return;
+            }
+        }
+        if (!conn_head_done(c))
+        {
+            request_too_large(c->fd);
+            conn_close(c);
+            return;
+        }
+        if (conn_dispatch(c) != 1)
+            return;
+    }
+}
+
+/**********************************************************************/
+/* Run a CGI request on its own detached thread.  The connection must
+ * already be out of any event loop and its socket in blocking mode.
+ * Parameter: the connection */
+/**********************************************************************/
+void conn_start_cgi(struct conn *c)
+{
+    struct timeval tv = { io_timeout, 0 };
+    pthread_t newthread;
+    pthread_attr_t attr;
+
+    setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&newthread, &attr, (void *)cgi_thread, c) != 0)
+    {
+        perror("pthread_create");
+        cannot_execute(c->fd);
+        conn_close(c);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/**********************************************************************/
+/* Hand a connection that turned out to speak h2c to a thread of its
+ * own, see h2_thread().  It must already be out of any event loop.
+ * Parameter: the connection */
+/**********************************************************************/
+void conn_start_h2(struct conn *c)
+{
+    pthread_t newthread;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&newthread, &attr, (void *)h2_thread, c) != 0)
+    {
+        perror("pthread_create");
+        conn_close(c);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/**********************************************************************/
+/* A connection of an event loop is about to wait for its client: arm
+ * its timer for what it waits for.  The deadline for a request head
+ * runs from its first bytes (or the accept) however slowly the rest
+ * trickles in; the one for sending is pushed back whenever the client
+ * took some of the response since it was armed.
+ * Parameter: the connection */
+/**********************************************************************/
+void conn_timer(struct conn *c)
+{
+    int timing, secs;
+
+    if (c->state == CONN_WRITE)
+    {
+        if (c->timing == TIMING_SEND && c->timer_sent == c->req.sent)
+            return;
+        timing = TIMING_SEND;
+        secs = io_timeout;
+        c->timer_sent = c->req.sent;
+    }
+    else if (c->rlen > 0 || c->requests == 0)
+    {
+        timing = TIMING_HEAD;
+        secs = request_timeout;
+    }
+    else
+    {
+        timing = TIMING_IDLE;
+        secs = keepalive_timeout;
+    }
+    if (timing == c->timing && timing != TIMING_SEND)
+        return;
+    c->timing = timing;
+    timer_arm(conn_wheel, &c->timer, secs > 0 ? secs * 1000 : 0);
+}
+
+/**********************************************************************/
+/* Push as much of the response out as the socket will take.  Headers
+ * sit in wbuf first; after that the file goes out with sendfile(), or
+ * is read into wbuf one chunk at a time on filesystems that cannot do
+ * sendfile().  Returns on EAGAIN and is called again on EPOLLOUT.
+ * Parameter: the connection
+ * Returns: 0 on EAGAIN, otherwise what conn_finish() returns, or -1 if
+ *          the connection was closed on an error */
+/**********************************************************************/
+int conn_write(struct conn *c)
+{
+    size_t len;
+    ssize_t n;
+
+    if (c->vec)
+        return(conn_write_entry(c));
+    while (1)
+    {
+        if (c->woff == c->wlen)
+        {
+            if (c->file == -1 || c->offset >= c->end)
+            {
+                if (conn_next_part(c))
+                    continue;
+                return(conn_finish(c));
+            }
+            if (!c->copy)
+            {
+                len = c->end - c->offset;
+                if (conn_pace(c, &len))
+                    return(0);
+                n = sendfile(c->fd, c->file, &c->offset, len);
+                if (n > 0)
+                {
+                    c->req.sent += n;
+                    continue;
+                }
+                if (n == -1 && errno == EINTR)
+                    continue;
+                if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    conn_timer(c);
+                    return(0);
+                }
+                if (n == 0 || (errno != EINVAL && errno != ENOSYS))
+                {
+                    conn_close(c);
+                    return(-1);
+                }
+                c->copy = 1;
+            }
+            n = pread(c->file, c->wbuf, sizeof(c->wbuf), c->offset);
+            if (n <= 0)
+            {
+                conn_close(c);
+                return(-1);
+            }
+            if (n > c->end - c->offset)
+                n = c->end - c->offset;
+            c->offset += n;
+            c->wlen = n;
+            c->woff = 0;
+        }
+        len = c->wlen - c->woff;
+        if (conn_pace(c, &len))
+            return(0);
+        /* headers and part boundaries followed by file data are held
+         * back so they share a segment with its first bytes */
+        n = send(c->fd, c->wbuf + c->woff, len,
+                (c->file != -1 && c->offset < c->end) ||
+                c->woff + len < c->wlen ? MSG_MORE : 0);
+        if (n > 0)
+        {
+            c->woff += n;
+            c->req.sent += n;
+        }
+        else if (n == -1 && errno == EINTR)
+            continue;
+        else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            conn_timer(c);
+            return(0);
+        }
+        else
+        {
+            conn_close(c);
+            return(-1);
+        }
+    }
+}
+
+/**********************************************************************/
+/* conn_write() for a response coming out of the hot-file cache or the
+ * snapshot image: the rendered headers, the Connection line and the
+ * body go out together with writev(), continuing where the last call
+ * left off.
+ * Parameter: the connection
+ * Returns: like conn_write() */
+/**********************************************************************/
+int conn_write_entry(struct conn *c)
+{
+    size_t len, cut;
+    ssize_t n;
+    int cnt;
+
+    while ((cnt = conn_iov(c)) > 0)
+    {
+        len = iov_length(c->iov, cnt);
+        if (conn_pace(c, &len))
+            return(0);
+        n = writev(c->fd, c->iov, iov_clamp(c->iov, cnt, len, &cut));
+        if (n > 0)
+        {
+            c->woff += n;
+            c->req.sent += n;
+        }
+        else if (n == -1 && errno == EINTR)
+            continue;
+        else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            conn_timer(c);
+            return(0);
+        }
+        else
+        {
+            conn_close(c);
+            return(-1);
+        }
+    }
+    return(conn_finish(c));
+}
+
+/**********************************************************************/
+/* The Connection header line and the blank line that end the headers
+ * of every response.
+ * Parameter: true if the connection stays open
+ * Returns: a static string */
+/**********************************************************************/
+const char *connection_line(int keep_alive)
+{
+    return(keep_alive ? "Connection: keep-alive\r\n\r\n" :
+            "Connection: close\r\n\r\n");
+}
+
+/**********************************************************************/
+/* Guess the Content-Type of a file from its extension.
+ * Parameter: the path of the file
+ * Returns: a static string */
+/**********************************************************************/
+const char *content_type(const char *path)
+{
+    static const char *types[][2] = {
+        { "html", "text/html" },
+        { "htm", "text/html" },
+        { "css", "text/css" },
+        { "js", "application/javascript" },
+        { "json", "application/json" },
+        { "xml", "application/xml" },
+        { "txt", "text/plain" },
+        { "png", "image/png" },
+        { "jpg", "image/jpeg" },
+        { "jpeg", "image/jpeg" },
+        { "gif", "image/gif" },
+        { "svg", "image/svg+xml" },
+        { "ico", "image/x-icon" },
+        { "webp", "image/webp" },
+        { "woff", "font/woff" },
+        { "woff2", "font/woff2" },
+        { "ttf", "font/ttf" },
+        { "eot", "application/vnd.ms-fontobject" },
+        { "mp3", "audio/mpeg" },
+        { "mp4", "video/mp4" },
+        { "wasm", "application/wasm" },
+        { "pdf", "application/pdf" },
+        { "deb", "application/vnd.debian.binary-package" },
+        { "gz", "application/gzip" },
+        { "xz", "application/x-xz" },
+        { "bz2", "application/x-bzip2" },
+        { "map", "application/json" },
+    };
+    const char *slash = strrchr(path, '/');
+    const char *dot = strrchr(path, '.');
+    size_t i;
+
+    if (dot == NULL || (slash != NULL && dot < slash))
+        return("application/octet-stream");
+    for (i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+        if (strcasecmp(dot + 1, types[i][0]) == 0)
+            return(types[i][1]);
+    return("application/octet-stream");
+}
+
+/**********************************************************************/
+/* Count the connections the server still has to finish: those accepted
+ * and not yet closed, over all threads, plus those waiting in the
+ * pool's queue.
+ * Returns: the number of connections */
+/**********************************************************************/
+uint64_t drain_count(void)
+{
+    const struct stats *s;
+    uint64_t accepted = 0, closed = 0;
+
+    pthread_mutex_lock(&stats_lock);
+    for (s = stats_list; s != NULL; s = s->next)
+    {
+        accepted += atomic_load_explicit(&s->accepted, memory_order_relaxed);
+        closed += atomic_load_explicit(&s->closed, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    if (pool_queue != NULL)
+        accepted += atomic_load(&pool_queue->enqueue_pos) -
+            atomic_load(&pool_queue->dequeue_pos);
+    return(accepted > closed ? accepted - closed : 0);
+}
+
+/**********************************************************************/
+/* Handler of SIGALRM, which restart_drain() sends to the acceptors: it
+ * does nothing but interrupt the accept() or epoll_wait() they sit in,
+ * so they look at draining.
+ * Parameter: the signal */
+/**********************************************************************/
+void drain_wake(int sig)
+{
+    (void)sig;
+}
+
+/**********************************************************************/
+/* Print out an error message with perror() (for system errors; based
+ * on value of errno, which indicates system call errors) and exit the
+ * program indicating an error. */
+/**********************************************************************/
+void error_die(const char *sc)
+{
+    perror(sc);
+    exit(1);
+}
+
+/**********************************************************************/
+/* Render the error responses into complete status line, headers and
+ * body, so that sending one costs a single writev() and no formatting.
+ * The Connection line is left out; it goes in between when sent. */
+/**********************************************************************/
+void error_pages_init(void)
+{
+    struct error_page *p;
+    char head[512];
+    char body[1024];
+    size_t i;
+    int n;
+
+    for (i = 0; i < sizeof(error_pages) / sizeof(error_pages[0]); i++)
+    {
+        p = &error_pages[i];
+        n = snprintf(body, sizeof(body),
+                "<HTML><HEAD><TITLE>%s</TITLE></HEAD>\r\n"
+                "<BODY><P>%s\r\n</BODY></HTML>\r\n", p->title, p->text);
+        p->head_len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\n"
+                SERVER_STRING
+                "Content-Type: text/html\r\n"
+                "Content-Length: %d\r\n"
+                "%s", p->status, n, p->extra);
+        p->len = p->head_len + n;
+        p->data = malloc(p->len);
+        if (p->data == NULL)
+            error_die("malloc");
+        memcpy(p->data, head, p->head_len);
+        memcpy(p->data + p->head_len, body, n);
+    }
+}
+
+/**********************************************************************/
+/* Check whether an entity tag appears in a list of them, as sent in
+ * If-None-Match or If-Range.  "*" matches anything.
+ * Parameters: the header value
+ *             the entity tag of the file, quotes included
+ *             true to use weak comparison (W/ prefixes are ignored);
+ *              with strong comparison weak tags never match
+ * Returns: true on a match */
+/**********************************************************************/
+int etag_match(const char *list, const char *etag, int weak)
+{
+    size_t len = strlen(etag);
+    const char *p = list;
+
+    while (*p != '\0')
+    {
+        while (ISspace(*p) || *p == ',')
+            p++;
+        if (*p == '*')
+            return(1);
+        if (strncmp(p, "W/", 2) == 0)
+        {
+            if (!weak)
+                return(0);
+            p += 2;
+        }
+        if (strncmp(p, etag, len) == 0 &&
+                (p[len] == '\0' || p[len] == ',' || ISspace(p[len])))
+            return(1);
+        while (*p != '\0' && *p != ',')
+            p++;
+    }
+    return(0);
+}
+
+/**********************************************************************/
+/* Execute a CGI script.  Will need to set environment variables as
+ * appropriate.  The request head has already been consumed.  A POST
+ * body is spliced from the socket into the script, and the script's
+ * output is spliced back out behind the response head built from its
+ * headers.  Under -f, .fcgi programs are handed to execute_fcgi()
+ * instead of being started for each request.
+ * Parameters: client socket descriptor
+ *             the parsed request; its status and sent are filled in
+ * Returns: 0 if the connection may carry another request, else -1 */
+/**********************************************************************/
+int execute_cgi(int client, struct request *req)
+{
+    struct cgi_out out;
+    char envbuf[HEAD_MAX + 1024];
+    char *env[CGI_ENV_MAX];
+    char buf[4096];
+    int cgi_output[2];
+    int cgi_input[2];
+    size_t len = strlen(req->path);
+    pid_t pid;
+    int status;
+    ssize_t n;
+    int ret;
+
+    req->status = 500;
+    if (strcasecmp(req->method, "POST") == 0 && req->content_length == -1)
+    {
+        req->status = 400;
+        bad_request(client);
+        return(-1);
+    }
+    if (fcgi_workers > 0 && len > 5 &&
+            strcmp(req->path + len - 5, ".fcgi") == 0)
+        return(execute_fcgi(client, req));
+
+    cgi_env(req, envbuf, sizeof(envbuf), env);
+    if (pipe2(cgi_output, O_CLOEXEC) < 0) {
+        cannot_execute(client);
+        return(-1);
+    }
+    if (pipe2(cgi_input, O_CLOEXEC) < 0) {
+        close(cgi_output[0]);
+        close(cgi_output[1]);
+        cannot_execute(client);
+        return(-1);
+    }
+
+    if ( (pid = fork()) < 0 ) {
+        close(cgi_output[0]);
+        close(cgi_output[1]);
+        close(cgi_input[0]);
+        close(cgi_input[1]);
+        cannot_execute(client);
+        return(-1);
+    }
+    if (pid == 0)  /* child: CGI script */
+    {
+        setpgid(0, 0);
+        dup2(cgi_output[1], STDOUT);
+        dup2(cgi_input[0], STDIN);
+        cgi_exec((char *)req->path, env);
+    }
+
+    /* parent */
+    setpgid(pid, pid);
+    close(cgi_output[1]);
+    close(cgi_input[0]);
+    ret = cgi_body(client, req, cgi_input[1]);
+    close(cgi_input[1]);
+
+    cgi_out_init(&out, client, req);
+    while (ret == 0 && !out.started)
+    {
+        if (cgi_wait(cgi_output[0]) == -1)
+        {
+            ret = -1;
+            break;
+        }
+        n = read(cgi_output[0], buf, sizeof(buf));
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        ret = cgi_write(&out, buf, n);
+    }
+    if (ret == 0 && out.started)
+        ret = cgi_splice(&out, cgi_output[0]);
+    if (ret == -1)
+        kill(-pid, SIGKILL);    /* or a stalled one holds up waitpid() */
+    ret = cgi_finish(&out, ret);
+    req->status = out.status;
+    req->sent = out.sent;
+
+    close(cgi_output[0]);
+    waitpid(pid, &status, 0);
+    return(ret);
+}
+
+/**********************************************************************/
+/* Run a request through a FastCGI responder kept warm by
+ * fcgi_connect(), over a local socket: the CGI variables go as
+ * FCGI_PARAMS, the POST body as FCGI_STDIN, and FCGI_STDOUT comes
+ * back through the same relay as a CGI script's output.
+ * Parameters: client socket descriptor
+ *             the parsed request; its status and sent are filled in
+ * Returns: 0 if the connection may carry another request, else -1 */
+/**********************************************************************/
+int execute_fcgi(int client, struct request *req)
+{
+    static const unsigned char begin[8] = { 0, FCGI_RESPONDER, 0 };
+    struct timeval tv = { io_timeout, 0 };
+    struct cgi_out out;
+    char envbuf[HEAD_MAX + 1024];
+    char *env[CGI_ENV_MAX];
+    unsigned char params[HEAD_MAX + 1024 + 8 * CGI_ENV_MAX];
+    unsigned char rec[8];
+    char data[65536 + 256];
+    size_t plen = 0;
+    size_t lens[2];
+    size_t have;
+    off_t left;
+    char *eq;
+    ssize_t n;
+    int done = 0;
+    int ret;
+    int fd;
+    int i, j;
+
+    req->status = 500;
+    fd = fcgi_connect(req->path);
+    if (fd == -1)
+    {
+        cannot_execute(client);
+        return(-1);
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    /* name-value pairs, lengths as 1 byte or 4 with the top bit set */
+    cgi_env(req, envbuf, sizeof(envbuf), env);
+    for (i = 0; env[i] != NULL; i++)
+    {
+        eq = strchr(env[i], '=');
+        lens[0] = eq - env[i];
+        lens[1] = strlen(eq + 1);
+        for (j = 0; j < 2; j++)
+        {
+            if (lens[j] < 128)
+                params[plen++] = lens[j];
+            else
+            {
+                params[plen++] = (lens[j] >> 24) | 0x80;
+                params[plen++] = lens[j] >> 16;
+                params[plen++] = lens[j] >> 8;
+                params[plen++] = lens[j];
+            }
+        }
+        memcpy(params + plen, env[i], lens[0]);
+        memcpy(params + plen + lens[0], eq + 1, lens[1]);
+        plen += lens[0] + lens[1];
+    }
+    ret = fcgi_record(fd, FCGI_BEGIN_REQUEST, begin, sizeof(begin));
+    if (ret == 0)
+        ret = fcgi_record(fd, FCGI_PARAMS, params, plen);
+    if (ret == 0)
+        ret = fcgi_record(fd, FCGI_PARAMS, NULL, 0);
+
+    have = req->body_len;
+    left = req->content_length > 0 ? req->content_length : 0;
+    if (have > (size_t)left)
+        have = left;
+    if (ret == 0 && have > 0)
+        ret = fcgi_record(fd, FCGI_STDIN, req->body, have);
+    left -= have;
+    while (ret == 0 && left > 0)
+    {
+        n = recv(client, data, left < 65535 ? left : 65535, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            ret = -1;
+        else
+        {
+            ret = fcgi_record(fd, FCGI_STDIN, data, n);
+            left -= n;
+        }
+    }
+    if (ret == 0)
+        ret = fcgi_record(fd, FCGI_STDIN, NULL, 0);
+
+    cgi_out_init(&out, client, req);
+    while (ret == 0 && !done)
+    {
+        if (read_full(fd, rec, sizeof(rec)) == -1 ||
+                read_full(fd, data, ((rec[4] << 8) | rec[5]) + rec[6]) == -1)
+        {
+            ret = -1;
+            break;
+        }
+        n = (rec[4] << 8) | rec[5];
+        if (rec[1] == FCGI_STDOUT)
+            ret = cgi_write(&out, data, n);
+        else if (rec[1] == FCGI_STDERR)
+            fwrite(data, 1, n, stderr);
+        else if (rec[1] == FCGI_END_REQUEST)
+            done = 1;
+    }
+    close(fd);
+    ret = cgi_finish(&out, done ? ret : -1);
+    req->status = out.status;
+    req->sent = out.sent;
+    return(ret);
+}
+
+/**********************************************************************/
+/* Connect to the workers of a FastCGI program, starting them the first
+ * time the program is asked for, and again if they have all died.
+ * Each program gets fcgi_workers processes that accept() on a
+ * listening socket passed as their standard input, as the FastCGI
+ * spec has it; a request queues in its backlog until one is free.
+ * Parameter: the path of the program
+ * Returns: a socket connected to a worker, or -1 */
+/**********************************************************************/
+int fcgi_connect(const char *path)
+{
+    static int napps;
+    struct fcgi_app *app;
+    int fd;
+
+    pthread_mutex_lock(&fcgi_lock);
+    for (app = fcgi_apps; app != NULL; app = app->next)
+        if (strcmp(app->path, path) == 0)
+            break;
+    if (app == NULL && (app = calloc(1, sizeof(*app))) != NULL)
+    {
+        app->path = strdup(path);
+        app->addr.sun_family = AF_UNIX;
+        /* abstract name: nothing to clean up in the filesystem */
+        snprintf(app->addr.sun_path + 1, sizeof(app->addr.sun_path) - 1,
+                "jdbhttpd-fcgi-%d-%d", (int)getpid(), napps++);
+        app->addr_len = offsetof(struct sockaddr_un, sun_path) + 1 +
+            strlen(app->addr.sun_path + 1);
+        app->next = fcgi_apps;
+        fcgi_apps = app;
+    }
+    pthread_mutex_unlock(&fcgi_lock);
+    if (app == NULL || app->path == NULL)
+        return(-1);
+
+    if ((fd = fcgi_try(app)) != -1)
+        return(fd);
+    pthread_mutex_lock(&fcgi_lock);
+    fd = fcgi_try(app);
+    if (fd == -1 && fcgi_spawn(app) == 0)
+        fd = fcgi_try(app);
+    pthread_mutex_unlock(&fcgi_lock);
+    return(fd);
+}
+
+/**********************************************************************/
+/* Write a FastCGI record (request id 1), split into several if the
+ * content is longer than a record can carry.  An empty record ends a
+ * stream.
+ * Parameters: the socket to the worker
+ *             the record type
+ *             the content and its length
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int fcgi_record(int fd, int type, const void *data, size_t len)
+{
+    unsigned char hdr[8] = { FCGI_VERSION_1, 0, 0, 1 };
+    struct iovec iov[2];
+    size_t n;
+
+    do
+    {
+        n = len < 65535 ? len : 65535;
+        hdr[1] = type;
+        hdr[4] = n >> 8;
+        hdr[5] = n;
+        iov[0].iov_base = hdr;
+        iov[0].iov_len = sizeof(hdr);
+        iov[1].iov_base = (void *)data;
+        iov[1].iov_len = n;
+        if (send_iov(fd, iov, 2) == -1)
+            return(-1);
+        data = (const char *)data + n;
+        len -= n;
+    } while (len > 0);
+    return(0);
+}
+
+/**********************************************************************/
+/* Start the workers of a FastCGI program on a new listening socket.
+ * Workers left over from before are reaped.  Called with fcgi_lock
+ * held.
+ * Parameter: the program
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int fcgi_spawn(struct fcgi_app *app)
+{
+    extern char **environ;
+    int sock;
+    int i;
+
+    for (i = 0; i < fcgi_workers; i++)
+        if (app->pids[i] > 0)
+            waitpid(app->pids[i], NULL, WNOHANG);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        return(-1);
+    if (bind(sock, (struct sockaddr *)&app->addr, app->addr_len) == -1 ||
+            listen(sock, SOMAXCONN) == -1)
+    {
+        perror("fcgi");
+        close(sock);
+        return(-1);
+    }
+    for (i = 0; i < fcgi_workers; i++)
+    {
+        app->pids[i] = fork();
+        if (app->pids[i] == 0)
+        {
+            dup2(sock, STDIN);
+            cgi_exec(app->path, environ);
+        }
+    }
+    /* only the workers hold the socket now, so once they are all gone
+     * connecting fails and the next request starts new ones */
+    close(sock);
+    return(0);
+}
+
+/**********************************************************************/
+/* Stop the workers of every FastCGI program before the server exits,
+ * as they would otherwise outlive it.  fcgi_lock stays held, so no
+ * worker is started meanwhile. */
+/**********************************************************************/
+void fcgi_stop(void)
+{
+    struct fcgi_app *app;
+    int i;
+
+    pthread_mutex_lock(&fcgi_lock);
+    for (app = fcgi_apps; app != NULL; app = app->next)
+        for (i = 0; i < fcgi_workers; i++)
+            if (app->pids[i] > 0)
+                kill(app->pids[i], SIGTERM);
+}
+
+/**********************************************************************/
+/* Try to connect to the workers of a FastCGI program.
+ * Parameter: the program
+ * Returns: the connected socket, or -1 */
+/**********************************************************************/
+int fcgi_try(struct fcgi_app *app)
+{
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return(-1);
+    if (connect(fd, (struct sockaddr *)&app->addr, app->addr_len) == -1)
+    {
+        close(fd);
+        return(-1);
+    }
+    return(fd);
+}
+
+/**********************************************************************/
+/* Set up the url cache: an inotify instance and the thread that reads
+ * it.  Without inotify every url is resolved afresh.  The descriptor
+ * limit is raised as far as allowed, and the cache kept to a quarter
+ * of it since an entry may hold three descriptors. */
+/**********************************************************************/
+void file_cache_init(void)
+{
+    pthread_t newthread;
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+        if (rl.rlim_cur != RLIM_INFINITY && file_max > rl.rlim_cur / 4)
+            file_max = rl.rlim_cur / 4;
+    }
+    if (file_max == 0)
+        return;
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd == -1)
+    {
+        perror("inotify_init1");
+        return;
+    }
+    if (pthread_create(&newthread, NULL, (void *)watch_thread, NULL) != 0)
+        error_die("pthread_create");
+    pthread_detach(newthread);
+}
+
+/**********************************************************************/
+/* Drop an entry from the url cache.  It is freed once the last
+ * request using it lets go.  Called with file_lock held.
+ * Parameter: the entry */
+/**********************************************************************/
+void file_evict(struct file_entry *f)
+{
+    struct file_entry **pp;
+
+    for (pp = &file_table[f->hash]; *pp != f; pp = &(*pp)->hnext)
+        ;
+    *pp = f->hnext;
+    f->prev->next = f->next;
+    f->next->prev = f->prev;
+    file_count--;
+    file_put(f);
+}
+
+/**********************************************************************/
+/* Resolve a url through the url cache, walking the path only on a
+ * miss or when a directory involved has changed since.
+ * Parameter: the url of the request, query string cut off
+ * Returns: a referenced entry, to be released with file_put(), or NULL
+ *          if nothing is there */
+/**********************************************************************/
+struct file_entry *file_get(const char *url)
+{
+    struct file_entry *f, *old;
+    unsigned h = 2166136261u;   /* FNV-1a */
+    const char *p;
+
+    for (p = url; *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    h %= FILE_BUCKETS;
+
+    pthread_mutex_lock(&file_lock);
+    for (f = file_table[h]; f != NULL; f = f->hnext)
+        if (strcmp(f->url, url) == 0)
+            break;
+    if (f != NULL && file_valid(f))
+    {
+        file_hits++;
+        f->prev->next = f->next;
+        f->next->prev = f->prev;
+    }
+    else
+    {
+        file_misses++;
+        pthread_mutex_unlock(&file_lock);
+        f = file_resolve(url);
+        if (f == NULL)
+            return(NULL);
+        atomic_init(&f->refs, 1);   /* the caller's */
+        if (f->dirs[0] == NULL || file_max == 0)
+            return(f);              /* cannot tell when it goes stale */
+        pthread_mutex_lock(&file_lock);
+        for (old = file_table[h]; old != NULL; old = old->hnext)
+            if (strcmp(old->url, url) == 0)
+                break;
+        if (old != NULL)
+            file_evict(old);
+        while (file_count >= file_max)
+            file_evict(file_lru.prev);
+        f->hash = h;
+        f->hnext = file_table[h];
+        file_table[h] = f;
+        file_count++;
+    }
+    f->next = file_lru.next;
+    f->prev = &file_lru;
+    file_lru.next->prev = f;
+    file_lru.next = f;
+    atomic_fetch_add(&f->refs, 1);
+    pthread_mutex_unlock(&file_lock);
+    return(f);
+}
+
+/**********************************************************************/
+/* Release a reference to a url cache entry, closing its descriptors
+ * and freeing it with the last one.
+ * Parameter: the entry, or NULL */
+/**********************************************************************/
+void file_put(struct file_entry *f)
+{
+    int i;
+
+    if (f == NULL || atomic_fetch_sub(&f->refs, 1) != 1)
+        return;
+    if (f->fd != -1)
+        close(f->fd);
+    for (i = 0; i < 2; i++)
+        if (f->var_fd[i] != -1)
+            close(f->var_fd[i]);
+    for (i = 0; i < 2; i++)
+        if (f->listing[i] != NULL)
+            cache_put(f->listing[i]);
+    free(f->url);
+    free(f->path);
+    free(f);
+}
+
+/**********************************************************************/
+/* Walk the path of a url: "htdocs" plus the url, a directory resolved
+ * to its index.html, then open the file and its precompressed
+ * siblings.  A directory that has no index.html gets its listing
+ * instead.  The directories involved are watched, and their
+ * generations noted before anything is looked at, so that a change
+ * racing with the walk still invalidates the entry.
+ * Parameter: the url
+ * Returns: an unlinked entry without references, or NULL if there is
+ *          no such file */
+/**********************************************************************/
+struct file_entry *file_resolve(const char *url)
+{
+    struct file_entry *f;
+    char path[512];
+    char dir[512];
+    char *slash;
+    char *index = NULL;   /* where index.html went onto a directory */
+    size_t len;
+    size_t i;
+
+    if (strlen(url) + sizeof("htdocs//index.html") + 4 > sizeof(path))
+        return(NULL);
+    len = sprintf(path, "htdocs%s", url);
+    f = calloc(1, sizeof(*f));
+    if (f == NULL)
+        return(NULL);
+    f->fd = f->var_fd[0] = f->var_fd[1] = -1;
+    f->gen = atomic_load(&file_gen);
+
+    strcpy(dir, path);
+    if (dir[len - 1] == '/')
+        dir[len - 1] = '\0';
+    else if ((slash = strrchr(dir, '/')) != NULL)
+        *slash = '\0';
+    if ((f->dirs[0] = watch_dir(dir)) != NULL)
+        f->gens[0] = atomic_load(&f->dirs[0]->gen);
+
+    if (path[len - 1] == '/')
+    {
+        index = path + len;
+        strcpy(index, "index.html");
+    }
+    if (stat(path, &f->st) == -1)
+        goto list;
+    if (S_ISDIR(f->st.st_mode))
+    {
+        if ((f->dirs[1] = watch_dir(path)) != NULL)
+            f->gens[1] = atomic_load(&f->dirs[1]->gen);
+        strcat(path, "/");
+        index = path + len + 1;
+        strcpy(index, "index.html");
+        if (stat(path, &f->st) == -1)
+            goto list;
+    }
+    if (!S_ISREG(f->st.st_mode))
+        goto fail;
+    TRACE_MARK(TRACE_RESOLVED);
+    f->url = strdup(url);
+    f->path = strdup(path);
+    if (f->url == NULL || f->path == NULL)
+        goto fail;
+    if ((f->st.st_mode & S_IXUSR) ||
+            (f->st.st_mode & S_IXGRP) ||
+            (f->st.st_mode & S_IXOTH)    )
+    {
+        f->cgi = 1;
+        return(f);
+    }
+
+    f->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (f->fd == -1 || fstat(f->fd, &f->st) == -1)
+        goto fail;
+    TRACE_MARK(TRACE_OPENED);
+    len = strlen(path);
+    for (i = 0; i < sizeof(codings) / sizeof(codings[0]); i++)
+    {
+        strcpy(path + len, codings[i][0]);
+        f->var_fd[i] = open(path, O_RDONLY | O_CLOEXEC);
+        if (f->var_fd[i] != -1 && (fstat(f->var_fd[i], &f->var_st[i]) == -1 ||
+                    !S_ISREG(f->var_st[i].st_mode)))
+        {
+            close(f->var_fd[i]);
+            f->var_fd[i] = -1;
+        }
+    }
+    return(f);
+
+list:
+    if (index == NULL || errno != ENOENT)
+        goto fail;
+    *index = '\0';
+    if (stat(path, &f->st) == -1 || !S_ISDIR(f->st.st_mode))
+        goto fail;
+    TRACE_MARK(TRACE_RESOLVED);
+    f->url = strdup(url);
+    f->path = strdup(path);
+    if (f->url == NULL || f->path == NULL || listing_make(f) == -1)
+        goto fail;
+    TRACE_MARK(TRACE_OPENED);
+    return(f);
+
+fail:
+    atomic_init(&f->refs, 1);
+    file_put(f);
+    return(NULL);
+}
+
+/**********************************************************************/
+/* Check that nothing has changed in the directories an entry of the
+ * url cache was resolved in.
+ * Parameter: the entry
+ * Returns: true if it may still be used */
+/**********************************************************************/
+int file_valid(const struct file_entry *f)
+{
+    int i;
+
+    if (f->gen != atomic_load(&file_gen))
+        return(0);
+    for (i = 0; i < 2; i++)
+        if (f->dirs[i] != NULL && f->gens[i] != atomic_load(&f->dirs[i]->gen))
+            return(0);
+    return(1);
+}
+
+/**********************************************************************/
+/* Build the status line and entity headers for a file response: 200
+ * for the whole file, 206 for byte ranges, 416 when no range can be
+ * satisfied, 304 when the client's copy is still current.  Everything
+ * but the Connection line, so the result can be cached.
+ * Parameters: the buffer to build them in and its size
+ *             the request, with the stat and ranges of the file
+ * Returns: the length of the headers */
+/**********************************************************************/
+int format_entity(char *buf, size_t size, const struct request *req)
+{
+    const char *status = "200 OK";
+    char range[128];
+    char coding[96];
+    char date[64];
+    char etag[80];
+    struct tm tm;
+
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT",
+            gmtime_r(&req->st.st_mtime, &tm));
+    format_etag(etag, req);
+    if (req->not_modified)
+        return(snprintf(buf, size, "HTTP/1.1 304 Not Modified\r\n"
+                    SERVER_STRING
+                    "ETag: %s\r\n"
+                    "Last-Modified: %s\r\n"
+                    "%s",
+                    etag, date,
+                    req->vary ? "Vary: Accept-Encoding\r\n" : ""));
+
+    range[0] = '\0';
+    if (req->nranges < 0)
+    {
+        status = "416 Range Not Satisfiable";
+        sprintf(range, "Content-Range: bytes */%lld\r\n",
+                (long long)req->st.st_size);
+    }
+    else if (req->nranges == 1)
+    {
+        status = "206 Partial Content";
+        sprintf(range, "Content-Range: bytes %lld-%lld/%lld\r\n",
+                (long long)req->ranges[0].first,
+                (long long)req->ranges[0].last,
+                (long long)req->st.st_size);
+    }
+    else if (req->nranges > 1)
+        status = "206 Partial Content";
+    sprintf(coding, "%s%s%s%s",
+            req->encoding ? "Content-Encoding: " : "",
+            req->encoding ? req->encoding : "",
+            req->encoding ? "\r\n" : "",
+            req->vary ? "Vary: Accept-Encoding\r\n" : "");
+
+    return(snprintf(buf, size, "HTTP/1.1 %s\r\n" SERVER_STRING
+                "Content-Type: %s\r\n"
+                "Content-Length: %lld\r\n"
+                "ETag: %s\r\n"
+                "Last-Modified: %s\r\n"
+                "Accept-Ranges: bytes\r\n"
+                "%s%s",
+                status,
+                req->nranges > 1 ? "multipart/byteranges; boundary="
+                    BOUNDARY : req->type,
+                (long long)req->length, etag, date, coding, range));
+}
+
+/**********************************************************************/
+/* Copy a pre-rendered error response into a buffer, for the event
+ * loops to send like any other response held in wbuf.
+ * Parameters: the buffer and its size, which must hold the response
+ *             one of the ERR_ constants
+ *             true if the connection stays open
+ * Returns: the length of the response */
+/**********************************************************************/
+size_t format_error(char *buf, size_t size, int err, int keep_alive)
+{
+    const struct error_page *p = &error_pages[err];
+    const char *conn = connection_line(keep_alive);
+    size_t len = strlen(conn);
+
+    if (p->len + len > size)
+        return(0);
+    memcpy(buf, p->data, p->head_len);
+    memcpy(buf + p->head_len, conn, len);
+    memcpy(buf + p->head_len + len, p->data + p->head_len,
+            p->len - p->head_len);
+    return(p->len + len);
+}
+
+/**********************************************************************/
+/* Derive a strong entity tag for a file from its inode, size and
+ * modification time.  A variant compressed on the fly has the same
+ * stat as the file, so its coding is tagged on.
+ * Parameters: a buffer of at least 80 bytes
+ *             the request, with the stat of the file */
+/**********************************************************************/
+void format_etag(char *buf, const struct request *req)
+{
+    const struct stat *st = &req->st;
+
+    sprintf(buf, "\"%llx-%llx-%llx%s%s\"", (unsigned long long)st->st_ino,
+            (unsigned long long)st->st_size,
+            (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL +
+            st->st_mtim.tv_nsec, req->zip != NULL ? "-" : "",
+            req->zip != NULL ? req->encoding : "");
+}
+
+/**********************************************************************/
+/* Build the complete headers for a file response.
+ * Parameters: the buffer to build them in and its size
+ *             the request, with the stat and ranges of the file
+ * Returns: the length of the headers */
+/**********************************************************************/
+int format_headers(char *buf, size_t size, const struct request *req)
+{
+    int len;
+
+    len = format_entity(buf, size, req);
+    return(len + snprintf(buf + len, size - len, "%s",
+                cache_connection(req)));
+}
+
+/**********************************************************************/
+/* Build the header of one part of a multipart/byteranges body, or the
+ * closing boundary after the last part.
+ * Parameters: the buffer to build it in and its size
+ *             the request
+ *             the index of the range, nranges for the closing boundary
+ * Returns: the length of the part header */
+/**********************************************************************/
+int format_part(char *buf, size_t size, const struct request *req, int i)
+{
+    if (i == req->nranges)
+        return(snprintf(buf, size, "\r\n--" BOUNDARY "--\r\n"));
+    return(snprintf(buf, size, "\r\n--" BOUNDARY "\r\n"
+                "Content-Type: %s\r\n"
+                "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                req->type,
+                (long long)req->ranges[i].first,
+                (long long)req->ranges[i].last,
+                (long long)req->st.st_size));
+}
+
+/**********************************************************************/
+/* Render the counters behind /__stats: the totals over all threads,
+ * how many connections wait in the listen queues (and the pool's
+ * queue), the hits and misses of the hot-file and url caches, what
+ * on-the-fly compression achieved and cost, then every latency
+ * histogram.
+ * Parameters: the buffer and its size
+ *             true for JSON, false for text
+ * Returns: the length of the output */
+/**********************************************************************/
+size_t format_stats(char *buf, size_t size, int json)
+{
+    static const char *classes[STAT_CLASSES] = {
+        [STAT_PAGE] = "page", [STAT_DEB] = "deb",
+        [STAT_DISTS] = "dists", [STAT_CGI] = "cgi",
+    };
+    const struct stats *s;
+    struct tcp_info ti;
+    socklen_t tlen;
+    unsigned long long accepted = 0, closed = 0, requests = 0, bytes = 0;
+    unsigned long long queued = 0, backlog = 0, pooled = 0;
+    unsigned long long chits, cmisses, fhits, fmisses;
+    uint64_t zin = atomic_load(&zip_in), zout = atomic_load(&zip_out);
+    char label[16];
+    size_t len;
+    int i, n;
+
+    for (i = 0; i < nlisteners; i++)
+    {
+        /* for a listener, unacked is the accept queue and sacked its
+         * limit */
+        tlen = sizeof(ti);
+        if (getsockopt(listeners[i], IPPROTO_TCP, TCP_INFO, &ti, &tlen) == 0)
+        {
+            queued += ti.tcpi_unacked;
+            backlog += ti.tcpi_sacked;
+        }
+    }
+    if (pool_queue != NULL)
+        pooled = atomic_load(&pool_queue->enqueue_pos) -
+            atomic_load(&pool_queue->dequeue_pos);
+    pthread_mutex_lock(&cache_lock);
+    chits = cache_hits;
+    cmisses = cache_misses;
+    pthread_mutex_unlock(&cache_lock);
+    pthread_mutex_lock(&file_lock);
+    fhits = file_hits;
+    fmisses = file_misses;
+    pthread_mutex_unlock(&file_lock);
+
+    pthread_mutex_lock(&stats_lock);
+    for (s = stats_list; s != NULL; s = s->next)
+    {
+        accepted += atomic_load_explicit(&s->accepted, memory_order_relaxed);
+        closed += atomic_load_explicit(&s->closed, memory_order_relaxed);
+        requests += atomic_load_explicit(&s->requests, memory_order_relaxed);
+        bytes += atomic_load_explicit(&s->bytes, memory_order_relaxed);
+    }
+    n = snprintf(buf, size, json ?
+            "{\"requests\":%llu,\"bytes_sent\":%llu,"
+            "\"connections_active\":%llu,\"connections_total\":%llu,"
+            "\"accept_queue\":%llu,\"accept_backlog\":%llu,"
+            "\"pool_queue\":%llu,"
+            "\"cache_hits\":%llu,\"cache_misses\":%llu,"
+            "\"file_hits\":%llu,\"file_misses\":%llu,"
+            "\"log_dropped\":%llu,"
+            "\"timeouts\":%llu,\"refused\":%llu,"
+            "\"rate_limited\":%llu,\"rate_paced\":%llu,"
+            "\"compress_files\":%llu,\"compress_hits\":%llu,"
+            "\"compress_in\":%llu,\"compress_out\":%llu,"
+            "\"compress_ratio\":%.3f,\"compress_cpu_us\":%llu,"
+            "\"h2_connections\":%llu,\"h2_streams\":%llu,"
+            "\"latency_us\":{\"class\":{" :
+            "requests %llu\n"
+            "bytes_sent %llu\n"
+            "connections_active %llu\n"
+            "connections_total %llu\n"
+            "accept_queue %llu\n"
+            "accept_backlog %llu\n"
+            "pool_queue %llu\n"
+            "cache_hits %llu\n"
+            "cache_misses %llu\n"
+            "file_hits %llu\n"
+            "file_misses %llu\n"
+            "log_dropped %llu\n"
+            "timeouts %llu\n"
+            "refused %llu\n"
+            "rate_limited %llu\n"
+            "rate_paced %llu\n"
+            "compress_files %llu\n"
+            "compress_hits %llu\n"
+            "compress_in %llu\n"
+            "compress_out %llu\n"
+            "compress_ratio %.3f\n"
+            "compress_cpu_us %llu\n"
+            "h2_connections %llu\n"
+            "h2_streams %llu\n"
+            "# latency in microseconds: count mean p50 p99 p999 max\n",
+            requests, bytes, accepted > closed ? accepted - closed : 0,
+            accepted, queued, backlog, pooled, chits, cmisses, fhits, fmisses,
+            (unsigned long long)atomic_load(&log_dropped),
+            (unsigned long long)atomic_load(&conn_timeouts),
+            (unsigned long long)atomic_load(&conn_refused),
+            (unsigned long long)atomic_load(&rate_limited),
+            (unsigned long long)atomic_load(&rate_paced),
+            (unsigned long long)atomic_load(&zip_files),
+            (unsigned long long)atomic_load(&zip_hits),
+            (unsigned long long)zin, (unsigned long long)zout,
+            zin > 0 ? (double)zout / zin : 0.0,
+            (unsigned long long)atomic_load(&zip_cpu) / 1000,
+            (unsigned long long)atomic_load(&h2_conns),
+            (unsigned long long)atomic_load(&h2_streams));
+    len = n < 0 ? 0 : (size_t)n < size ? (size_t)n : size - 1;
+    for (i = 0; i < STAT_SERIES; i++)
+    {
+        if (i < STAT_CLASSES)
+            strcpy(label, classes[i]);
+        else if (i < STAT_SERIES - 1)
+            sprintf(label, "%d", stat_codes[i - STAT_CLASSES]);
+        else
+            strcpy(label, "other");
+        if (json && i == STAT_CLASSES)
+            len += snprintf(buf + len, size - len, "},\"status\":{");
+        if (len >= size)
+            len = size - 1;
+        len += stats_series(buf + len, size - len,
+                json ? (i == 0 || i == STAT_CLASSES ? "" : ",") :
+                i < STAT_CLASSES ? "class" : "status", label, i, json);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    if (json)
+        len += snprintf(buf + len, size - len, "}}}\n");
+    return(len < size ? len : size - 1);
+}
+
+/**********************************************************************/
+/* Arm the deadline of a blocking connection, or move it.
+ * Parameters: the guard
+ *             what the connection waits for, TIMING_
+ *             the seconds it may take */
+/**********************************************************************/
+void guard_arm(struct guard *g, int timing, int secs)
+{
+    g->timing = timing;
+    pthread_mutex_lock(&guard_lock);
+    timer_arm(&guard_wheel, &g->timer, secs > 0 ? secs * 1000 : 0);
+    pthread_mutex_unlock(&guard_lock);
+}
+
+/**********************************************************************/
+/* Disarm the deadline of a blocking connection.  Once this returns,
+ * guard_thread() no longer touches the socket, so it may be closed.
+ * Parameter: the guard */
+/**********************************************************************/
+void guard_cancel(struct guard *g)
+{
+    pthread_mutex_lock(&guard_lock);
+    timer_cancel(&guard_wheel, &g->timer);
+    pthread_mutex_unlock(&guard_lock);
+    g->timing = TIMING_NONE;
+}
+
+/**********************************************************************/
+/* A deadline of a blocking connection passed: shut its socket down so
+ * the thread waiting on it gives up.  Runs under guard_lock.
+ * Parameter: the timer, the first member of the struct guard */
+/**********************************************************************/
+void guard_expire(struct timer *t)
+{
+    atomic_fetch_add(&conn_timeouts, 1);
+    shutdown(((struct guard *)t)->fd, SHUT_RDWR);
+}
+
+/**********************************************************************/
+/* Start the thread that enforces the deadlines of blocking
+ * connections, for the thread and pool models. */
+/**********************************************************************/
+void guard_start(void)
+{
+    pthread_t newthread;
+
+    wheel_init(&guard_wheel);
+    if (pthread_create(&newthread, NULL, (void *)guard_thread, NULL) != 0)
+        error_die("pthread_create");
+    pthread_detach(newthread);
+}
+
+/**********************************************************************/
+/* Body of the guard thread: run the wheel of blocking connections
+ * once a tick.
+ * Parameter: unused */
+/**********************************************************************/
+void guard_thread(void *arg)
+{
+    static const struct timespec tick = { 0, WHEEL_TICK_MS * 1000000L };
+
+    (void)arg;
+    while (1)
+    {
+        nanosleep(&tick, NULL);
+        pthread_mutex_lock(&guard_lock);
+        wheel_run(&guard_wheel, guard_expire);
+        pthread_mutex_unlock(&guard_lock);
+    }
+}
+
+/**********************************************************************/
+/* Decode the base64url of an HTTP2-Settings header, padded or not.
+ * Parameters: the text
+ *             the buffer for the bytes and its size
+ * Returns: the number of bytes, or -1 if the text is not base64url or
+ *          does not fit */
+/**********************************************************************/
+int h2_base64(const char *in, unsigned char *out, size_t size)
+{
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    const char *d;
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t len = 0;
+
+    for (; *in != '\0' && *in != '='; in++)
+    {
+        if ((d = strchr(digits, *in)) == NULL)
+            return(-1);
+        acc = acc << 6 | (d - digits);
+        bits += 6;
+        if (bits >= 8)
+        {
+            if (len == size)
+                return(-1);
+            bits -= 8;
+            out[len++] = acc >> bits;
+        }
+    }
+    return(len);
+}
+
+/**********************************************************************/
+/* Collect a fragment of a header block, from a HEADERS frame or a
+ * CONTINUATION, and act on the block once it is complete.
+ * Parameters: the connection, with block_id set
+ *             the flags of the frame
+ *             the fragment and its length
+ * Returns: 0, or -1 on a connection error */
+/**********************************************************************/
+int h2_block(struct h2_conn *h, int flags, const unsigned char *p,
+        size_t len)
+{
+    uint32_t id = h->block_id;
+
+    if (h->block_len + len > sizeof(h->block))
+        return(h2_goaway(h, H2_ENHANCE_YOUR_CALM));
+    memcpy(h->block + h->block_len, p, len);
+    h->block_len += len;
+    if (!(flags & H2_END_HEADERS))
+        return(0);
+    h->block_id = 0;
+    return(h2_request(h, id, h->block_flags & H2_END_STREAM));
+}
+
+/**********************************************************************/
+/* Forget a stream whose response has been queued completely, or that
+ * was reset, and drop what it holds.  Requests that never parsed are
+ * not counted, as with HTTP/1.x.
+ * Parameters: the connection
+ *             the stream
+ *             true to count and log its request */
+/**********************************************************************/
+void h2_close(struct h2_conn *h, struct h2_stream *s, int log)
+{
+    struct h2_stream **pp;
+
+    for (pp = &h->streams; *pp != s; pp = &(*pp)->next)
+        ;
+    *pp = s->next;
+    h->nstreams--;
+    if (log && s->req.url != NULL)
+    {
+        stats_record(&s->req);
+        access_log(&s->req);
+    }
+    request_release(&s->req);
+    if (s->entry != NULL)
+        cache_put(s->entry);
+    free(s->buf);
+    free(s);
+}
+
+/**********************************************************************/
+/* Take a DATA frame.  Request bodies are of no use to anything but
+ * CGI, which is not run over h2c, so the bytes are dropped and the
+ * client is credited for them right away.
+ * Parameters: the connection
+ *             the stream, the flags and the length of the frame
+ * Returns: 0, or -1 on a connection error */
+/**********************************************************************/
+int h2_data(struct h2_conn *h, uint32_t id, int flags, size_t len)
+{
+    struct h2_stream *s = h2_find(h, id);
+    unsigned char inc[4];
+
+    if (id == 0 || id > h->last_id)
+        return(h2_goaway(h, H2_PROTOCOL_ERROR));
+    h2_put32(inc, len);
+    if (len > 0)
+        h2_queue(h, H2_WINDOW_UPDATE, 0, 0, inc, 4);
+    if (s == NULL || !s->body)
+        return(0);
+    if (flags & H2_END_STREAM)
+        s->body = 0;
+    else if (len > 0)
+        h2_queue(h, H2_WINDOW_UPDATE, 0, id, inc, 4);
+    return(0);
+}
+
+/**********************************************************************/
+/* The whole response of a stream is queued.  A client still sending a
+ * request body is told to stop.
+ * Parameters: the connection
+ *             the stream, which is freed */
+/**********************************************************************/
+void h2_end(struct h2_conn *h, struct h2_stream *s)
+{
+    if (s->body)
+        h2_reset(h, s->id, H2_NO_ERROR);
+    h2_close(h, s, 1);
+}
+
+/**********************************************************************/
+/* Answer a stream with one of the pre-rendered error pages.
+ * Parameters: the connection
+ *             the stream, with the status of its request set
+ *             one of the ERR_ constants */
+/**********************************************************************/
+void h2_error(struct h2_conn *h, struct h2_stream *s, int err)
+{
+    const struct error_page *p = &error_pages[err];
+
+    s->req.from = FROM_NONE;
+    s->data = p->data + p->head_len;
+    s->offset = 0;
+    s->end = p->len - p->head_len;
+    h2_reply(h, s, p->data, p->head_len);
+}
+
+/**********************************************************************/
+/* Look up an open stream.
+ * Parameters: the connection
+ *             the stream identifier
+ * Returns: the stream, or NULL if it is not open */
+/**********************************************************************/
+struct h2_stream *h2_find(struct h2_conn *h, uint32_t id)
+{
+    struct h2_stream *s;
+
+    for (s = h->streams; s != NULL && s->id != id; s = s->next)
+        ;
+    return(s);
+}
+
+/**********************************************************************/
+/* Send as much of the queued frames as the socket takes, paced for a
+ * client over a -r/-R byte rate.
+ * Parameter: the connection
+ * Returns: 0, or -1 if the connection failed */
+/**********************************************************************/
+int h2_flush(struct h2_conn *h)
+{
+    size_t len;
+    ssize_t n;
+
+    while (h->out_off < h->out_len)
+    {
+        len = h->out_len - h->out_off;
+        rate_wait(&len);
+        n = send(h->fd, h->out + h->out_off, len, 0);
+        if (n > 0)
+            h->out_off += n;
+        else if (n == -1 && errno == EINTR)
+            continue;
+        else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return(0);
+        else
+            return(-1);
+    }
+    h->out_off = h->out_len = 0;
+    return(0);
+}
+
+/**********************************************************************/
+/* Act on a frame from the client.
+ * Parameters: the connection
+ *             the type, flags and stream of the frame
+ *             its payload and the length of that
+ * Returns: 0, or -1 on a connection error */
+/**********************************************************************/
+int h2_frame(struct h2_conn *h, int type, int flags, uint32_t id,
+        const unsigned char *p, size_t len)
+{
+    struct h2_stream *s;
+    uint32_t inc;
+    size_t pad = 0;
+    int err;
+
+    if (h->block_id != 0 && (type != H2_CONTINUATION || id != h->block_id))
+        return(h2_goaway(h, H2_PROTOCOL_ERROR));
+    if (!h->settings && type != H2_SETTINGS)
+        return(h2_goaway(h, H2_PROTOCOL_ERROR));
+    switch (type)
+    {
+        case H2_DATA:
+            return(h2_data(h, id, flags, len));
+        case H2_HEADERS:
+            if (id == 0 || (id & 1) == 0)
+                return(h2_goaway(h, H2_PROTOCOL_ERROR));
+            if (flags & H2_PADDED)
+            {
+                if (len < 1)
+                    return(h2_goaway(h, H2_FRAME_SIZE_ERROR));
+                pad = *p++;
+                len--;
+            }
+            if (flags & H2_PRIO)    /* priorities are not honoured */
+            {
+                if (len < 5)
+                    return(h2_goaway(h, H2_FRAME_SIZE_ERROR));
+                p += 5;
+                len -= 5;
+            }
+            if (pad > len)
+                return(h2_goaway(h, H2_PROTOCOL_ERROR));
+            h->block_id = id;
+            h->block_flags = flags;
+            h->block_len = 0;
+            return(h2_block(h, flags, p, len - pad));
+        case H2_CONTINUATION:
+            if (h->block_id == 0)
+                return(h2_goaway(h, H2_PROTOCOL_ERROR));
+            return(h2_block(h, flags, p, len));
+        case H2_PRIORITY:
+            if (id == 0)
+                return(h2_goaway(h, H2_PROTOCOL_ERROR));
+            if (len != 5)
+                h2_reset(h, id, H2_FRAME_SIZE_ERROR);
+            return(0);
+        case H2_RST_STREAM:
+            if (id == 0 || id > h->last_id)
+                return(h2_goaway(h, H2_PROTOCOL_ERROR));
+            if (len != 4)
+                return(h2_goaway(h, H2_FRAME_SIZE_ERROR));
+            if ((s = h2_find(h, id)) != NULL)
+                h2_close(h, s, 1);
+            return(0);
+        case H2_SETTINGS:
+            if (id != 0)
+                return(h2_goaway(h, H2_PROTOCOL_ERROR));
+            if (flags & H2_ACK)
+                return(len == 0 ? 0 : h2_goaway(h, H2_FRAME_SIZE_ERROR));
+            if (len % 6 != 0)
+                return(h2_goaway(h, H2_FRAME_SIZE_ERROR));
+            if ((err = h2_settings(h, p, len)) != H2_NO_ERROR)
+                return(h2_goaway(h, err));
+            h->settings = 1;
+            h2_queue(h, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+            return(0);
+        case H2_PUSH_PROMISE:
+            return(h2_goaway(h, H2_PROTOCOL_ERROR));
+        case H2_PING:
+            if (id != 0)
+                return(h2_goaway(h, H2_PROTOCOL_ERROR));
+            if (len != 8)
+                return(h2_goaway(h, H2_FRAME_SIZE_ERROR));
+            if (!(flags & H2_ACK))
+                h2_queue(h, H2_PING, H2_ACK, 0, p, 8);
+            return(0);
+        case H2_GOAWAY:
+            h->goaway = 1;  /* the streams already open are finished */
+            return(0);
+        case H2_WINDOW_UPDATE:
+            if (len != 4)
+                return(h2_goaway(h, H2_FRAME_SIZE_ERROR));
+            inc = h2_get32(p) & 0x7fffffff;
+            if (id == 0)
+            {
+                if (inc == 0)
+                    return(h2_goaway(h, H2_PROTOCOL_ERROR));
+                if (h->window + inc > 0x7fffffff)
+                    return(h2_goaway(h, H2_FLOW_CONTROL_ERROR));
+                h->window += inc;
+            }
+            else if ((s = h2_find(h, id)) != NULL)
+            {
+                if (inc == 0 || s->window + inc > 0x7fffffff)
+                {
+                    h2_reset(h, id, inc == 0 ? H2_PROTOCOL_ERROR :
+                            H2_FLOW_CONTROL_ERROR);
+                    h2_close(h, s, 1);
+                }
+                else
+                    s->window += inc;
+            }
+            return(0);
+    }
+    return(0);      /* unknown frame types are ignored */
+}
+
+/**********************************************************************/
+/* Read a 32-bit number in network byte order.
+ * Parameter: its first byte
+ * Returns: the number */
+/**********************************************************************/
+uint32_t h2_get32(const unsigned char *p)
+{
+    return((uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]);
+}
+
+/**********************************************************************/
+/* Queue a GOAWAY: no more streams are taken after the last one the
+ * client opened.  Without an error, those that are open are finished
+ * before the connection is closed.
+ * Parameters: the connection
+ *             the error code, H2_NO_ERROR for a graceful close
+ * Returns: 0 for H2_NO_ERROR, otherwise -1 */
+/**********************************************************************/
+int h2_goaway(struct h2_conn *h, int err)
+{
+    unsigned char p[8];
+
+    h2_put32(p, h->last_id);
+    h2_put32(p + 4, err);
+    h2_queue(h, H2_GOAWAY, 0, 0, p, 8);
+    h->goaway = 1;
+    return(err == H2_NO_ERROR ? 0 : -1);
+}
+
+/**********************************************************************/
+/* Check the rest of the client preface, then act on the complete
+ * frames that have come in.  Frames stay in the buffer while there is
+ * not room enough queued output for what they might provoke, so a
+ * client that does not read cannot make the server queue without end.
+ * Parameter: the connection
+ * Returns: 0, or -1 if the connection is to be closed */
+/**********************************************************************/
+int h2_input(struct h2_conn *h)
+{
+    const unsigned char *p;
+    size_t off = 0, len;
+    int ret = 0;
+
+    if (h->expect_len > 0)
+    {
+        off = h->in_len < h->expect_len ? h->in_len : h->expect_len;
+        if (memcmp(h->in, h->expect, off) != 0)
+            return(-1);
+        h->expect += off;
+        h->expect_len -= off;
+    }
+    while (ret == 0 && h->in_len - off >= 9 && h2_room(h) >= H2_RESERVE)
+    {
+        p = h->in + off;
+        len = p[0] << 16 | p[1] << 8 | p[2];
+        if (len > H2_FRAME)
+        {
+            ret = h2_goaway(h, H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (h->in_len - off < 9 + len)
+            break;
+        ret = h2_frame(h, p[3], p[4], h2_get32(p + 5) & 0x7fffffff, p + 9,
+                len);
+        off += 9 + len;
+    }
+    h->in_len -= off;
+    memmove(h->in, h->in + off, h->in_len);
+    return(ret);
+}
+
+/**********************************************************************/
+/* Open a stream for a request, unless the connection is going away or
+ * the client has as many streams open as it may.  -n counts streams
+ * like it counts requests on an HTTP/1.x connection.
+ * Parameters: the connection
+ *             the stream identifier
+ * Returns: the stream, or NULL if it is refused */
+/**********************************************************************/
+struct h2_stream *h2_open(struct h2_conn *h, uint32_t id)
+{
+    struct h2_stream *s, **pp;
+
+    if (h->goaway || h->nstreams >= H2_STREAMS ||
+            (s = calloc(1, sizeof(*s))) == NULL)
+        return(NULL);
+    s->id = id;
+    s->window = h->initial;
+    s->file = -1;
+    for (pp = &h->streams; *pp != NULL; pp = &(*pp)->next)
+        ;
+    *pp = s;
+    h->nstreams++;
+    atomic_fetch_add(&h2_streams, 1);
+    if (++h->requests >= keepalive_max || atomic_load(&draining))
+        h2_goaway(h, H2_NO_ERROR);
+    return(s);
+}
+
+/**********************************************************************/
+/* Check whether a request head is the start of the HTTP/2 client
+ * preface: "PRI * HTTP/2.0", then an empty line.  The rest of the
+ * preface follows it.
+ * Parameters: the head and its length
+ * Returns: true if it is */
+/**********************************************************************/
+int h2_preface(const char *buf, size_t len)
+{
+    return(len == H2_PRI_LEN && memcmp(buf, H2_PREFACE, H2_PRI_LEN) == 0);
+}
+
+/**********************************************************************/
+/* Queue DATA frames for the streams with a body to send, a frame from
+ * each in turn, so that a large file does not hold up the small ones
+ * requested next to it.  Each stream goes as far as its window and the
+ * connection window let it; bodies come from memory or are read from
+ * their file straight into the output buffer.  Nothing is sent before
+ * the client's SETTINGS: after an upgrade, clients such as curl take
+ * only so much data behind the 101 response.
+ * Parameter: the connection
+ * Returns: true if it stopped for want of room in the output buffer */
+/**********************************************************************/
+int h2_pump(struct h2_conn *h)
+{
+    struct h2_stream *s, *next;
+    unsigned char *p;
+    int more = h->settings;
+    off_t n;
+
+    while (more)
+    {
+        more = 0;
+        for (s = h->streams; s != NULL; s = next)
+        {
+            next = s->next;
+            if (!s->sending)
+                continue;
+            n = s->end - s->offset;
+            if (n > H2_FRAME)
+                n = H2_FRAME;
+            if (n > s->window)
+                n = s->window;
+            if (n > h->window)
+                n = h->window;
+            if (n <= 0)
+                continue;       /* until a WINDOW_UPDATE */
+            if (h2_room(h) < (size_t)n + 9 + H2_RESERVE)
+                return(1);
+            p = h->out + h->out_len + 9;
+            if (s->data != NULL)
+                memcpy(p, s->data + s->offset, n);
+            else if (pread(s->file, p, n, s->offset) != n)
+            {
+                h2_reset(h, s->id, H2_INTERNAL_ERROR);
+                h2_close(h, s, 1);
+                continue;
+            }
+            s->offset += n;
+            s->window -= n;
+            h->window -= n;
+            s->req.sent += n;
+            h2_queue(h, H2_DATA, s->offset == s->end ? H2_END_STREAM : 0,
+                    s->id, NULL, n);
+            if (s->offset == s->end)
+                h2_end(h, s);
+            more = 1;
+        }
+    }
+    return(0);
+}
+
+/**********************************************************************/
+/* Write a 32-bit number in network byte order.
+ * Parameters: where its first byte goes
+ *             the number */
+/**********************************************************************/
+void h2_put32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/**********************************************************************/
+/* Append a frame to the output buffer.  Callers see to it that there
+ * is room: h2_input() keeps H2_RESERVE bytes free for anything but
+ * DATA frames, which h2_pump() sizes to fit.
+ * Parameters: the connection
+ *             the type, flags and stream of the frame
+ *             its payload, or NULL if that is in place already, and
+ *             the length of that */
+/**********************************************************************/
+void h2_queue(struct h2_conn *h, int type, int flags, uint32_t id,
+        const void *payload, size_t len)
+{
+    unsigned char *p;
+
+    if (h2_room(h) < len + 9)
+        return;
+    p = h->out + h->out_len;
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    h2_put32(p + 5, id);
+    if (payload != NULL)
+        memcpy(p + 9, payload, len);
+    h->out_len += 9 + len;
+}
+
+/**********************************************************************/
+/* Queue the HEADERS of a response, made from its HTTP/1.1 head: the
+ * status line becomes :status, header names go lower case, and those
+ * about the connection are left out.  With a body still to send the
+ * stream moves on to DATA frames, otherwise it is done.
+ * Parameters: the connection
+ *             the stream, with the body it is to send set up
+ *             the HTTP/1.1 head, which may or may not end with the
+ *             empty line, and its length */
+/**********************************************************************/
+void h2_reply(struct h2_conn *h, struct h2_stream *s, const char *text,
+        size_t len)
+{
+    static const char *hop[] = { "connection", "keep-alive",
+        "transfer-encoding", "upgrade", NULL };
+    unsigned char block[4096];
+    char name[64];
+    char value[1024];
+    const char *p, *next, *eol, *colon, *end = text + len;
+    size_t n = 0, i;
+
+    if (h->table_update)
+    {
+        hpack_resize(&h->enc, h->table_want);
+        n += hpack_put_int(block, 5, 0x20, h->table_want);
+        h->table_update = 0;
+    }
+    snprintf(value, sizeof(value), "%.3s", len > 12 ? text + 9 : "500");
+    n += hpack_encode(h, block + n, ":status", value);
+    for (p = memchr(text, '\n', len); p != NULL && ++p < end; p = next)
+    {
+        next = memchr(p, '\n', end - p);
+        eol = next != NULL ? next : end;
+        if (eol > p && eol[-1] == '\r')
+            eol--;
+        if (eol == p)
+            break;
+        colon = memchr(p, ':', eol - p);
+        if (colon == NULL || colon - p >= (int)sizeof(name))
+            continue;
+        for (i = 0; p + i < colon; i++)
+            name[i] = tolower((unsigned char)p[i]);
+        name[i] = '\0';
+        for (colon++; colon < eol && ISspace(*colon); colon++)
+            ;
+        snprintf(value, sizeof(value), "%.*s", (int)(eol - colon), colon);
+        for (i = 0; hop[i] != NULL && strcmp(hop[i], name) != 0; i++)
+            ;
+        if (hop[i] != NULL ||
+                n + strlen(name) + strlen(value) + 16 > sizeof(block))
+            continue;
+        n += hpack_encode(h, block + n, name, value);
+    }
+    s->req.sent += n;
+    h2_queue(h, H2_HEADERS, H2_END_HEADERS |
+            (s->offset == s->end ? H2_END_STREAM : 0), s->id, block, n);
+    if (s->offset < s->end)
+        s->sending = 1;
+    else
+        h2_end(h, s);
+}
+
+/**********************************************************************/
+/* A header block is complete: open a stream for the request in it and
+ * answer that.  Blocks for streams that are open already (trailers) or
+ * refused are still decoded, to keep the dynamic table in step.
+ * Parameters: the connection, with the block in block
+ *             the stream identifier
+ *             true if the HEADERS frame ended the stream
+ * Returns: 0, or -1 on a connection error */
+/**********************************************************************/
+int h2_request(struct h2_conn *h, uint32_t id, int end_stream)
+{
+    struct h2_stream *s = h2_find(h, id);
+    char head[HEAD_MAX];
+    size_t len;
+    int ret;
+
+    if (s != NULL || id <= h->last_id)
+    {
+        if (hpack_decode(h, head, sizeof(head), &len) == -1)
+            return(h2_goaway(h, H2_COMPRESSION_ERROR));
+        if (s != NULL && end_stream)
+            s->body = 0;
+        return(0);
+    }
+    h->last_id = id;
+    if ((s = h2_open(h, id)) == NULL)
+    {
+        if (hpack_decode(h, head, sizeof(head), &len) == -1)
+            return(h2_goaway(h, H2_COMPRESSION_ERROR));
+        h2_reset(h, id, H2_REFUSED_STREAM);
+        return(0);
+    }
+    s->body = !end_stream;
+    ret = hpack_decode(h, s->head, sizeof(s->head), &len);
+    if (ret == -1)
+        return(h2_goaway(h, H2_COMPRESSION_ERROR));
+    if (ret == 1)
+    {
+        h2_reset(h, id, H2_PROTOCOL_ERROR);
+        h2_close(h, s, 0);
+    }
+    else if (ret == 2)
+    {
+        s->req.status = 431;
+        h2_error(h, s, ERR_TOO_LARGE);
+    }
+    else if (parse_request(&s->req, s->head, len) < 0)
+    {
+        s->req.status = 501;
+        h2_error(h, s, ERR_UNIMPLEMENTED);
+    }
+    else
+        h2_respond(h, s);
+    return(0);
+}
+
+/**********************************************************************/
+/* Queue a RST_STREAM.
+ * Parameters: the connection
+ *             the stream identifier
+ *             the error code */
+/**********************************************************************/
+void h2_reset(struct h2_conn *h, uint32_t id, int err)
+{
+    unsigned char p[4];
+
+    h2_put32(p, err);
+    h2_queue(h, H2_RST_STREAM, 0, id, p, 4);
+}
+
+/**********************************************************************/
+/* Route the request of a new stream and set its response going, from
+ * wherever an HTTP/1.x response would come from.  Several byte ranges
+ * are answered with the whole file rather than a multipart body, and
+ * CGI requests are refused with HTTP_1_1_REQUIRED, which has clients
+ * retry them over HTTP/1.1.
+ * Parameters: the connection
+ *             the stream, with its request parsed */
+/**********************************************************************/
+void h2_respond(struct h2_conn *h, struct h2_stream *s)
+{
+    struct request *req = &s->req;
+    const struct snap_body *b;
+    struct cache_entry *e = NULL;
+    char head[1024];
+    size_t len;
+    int hit = 0;
+
+    req->start = monotonic_usec();
+    req->peer = h->peer;
+    req->keep_alive = 1;
+    switch (route_request(req))
+    {
+        case ROUTE_CGI:
+            h2_reset(h, s->id, H2_HTTP_1_1_REQUIRED);
+            h2_close(h, s, 0);
+            return;
+        case ROUTE_STATS:
+            req->status = 200;
+            if ((s->buf = malloc(8192)) == NULL ||
+                    (len = stats_response(s->buf, 8192, req)) == 0)
+            {
+                h2_reset(h, s->id, H2_INTERNAL_ERROR);
+                h2_close(h, s, 0);
+                return;
+            }
+            s->data = strstr(s->buf, "\r\n\r\n") + 4;
+            s->end = s->buf + len - s->data;
+            h2_reply(h, s, s->buf, s->data - s->buf);
+            return;
+        case ROUTE_NOT_FOUND:
+            req->status = 404;
+            h2_error(h, s, ERR_NOT_FOUND);
+            return;
+        case ROUTE_LIMITED:
+            req->status = 429;
+            h2_error(h, s, ERR_LIMITED);
+            return;
+    }
+    if (req->nranges > 1)
+    {
+        req->nranges = 0;
+        req->length = req->st.st_size;
+    }
+    req->status = response_status(req);
+    if (req->status == 404)
+    {
+        h2_error(h, s, ERR_NOT_FOUND);
+        return;
+    }
+    b = req->snap_body;
+    if (!req->not_modified && req->nranges >= 0)
+    {
+        if ((e = req->zip) != NULL)
+        {
+            req->zip = NULL;
+            req->from = FROM_ZIP;
+        }
+        else if ((e = req->listing) != NULL)
+        {
+            req->listing = NULL;
+            req->from = FROM_LISTING;
+        }
+        else if (req->nranges == 0 && b != NULL)
+        {
+            req->from = FROM_SNAPSHOT;
+            s->data = req->snap->base + b->body_off;
+            s->end = b->size;
+            h2_reply(h, s, req->snap->base + b->hdr_off, b->hdr_len);
+            return;
+        }
+        else if (req->nranges == 0 && (e = cache_get(req, &hit)) != NULL)
+            req->from = hit ? FROM_CACHE : FROM_FILE;
+        if (e != NULL)
+        {
+            s->entry = e;
+            s->data = e->data + e->hdr_len;
+            s->end = e->size;
+            h2_reply(h, s, e->data, e->hdr_len);
+            return;
+        }
+        req->from = FROM_FILE;
+        s->file = req->fd;
+        s->offset = req->base;
+        s->end = req->base + req->st.st_size;
+        if (req->nranges == 1)
+        {
+            s->offset = req->base + req->ranges[0].first;
+            s->end = req->base + req->ranges[0].last + 1;
+        }
+    }
+    len = format_entity(head, sizeof(head), req);
+    h2_reply(h, s, head, len);
+}
+
+/**********************************************************************/
+/* Make room at the end of the output buffer by moving what is still
+ * to be sent to its start.
+ * Parameter: the connection
+ * Returns: the bytes free after it */
+/**********************************************************************/
+size_t h2_room(struct h2_conn *h)
+{
+    if (h->out_off > 0)
+    {
+        h->out_len -= h->out_off;
+        memmove(h->out, h->out + h->out_off, h->out_len);
+        h->out_off = 0;
+    }
+    return(sizeof(h->out) - h->out_len);
+}
+
+/**********************************************************************/
+/* Serve an h2c connection until either side is done with it.  The
+ * socket is switched to non-blocking mode; the thread polls it for
+ * frames from the client and, while there is output queued, for room
+ * to send.  It is closed after -k seconds without a stream open, or
+ * -T seconds without progress while there is one.
+ * Parameters: the socket
+ *             the client address, for the rate limits
+ *             the HTTP/1.1 request that asked for an upgrade, which
+ *             becomes stream 1, or NULL after a prior knowledge
+ *             preface (whose first H2_PRI_LEN bytes have been taken)
+ *             bytes already received after that, and how many */
+/**********************************************************************/
+void h2_serve(int fd, in_addr_t peer, const struct request *upgrade,
+        const char *rest, size_t len)
+{
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\n"
+        "Connection: Upgrade\r\n"
+        "Upgrade: h2c\r\n\r\n";
+    static const unsigned char settings[] = {
+        0, 3, 0, 0, 0, H2_STREAMS   /* SETTINGS_MAX_CONCURRENT_STREAMS */
+    };
+    unsigned char buf[256];
+    struct h2_conn *h;
+    struct h2_stream *s;
+    struct pollfd pfd;
+    ssize_t n;
+    int secs, full;
+
+    pthread_once(&hpack_once, hpack_init);
+    if ((h = calloc(1, sizeof(*h))) == NULL)
+        return;
+    atomic_fetch_add(&h2_conns, 1);
+    h->fd = fd;
+    h->peer = peer;
+    h->window = h->initial = H2_WINDOW;
+    h->dec.max = h->enc.max = H2_TABLE;
+    h->expect = upgrade != NULL ? H2_PREFACE : H2_PREFACE + H2_PRI_LEN;
+    h->expect_len = strlen(h->expect);
+    memcpy(h->in, rest, len);
+    h->in_len = len;
+    rate_peer = peer;
+    set_nonblocking(fd);
+    if (upgrade != NULL)
+    {
+        memcpy(h->out, switching, sizeof(switching) - 1);
+        h->out_len = sizeof(switching) - 1;
+    }
+    h2_queue(h, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+    if (upgrade != NULL && (s = h2_open(h, 1)) != NULL)
+    {
+        /* the settings that came with the upgrade count as the
+         * client's; it still sends a SETTINGS frame after the preface */
+        n = h2_base64(upgrade->http2_settings, buf, sizeof(buf));
+        if (n > 0 && n % 6 == 0)
+            h2_settings(h, buf, n);
+        s->window = h->initial;
+        s->req = *upgrade;
+        h->last_id = 1;
+        h2_respond(h, s);
+    }
+
+    while (1)
+    {
+        if (h2_input(h) == -1)
+        {
+            h2_flush(h);
+            break;
+        }
+        full = h2_pump(h);
+        if (h2_flush(h) == -1)
+            break;
+        if (h->goaway && h->nstreams == 0 && h->out_len == 0)
+            break;
+        pfd.fd = fd;
+        pfd.events = (h->in_len < sizeof(h->in) ? POLLIN : 0) |
+            (h->out_len > 0 || full ? POLLOUT : 0);
+        secs = h->out_len > 0 || h->nstreams > 0 ? io_timeout :
+            h->settings ? keepalive_timeout : request_timeout;
+        n = poll(&pfd, 1, secs > 0 ? secs * 1000 : 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == 0)
+        {
+            atomic_fetch_add(&conn_timeouts, 1);
+            if (h->nstreams == 0)
+            {
+                h2_goaway(h, H2_NO_ERROR);
+                h2_flush(h);
+            }
+            break;
+        }
+        if (n == -1)
+            break;
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            n = recv(fd, h->in + h->in_len, sizeof(h->in) - h->in_len, 0);
+            if (n == 0 || (n == -1 && errno != EINTR && errno != EAGAIN))
+                break;
+            if (n > 0)
+                h->in_len += n;
+        }
+    }
+
+    while (h->streams != NULL)     /* cut short */
+        h2_close(h, h->streams, 1);
+    hpack_clear(&h->dec);
+    hpack_clear(&h->enc);
+    free(h);
+    rate_peer = INADDR_ANY;
+}
+
+/**********************************************************************/
+/* Apply the client's settings, from a SETTINGS frame or the
+ * HTTP2-Settings header of an upgrade.  A new initial window moves the
+ * windows of the open streams along with it.
+ * Parameters: the connection
+ *             the settings and their length, a multiple of six
+ * Returns: H2_NO_ERROR, or the code of the connection error */
+/**********************************************************************/
+int h2_settings(struct h2_conn *h, const unsigned char *p, size_t len)
+{
+    struct h2_stream *s;
+    uint32_t v;
+    size_t i;
+
+    for (i = 0; i + 6 <= len; i += 6)
+    {
+        v = h2_get32(p + i + 2);
+        switch (p[i] << 8 | p[i + 1])
+        {
+            case 1:     /* SETTINGS_HEADER_TABLE_SIZE */
+                h->table_want = v < H2_TABLE ? v : H2_TABLE;
+                h->table_update = h->table_want != h->enc.max;
+                break;
+            case 4:     /* SETTINGS_INITIAL_WINDOW_SIZE */
+                if (v > 0x7fffffff)
+                    return(H2_FLOW_CONTROL_ERROR);
+                for (s = h->streams; s != NULL; s = s->next)
+                    s->window += (int64_t)v - h->initial;
+                h->initial = v;
+                break;
+            case 5:     /* SETTINGS_MAX_FRAME_SIZE: ours are smaller */
+                if (v < H2_FRAME || v > 0xffffff)
+                    return(H2_PROTOCOL_ERROR);
+                break;
+        }
+    }
+    return(H2_NO_ERROR);
+}
+
+/**********************************************************************/
+/* Serve a connection of an event loop that turned out to speak h2c, on
+ * a thread of its own.
+ * Parameter: the connection, holding the preface or the upgrade
+ *            request and whatever came after it */
+/**********************************************************************/
+void h2_thread(void *arg)
+{
+    struct conn *c = arg;
+
+    h2_serve(c->fd, c->peer,
+            h2_preface(c->rbuf, c->head_len) ? NULL : &c->req,
+            c->rbuf + c->head_len, c->rlen - c->head_len);
+    ip_release(c->peer);
+    if (stats_self() != NULL)
+        stat_add(&stats_mine->closed, 1);
+    linger_close(c->fd);
+    free(c);
+}
+
+/**********************************************************************/
+/* Check whether an HTTP/1.1 request asks to switch to h2c.  Requests
+ * with a body are served over HTTP/1.1 instead.
+ * Parameter: the parsed request
+ * Returns: true if the connection is to be upgraded */
+/**********************************************************************/
+int h2_upgrade(const struct request *req)
+{
+    return(req->http2_settings != NULL && req->version >= 11 &&
+            !req->cgi && req->content_length <= 0 &&
+            strcasestr(req->upgrade, "h2c") != NULL);
+}
+
+/**********************************************************************/
+/* Find the end of a request head: the empty line after the headers.
+ * Lines may end in CRLF or a bare LF.  The scan picks up where the
+ * previous call for the same head left off, so bytes that trickle in
+ * are only looked at once.
+ * Parameters: the bytes received so far and how many there are
+ *             in/out offset to resume scanning from, 0 for a new head
+ * Returns: the length of the head including the empty line, or 0 if
+ *          it is not complete yet */
+/**********************************************************************/
+size_t head_length(const char *buf, size_t len, size_t *scan)
+{
+    const char *lf;
+    size_t i = *scan;
+
+    while ((lf = memchr(buf + i, '\n', len - i)) != NULL)
+    {
+        i = lf - buf;
+        if (i + 1 == len || (buf[i + 1] == '\r' && i + 2 == len))
+            break;      /* too early to tell */
+        if (buf[i + 1] == '\n')
+            return(i + 2);
+        if (buf[i + 1] == '\r' && buf[i + 2] == '\n')
+            return(i + 3);
+        i++;
+    }
+    *scan = (lf != NULL) ? i : len;
+    return(0);
+}
+
+/**********************************************************************/
+/* Return the informational HTTP headers about a file.  When file
+ * data follows they are sent with MSG_MORE, so they leave in the same
+ * segment as the start of the body rather than on their own. */
+/* Parameters: the socket to print the headers on
+ *             the request for the file
+ * Returns: the length of the headers */
+/**********************************************************************/
+int headers(int client, const struct request *req)
+{
+    char buf[1024];
+    int len;
+
+    len = format_headers(buf, sizeof(buf), req);
+    send(client, buf, len, req->nranges < 0 || req->not_modified ||
+            req->length == 0 ? 0 : MSG_MORE);
+    TRACE_MARK(TRACE_FIRST_SEND);
+    return(len);
+}
+
+/**********************************************************************/
+/* Count a value into a histogram.  Only the thread owning the
+ * histogram writes to it.
+ * Parameters: the histogram
+ *             the value, in microseconds */
+/**********************************************************************/
+void hist_add(struct hist *h, uint64_t v)
+{
+    stat_add(&h->buckets[hist_bucket(v)], 1);
+    stat_add(&h->sum, v);
+    if (v > atomic_load_explicit(&h->max, memory_order_relaxed))
+        atomic_store_explicit(&h->max, v, memory_order_relaxed);
+}
+
+/**********************************************************************/
+/* The bucket of a histogram a value falls in: values below 16 have a
+ * bucket each, larger ones share one with the values that agree with
+ * them in the top five bits.
+ * Parameter: the value
+ * Returns: the index of the bucket */
+/**********************************************************************/
+int hist_bucket(uint64_t v)
+{
+    int e;
+
+    if (v >= 1ULL << HIST_MAX_EXP)
+        v = (1ULL << HIST_MAX_EXP) - 1;
+    if (v < 1 << HIST_SUB_BITS)
+        return(v);
+    e = 63 - __builtin_clzll(v);
+    return(((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+            ((v >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1)));
+}
+
+/**********************************************************************/
+/* Read a percentile off a histogram.
+ * Parameters: the histogram
+ *             the fraction of values that must not be above the result
+ * Returns: the highest value of the bucket the percentile falls in,
+ *          but no more than the largest value seen */
+/**********************************************************************/
+uint64_t hist_percentile(const struct hist_total *t, double q)
+{
+    uint64_t want = q * t->count;
+    uint64_t seen = 0;
+    int i;
+
+    if (want < q * t->count)
+        want++;
+    if (want == 0)
+        want = 1;
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += t->buckets[i];
+        if (seen >= want)
+            return(hist_value(i) < t->max ? hist_value(i) : t->max);
+    }
+    return(t->max);
+}
+
+/**********************************************************************/
+/* The highest value that falls in a bucket, see hist_bucket().
+ * Parameter: the index of the bucket
+ * Returns: the value */
+/**********************************************************************/
+uint64_t hist_value(int i)
+{
+    int e;
+
+    if (i < 1 << HIST_SUB_BITS)
+        return(i);
+    e = (i >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    return((((uint64_t)(i & ((1 << HIST_SUB_BITS) - 1)) +
+                    (1 << HIST_SUB_BITS) + 1) << (e - HIST_SUB_BITS)) - 1);
+}
+
+/**********************************************************************/
+/* Add a field to an HPACK dynamic table, evicting the oldest ones to
+ * make room.  A field larger than the whole table empties it.
+ * Parameters: the table
+ *             the name and the value
+ * Returns: 0, or -1 if out of memory, with the table unchanged */
+/**********************************************************************/
+int hpack_add(struct hpack_table *t, const char *name, const char *value)
+{
+    size_t nlen = strlen(name), vlen = strlen(value);
+    size_t size = nlen + vlen + 32;
+    struct hpack_field *f;
+    char *p = NULL;
+
+    if (size <= t->max && (p = malloc(nlen + vlen + 2)) == NULL)
+        return(-1);     /* before anything is evicted */
+    while (t->count > 0 && t->size + size > t->max)
+    {
+        f = &t->fields[(t->first + t->count - 1) % (H2_TABLE / 32)];
+        free(f->name);
+        t->size -= f->size;
+        t->count--;
+    }
+    if (p == NULL)
+        return(0);
+    memcpy(p, name, nlen + 1);
+    memcpy(p + nlen + 1, value, vlen + 1);
+    t->first = (t->first + H2_TABLE / 32 - 1) % (H2_TABLE / 32);
+    f = &t->fields[t->first];
+    f->name = p;
+    f->value = p + nlen + 1;
+    f->size = size;
+    t->count++;
+    t->size += size;
+    return(0);
+}
+
+/**********************************************************************/
+/* Empty an HPACK dynamic table.
+ * Parameter: the table */
+/**********************************************************************/
+void hpack_clear(struct hpack_table *t)
+{
+    hpack_resize(t, 0);
+}
+
+/**********************************************************************/
+/* Decode the header block of a request and rebuild the request as an
+ * HTTP/1.1 head for parse_request(): the pseudo-headers make up the
+ * request line, :authority becomes Host, and the other fields follow
+ * as they are.  The whole block is decoded even when the request turns
+ * out malformed, so that the dynamic table stays in step.
+ * Parameters: the connection, with the block in block
+ *             the buffer for the head and its size
+ *             out: the length of the head
+ * Returns: 0 on success, 1 if the request is malformed, 2 if its head
+ *          does not fit, -1 if the block cannot be decoded */
+/**********************************************************************/
+int hpack_decode(struct h2_conn *h, char *head, size_t size, size_t *len)
+{
+    const unsigned char *p = h->block, *end = h->block + h->block_len;
+    const char *name, *value;
+    char method[16];
+    uint32_t index;
+    size_t lines = 0;
+    int regular = 0, ret = 0, b, n;
+
+    method[0] = h->path[0] = h->lines[0] = '\0';
+    while (p < end)
+    {
+        b = *p;
+        if (b & 0x80)           /* indexed */
+        {
+            if (hpack_int(&p, end, 7, &index) == -1 ||
+                    hpack_lookup(&h->dec, index, &name, &value) == -1)
+                return(-1);
+        }
+        else if ((b & 0xe0) == 0x20)    /* dynamic table size update */
+        {
+            if (hpack_int(&p, end, 5, &index) == -1 || index > H2_TABLE)
+                return(-1);
+            hpack_resize(&h->dec, index);
+            continue;
+        }
+        else                    /* literal, indexed (0x40) or not */
+        {
+            if (hpack_int(&p, end, b & 0x40 ? 6 : 4, &index) == -1)
+                return(-1);
+            if (index != 0)
+            {
+                if (hpack_lookup(&h->dec, index, &name, &value) == -1)
+                    return(-1);
+                snprintf(h->name, sizeof(h->name), "%s", name);
+            }
+            else if (hpack_string(&p, end, h->name, sizeof(h->name)) == -1)
+                return(-1);
+            if (hpack_string(&p, end, h->value, sizeof(h->value)) == -1)
+                return(-1);
+            if ((b & 0x40) && hpack_add(&h->dec, h->name, h->value) == -1)
+                return(-1);
+            name = h->name;
+            value = h->value;
+        }
+        if (ret != 0)
+            continue;
+        if (strpbrk(name, "\r\n") != NULL || strpbrk(value, "\r\n") != NULL)
+            ret = 1;
+        else if (name[0] == ':' && regular)
+            ret = 1;
+        else if (strcmp(name, ":method") == 0)
+            ret = snprintf(method, sizeof(method), "%s", value) >=
+                (int)sizeof(method);
+        else if (strcmp(name, ":path") == 0)
+            ret = snprintf(h->path, sizeof(h->path), "%s", value) >=
+                (int)sizeof(h->path) ? 2 : 0;
+        else if (strcmp(name, ":authority") == 0)
+            name = "host";
+        else if (name[0] == ':' && strcmp(name, ":scheme") != 0)
+            ret = 1;
+        else if (name[0] != ':')
+        {
+            regular = 1;
+            for (n = 0; name[n] != '\0' && !isupper((unsigned char)name[n]);
+                    n++)
+                ;
+            if (name[n] != '\0')
+                ret = 1;
+        }
+        if (ret != 0 || name[0] == ':')
+            continue;
+        n = snprintf(h->lines + lines, sizeof(h->lines) - lines,
+                "%s: %s\r\n", name, value);
+        if (n >= (int)(sizeof(h->lines) - lines))
+            ret = 2;
+        else
+            lines += n;
+    }
+    if (ret == 0 && (method[0] == '\0' || h->path[0] != '/'))
+        ret = 1;
+    if (ret != 0)
+        return(ret);
+    n = snprintf(head, size, "%s %s HTTP/1.1\r\n%s\r\n", method, h->path,
+            h->lines);
+    if (n >= (int)size)
+        return(2);
+    *len = n;
+    return(0);
+}
+
+/**********************************************************************/
+/* Encode a header field of a response.  A field found whole in the
+ * static or dynamic table goes out as its index; anything else is a
+ * literal, with an indexed name where there is one, which is added to
+ * the dynamic table unless its value changes from one response to the
+ * next.  Strings are not Huffman coded.
+ * Parameters: the connection, whose enc table is used
+ *             the buffer, with room for the field plus 16 bytes
+ *             the name, in lower case, and the value
+ * Returns: the length of the encoding */
+/**********************************************************************/
+size_t hpack_encode(struct h2_conn *h, unsigned char *buf, const char *name,
+        const char *value)
+{
+    static const char *unique[] = { "content-length", "content-range",
+        "etag", "last-modified", NULL };
+    const struct hpack_table *t = &h->enc;
+    const struct hpack_field *f;
+    uint32_t index = 0;
+    size_t n, len;
+    int i, add = 1;
+
+    for (i = 0; i < 61; i++)
+        if (strcmp(hpack_static[i][0], name) == 0)
+        {
+            if (strcmp(hpack_static[i][1], value) == 0)
+                return(hpack_put_int(buf, 7, 0x80, i + 1));
+            if (index == 0)
+                index = i + 1;
+        }
+    for (i = 0; i < t->count; i++)
+    {
+        f = &t->fields[(t->first + i) % (H2_TABLE / 32)];
+        if (strcmp(f->name, name) == 0)
+        {
+            if (strcmp(f->value, value) == 0)
+                return(hpack_put_int(buf, 7, 0x80, 62 + i));
+            if (index == 0)
+                index = 62 + i;
+        }
+    }
+    for (i = 0; unique[i] != NULL; i++)
+        if (strcmp(unique[i], name) == 0)
+            add = 0;
+again:
+    n = add ? hpack_put_int(buf, 6, 0x40, index) :
+        hpack_put_int(buf, 4, 0x00, index);
+    if (index == 0)
+    {
+        len = strlen(name);
+        n += hpack_put_int(buf + n, 7, 0x00, len);
+        memcpy(buf + n, name, len);
+        n += len;
+    }
+    len = strlen(value);
+    n += hpack_put_int(buf + n, 7, 0x00, len);
+    memcpy(buf + n, value, len);
+    n += len;
+    if (add && hpack_add(&h->enc, name, value) == -1)
+    {
+        add = 0;        /* the client must not index it either */
+        goto again;
+    }
+    return(n);
+}
+
+/**********************************************************************/
+/* Decode a Huffman coded string.  The code being canonical, a code of
+ * each length is a symbol exactly when it falls within the codes
+ * hpack_init() found for that length.
+ * Parameters: the coded bytes and how many there are
+ *             the buffer for the string and its size
+ * Returns: the length of the string, or -1 if the coding is invalid
+ *          or the string does not fit */
+/**********************************************************************/
+int hpack_huffman(const unsigned char *in, size_t n, char *out, size_t size)
+{
+    uint32_t code = 0;
+    size_t i, len = 0;
+    int bits = 0, ones = 1;
+    int bit, k, sym;
+
+    for (i = 0; i < n; i++)
+        for (k = 7; k >= 0; k--)
+        {
+            bit = in[i] >> k & 1;
+            code = code << 1 | bit;
+            ones &= bit;
+            bits++;
+            if (code - hpack_first[bits] < (uint32_t)hpack_count[bits])
+            {
+                sym = hpack_sorted[hpack_offset[bits] + code -
+                    hpack_first[bits]];
+                if (sym == 256 || len == size)
+                    return(-1);
+                out[len++] = sym;
+                code = 0;
+                bits = 0;
+                ones = 1;
+            }
+            else if (bits == 30)
+                return(-1);
+        }
+    /* what is left must be the start of EOS, less than a byte of it */
+    return(bits < 8 && ones ? (int)len : -1);
+}
+
+/**********************************************************************/
+/* Build the decoding tables of the Huffman code from hpack_lengths[]:
+ * the codes of each length are consecutive, starting where those of
+ * the length before ended, doubled, and go to the symbols in order. */
+/**********************************************************************/
+void hpack_init(void)
+{
+    uint32_t code = 0;
+    int bits, sym, n = 0;
+
+    for (bits = 1; bits <= 30; bits++)
+    {
+        hpack_first[bits] = code;
+        hpack_offset[bits] = n;
+        for (sym = 0; sym < 257; sym++)
+            if (hpack_lengths[sym] == bits)
+                hpack_sorted[n++] = sym;
+        hpack_count[bits] = n - hpack_offset[bits];
+        code = (code + hpack_count[bits]) << 1;
+    }
+}
+
+/**********************************************************************/
+/* Decode an HPACK integer with a prefix of so many bits.
+ * Parameters: in/out: where it starts, moved past it
+ *             the end of the block
+ *             the bits of the prefix
+ *             out: the value
+ * Returns: 0, or -1 if it is cut short or out of range */
+/**********************************************************************/
+int hpack_int(const unsigned char **p, const unsigned char *end, int bits,
+        uint32_t *v)
+{
+    uint32_t max = (1u << bits) - 1;
+    int shift = 0;
+    int b;
+
+    if (*p >= end)
+        return(-1);
+    *v = *(*p)++ & max;
+    if (*v < max)
+        return(0);
+    do
+    {
+        if (*p >= end || shift > 21)
+            return(-1);
+        b = *(*p)++;
+        *v += (uint32_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return(0);
+}
+
+/**********************************************************************/
+/* Look up an index in the static table, then the dynamic one.
+ * Parameters: the dynamic table
+ *             the index, from 1
+ *             out: the name and the value
+ * Returns: 0, or -1 if there is no such entry */
+/**********************************************************************/
+int hpack_lookup(const struct hpack_table *t, uint32_t index,
+        const char **name, const char **value)
+{
+    const struct hpack_field *f;
+
+    if (index == 0)
+        return(-1);
+    if (index <= 61)
+    {
+        *name = hpack_static[index - 1][0];
+        *value = hpack_static[index - 1][1];
+        return(0);
+    }
+    if (index - 62 >= (uint32_t)t->count)
+        return(-1);
+    f = &t->fields[(t->first + index - 62) % (H2_TABLE / 32)];
+    *name = f->name;
+    *value = f->value;
+    return(0);
+}
+
+/**********************************************************************/
+/* Encode an HPACK integer with a prefix of so many bits.
+ * Parameters: the buffer
+ *             the bits of the prefix
+ *             the bits of the first byte above the prefix
+ *             the value
+ * Returns: the length of the encoding */
+/**********************************************************************/
+size_t hpack_put_int(unsigned char *buf, int bits, int first, uint32_t v)
+{
+    uint32_t max = (1u << bits) - 1;
+    size_t n = 1;
+
+    if (v < max)
+    {
+        buf[0] = first | v;
+        return(1);
+    }
+    buf[0] = first | max;
+    for (v -= max; v >= 128; v >>= 7)
+        buf[n++] = (v & 0x7f) | 0x80;
+    buf[n++] = v;
+    return(n);
+}
+
+/**********************************************************************/
+/* Set the size of an HPACK dynamic table, evicting the oldest fields
+ * until they fit.
+ * Parameters: the table
+ *             the size in bytes, at most H2_TABLE */
+/**********************************************************************/
+void hpack_resize(struct hpack_table *t, size_t max)
+{
+    struct hpack_field *f;
+
+    t->max = max;
+    while (t->size > max)
+    {
+        f = &t->fields[(t->first + t->count - 1) % (H2_TABLE / 32)];
+        free(f->name);
+        t->size -= f->size;
+        t->count--;
+    }
+}
+
+/**********************************************************************/
+/* Decode an HPACK string literal, Huffman coded or not.
+ * Parameters: in/out: where it starts, moved past it
+ *             the end of the block
+ *             the buffer for the string and its size
+ * Returns: 0, or -1 if it is cut short, invalid, holds a null byte or
+ *          does not fit */
+/**********************************************************************/
+int hpack_string(const unsigned char **p, const unsigned char *end,
+        char *out, size_t size)
+{
+    uint32_t len;
+    int huffman, n;
+
+    if (*p >= end)
+        return(-1);
+    huffman = **p & 0x80;
+    if (hpack_int(p, end, 7, &len) == -1 || len > (size_t)(end - *p))
+        return(-1);
+    if (huffman)
+        n = hpack_huffman(*p, len, out, size - 1);
+    else if (len < size)
+    {
+        memcpy(out, *p, len);
+        n = len;
+    }
+    else
+        n = -1;
+    if (n == -1 || memchr(out, '\0', n) != NULL)
+        return(-1);
+    out[n] = '\0';
+    *p += len;
+    return(0);
+}
+
+/**********************************************************************/
+/* Copy a string into HTML text or a quoted attribute value.
+ * Parameters: where to put it, room for six times the string
+ *             the string
+ * Returns: the length of the output */
+/**********************************************************************/
+size_t html_escape(char *dst, const char *src)
+{
+    char *d = dst;
+
+    for (; *src != '\0'; src++)
+    {
+        switch (*src)
+        {
+            case '&':
+                d += sprintf(d, "&amp;");
+                break;
+            case '<':
+                d += sprintf(d, "&lt;");
+                break;
+            case '>':
+                d += sprintf(d, "&gt;");
+                break;
+            case '"':
+                d += sprintf(d, "&quot;");
+                break;
+            default:
+                *d++ = *src;
+        }
+    }
+    return(d - dst);
+}
+
+/**********************************************************************/
+/* Shorten a set of iovecs to the first so many bytes.
+ * Parameters: the iovecs
+ *             their number
+ *             the bytes to keep
+ *             out: what was cut off the last iovec kept, to be added
+ *             back if the iovecs are used again
+ * Returns: the number of iovecs kept */
+/**********************************************************************/
+int iov_clamp(struct iovec *iov, int cnt, size_t max, size_t *cut)
+{
+    int i;
+
+    *cut = 0;
+    for (i = 0; i < cnt; i++)
+    {
+        if (iov[i].iov_len >= max)
+        {
+            *cut = iov[i].iov_len - max;
+            iov[i].iov_len = max;
+            return(i + 1);
+        }
+        max -= iov[i].iov_len;
+    }
+    return(cnt);
+}
+
+/**********************************************************************/
+/* Add up the lengths of a set of iovecs.
+ * Parameters: the iovecs and their number
+ * Returns: the bytes they hold */
+/**********************************************************************/
+size_t iov_length(const struct iovec *iov, int cnt)
+{
+    size_t len = 0;
+
+    while (cnt-- > 0)
+        len += iov++->iov_len;
+    return(len);
+}
+
+/**********************************************************************/
+/* Count a new connection against the cap on connections per client
+ * address.  Connections that cannot be counted (no memory, no address)
+ * are let through.  The address is also what the rate limits go by.
+ * Parameters: the client socket
+ *             out: the client address, to hand to ip_release() when it
+ *             closes
+ * Returns: 0 if the connection may go on, -1 if the client already
+ *          holds its share */
+/**********************************************************************/
+int ip_admit(int fd, in_addr_t *peer)
+{
+    struct sockaddr_in name;
+    socklen_t len = sizeof(name);
+    struct ip_count **bucket, *e;
+    int ret = 0;
+
+    *peer = INADDR_ANY;
+    if ((ip_max <= 0 && rate_count == 0) ||
+            getpeername(fd, (struct sockaddr *)&name, &len) == -1 ||
+            name.sin_family != AF_INET)
+        return(0);
+    if (ip_max <= 0)
+    {
+        *peer = name.sin_addr.s_addr;
+        return(0);
+    }
+    bucket = &ip_table[(uint32_t)(name.sin_addr.s_addr * 2654435761u) >>
+        (32 - IP_BITS)];
+    pthread_mutex_lock(&ip_lock);
+    for (e = *bucket; e != NULL && e->addr != name.sin_addr.s_addr;
+            e = e->next)
+        ;
+    if (e == NULL && (e = calloc(1, sizeof(*e))) != NULL)
+    {
+        e->addr = name.sin_addr.s_addr;
+        e->next = *bucket;
+        *bucket = e;
+    }
+    if (e != NULL && e->count >= ip_max)
+        ret = -1;
+    else if (e != NULL)
+    {
+        e->count++;
+        *peer = e->addr;
+    }
+    pthread_mutex_unlock(&ip_lock);
+    if (ret == -1)
+        atomic_fetch_add(&conn_refused, 1);
+    return(ret);
+}
+
+/**********************************************************************/
+/* A connection counted by ip_admit() closes.
+ * Parameter: the address ip_admit() returned */
+/**********************************************************************/
+void ip_release(in_addr_t peer)
+{
+    struct ip_count **pp, *e;
+
+    if (peer == INADDR_ANY || ip_max <= 0)
+        return;
+    pthread_mutex_lock(&ip_lock);
+    for (pp = &ip_table[(uint32_t)(peer * 2654435761u) >> (32 - IP_BITS)];
+            (e = *pp) != NULL; pp = &e->next)
+    {
+        if (e->addr != peer)
+            continue;
+        if (--e->count == 0)
+        {
+            *pp = e->next;
+            free(e);
+        }
+        break;
+    }
+    pthread_mutex_unlock(&ip_lock);
+}
+
+/**********************************************************************/
+/* Close a socket on which the client may still be sending, such as
+ * one with pipelined requests left unserved.  Rather than have the
+ * kernel reset it, shut it down for writing and hand it to
+ * linger_thread(), which reads and throws away the rest of the input
+ * and closes the socket once the client closes its end, or after
+ * LINGER_SECS.  Closes it at once if there is no room for it.
+ * Parameter: the socket */
+/**********************************************************************/
+void linger_close(int fd)
+{
+    struct epoll_event ev;
+    struct timespec ts;
+    unsigned slot;
+
+    if (linger_epoll == -1 || shutdown(fd, SHUT_WR) == -1)
+    {
+        close(fd);
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    pthread_mutex_lock(&linger_lock);
+    if (linger_count == LINGER_MAX)
+    {
+        pthread_mutex_unlock(&linger_lock);
+        close(fd);
+        return;
+    }
+    slot = (linger_head + linger_count++) % LINGER_MAX;
+    linger_fds[slot] = fd;
+    linger_until[slot] = ts.tv_sec + LINGER_SECS;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.u32 = slot;
+    if (epoll_ctl(linger_epoll, EPOLL_CTL_ADD, fd, &ev) == -1)
+    {
+        close(fd);
+        linger_fds[slot] = -1;
+    }
+    pthread_mutex_unlock(&linger_lock);
+}
+
+/**********************************************************************/
+/* Start the thread that drains the sockets given to linger_close(). */
+/**********************************************************************/
+void linger_start(void)
+{
+    pthread_t newthread;
+
+    linger_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (linger_epoll == -1)
+        error_die("epoll_create1");
+    if (pthread_create(&newthread, NULL, (void *)linger_thread, NULL) != 0)
+        error_die("pthread_create");
+    pthread_detach(newthread);
+}
+
+/**********************************************************************/
+/* Body of the linger thread: read whatever arrives on the lingering
+ * sockets and close each at the end of its input, and the ones that
+ * are still open when their LINGER_SECS are up.
+ * Parameter: unused */
+/**********************************************************************/
+void linger_thread(void *arg)
+{
+    struct epoll_event events[64];
+    struct timespec ts;
+    char buf[4096];
+    ssize_t n;
+    int ready, timeout, fd, i, reads;
+
+    (void)arg;
+    while (1)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        pthread_mutex_lock(&linger_lock);
+        while (linger_count > 0 && linger_until[linger_head] <= ts.tv_sec)
+        {
+            if (linger_fds[linger_head] != -1)
+                close(linger_fds[linger_head]);
+            linger_head = (linger_head + 1) % LINGER_MAX;
+            linger_count--;
+        }
+        /* a socket queued while this waits is due LINGER_SECS later */
+        timeout = (linger_count > 0 ?
+                linger_until[linger_head] - ts.tv_sec : LINGER_SECS) * 1000;
+        pthread_mutex_unlock(&linger_lock);
+
+        ready = epoll_wait(linger_epoll, events, 64, timeout);
+        pthread_mutex_lock(&linger_lock);
+        for (i = 0; i < ready; i++)
+        {
+            fd = linger_fds[events[i].data.u32];
+            if (fd == -1)
+                continue;
+            reads = 0;
+            while ((n = recv(fd, buf, sizeof(buf), 0)) > 0 &&
+                    ++reads < LINGER_READS)
+                ;
+            if (n == -1 && (errno == EAGAIN || errno == EINTR))
+                continue;
+            close(fd);
+            linger_fds[events[i].data.u32] = -1;
+        }
+        pthread_mutex_unlock(&linger_lock);
+    }
+}
+
+/**********************************************************************/
+/* Note the listening sockets an old server handed over in a restart,
+ * as described at RESTART_ENV, and take the variable out of the
+ * environment so CGI programs and later restarts do not see it. */
+/**********************************************************************/
+void listen_inherit(void)
+{
+    const char *s = getenv(RESTART_ENV);
+    int n;
+
+    if (s == NULL)
+        return;
+    n = atoi(s);
+    unsetenv(RESTART_ENV);
+    if (n <= 0 || n > CPU_SETSIZE)
+        return;
+    inherit_next = STDERR + 1;
+    inherit_end = inherit_next + n;
+    ready_fd = inherit_end;
+}
+
+/**********************************************************************/
+/* Tell the old server, if this one was started by a restart, that the
+ * sockets it handed over are in use now and it may stop accepting. */
+/**********************************************************************/
+void listen_ready(void)
+{
+    if (ready_fd == -1)
+        return;
+    if (write(ready_fd, "", 1) != 1)
+        perror("restart");
+    close(ready_fd);
+    ready_fd = -1;
+}
+
+/**********************************************************************/
+/* Take the next listening socket handed over by the old server, to use
+ * instead of binding one with startup().
+ * Parameter: set to the port it listens on
+ * Returns: the socket, or -1 if there are no more */
+/**********************************************************************/
+int listen_take(u_short *port)
+{
+    struct sockaddr_in name;
+    socklen_t namelen = sizeof(name);
+    int fd;
+
+    if (inherit_next >= inherit_end)
+        return(-1);
+    fd = inherit_next++;
+    if (getsockname(fd, (struct sockaddr *)&name, &namelen) == -1)
+        error_die("getsockname");
+    *port = ntohs(name.sin_port);
+    if (nlisteners < CPU_SETSIZE)
+        listeners[nlisteners++] = fd;
+    return(fd);
+}
+
+/**********************************************************************/
+/* List a directory that has no index.html.  Its entries are read and
+ * stat'ed once, here, and the listing is rendered as HTML and as JSON
+ * into entries kept with the url cache entry, so a hit costs one send
+ * and a change in the directory (inotify) has it listed afresh.  Names
+ * starting with a dot, and anything but files and directories, are
+ * left out.  The validators are those of the directory, with the
+ * newest modification time of it and its entries.
+ * Parameter: the entry, with url, path and st of the directory
+ * Returns: 0, or -1 if the directory cannot be listed */
+/**********************************************************************/
+int listing_make(struct file_entry *f)
+{
+    struct dirent **names;
+    struct stat *sts;
+    struct stat st = f->st;
+    int dfd;
+    int n, i, j;
+    int ret = -1;
+
+    n = scandir(f->path, &names, NULL, alphasort);
+    if (n == -1)
+        return(-1);
+    sts = malloc((n + 1) * sizeof(*sts));
+    dfd = open(f->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (i = j = 0; i < n; i++)
+    {
+        if (sts == NULL || dfd == -1 || names[i]->d_name[0] == '.' ||
+                fstatat(dfd, names[i]->d_name, &sts[j], 0) == -1 ||
+                (!S_ISREG(sts[j].st_mode) && !S_ISDIR(sts[j].st_mode)))
+        {
+            free(names[i]);
+            continue;
+        }
+        if (sts[j].st_mtim.tv_sec > st.st_mtim.tv_sec ||
+                (sts[j].st_mtim.tv_sec == st.st_mtim.tv_sec &&
+                 sts[j].st_mtim.tv_nsec > st.st_mtim.tv_nsec))
+            st.st_mtim = sts[j].st_mtim;
+        names[j++] = names[i];
+    }
+    if (sts != NULL && dfd != -1)
+    {
+        f->listing[0] = listing_render(f->url, &st, names, sts, j, 0);
+        f->listing[1] = listing_render(f->url, &st, names, sts, j, 1);
+        if (f->listing[0] != NULL && f->listing[1] != NULL)
+            ret = 0;
+    }
+    for (i = 0; i < j; i++)
+        free(names[i]);
+    free(names);
+    free(sts);
+    if (dfd != -1)
+        close(dfd);
+    return(ret);
+}
+
+/**********************************************************************/
+/* Point a request for a directory at its listing: HTML, or JSON when
+ * the query string has format=json, as for /__stats.  The validators of
+ * the listing stand in for the stat of the directory.  It is always
+ * sent whole.
+ * Parameter: the request, routed to a url cache entry with a listing */
+/**********************************************************************/
+void listing_pick(struct request *req)
+{
+    int json = query_param(req->query_string, "format=json");
+    struct cache_entry *e = req->file->listing[json];
+
+    atomic_fetch_add(&e->refs, 1);
+    req->listing = e;
+    req->type = listing_types[json];
+    req->st.st_size = e->size;
+    req->st.st_mtim = e->mtime;
+    req->range = "";
+}
+
+/**********************************************************************/
+/* Render a directory listing, headers and all.  Links are absolute, so
+ * they work whether or not the url ends in a slash, and percent-encoded
+ * so that any name makes one.
+ * Parameters: the url of the directory
+ *             its stat, with the modification time to put out
+ *             the names in it, in order
+ *             their stat
+ *             how many there are
+ *             true for JSON, false for HTML
+ * Returns: an unlinked entry with one reference, or NULL on error */
+/**********************************************************************/
+struct cache_entry *listing_render(const char *url, const struct stat *st,
+        struct dirent **names, const struct stat *sts, int n, int json)
+{
+    struct cache_entry *e;
+    struct request hdr;
+    size_t url_len = strlen(url);
+    const char *slash = url[url_len - 1] == '/' ? "" : "/";
+    size_t room = 1024 + 18 * url_len;
+    size_t row;
+    char head[1024];
+    char when[32];
+    char up[512];
+    char *body, *p;
+    struct tm tm;
+    size_t len;
+    int dir;
+    int i;
+
+    /* The head and tail of the page have the url html-escaped twice and
+     * its parent percent-encoded, a row the url percent-encoded and the
+     * name percent-encoded and html-escaped, or JSON-escaped.  Each
+     * escape writes a NUL past what it returns, hence the slack. */
+    for (i = 0; i < n; i++)
+        room += 6 * url_len + 12 * strlen(names[i]->d_name) + 256;
+    if ((body = malloc(room)) == NULL)
+        return(NULL);
+    p = body;
+    if (json)
+    {
+        p += sprintf(p, "{\"path\":\"");
+        p += log_escape(p, url);
+        p += sprintf(p, "%s\",\"entries\":[", slash);
+    }
+    else
+    {
+        p += sprintf(p, "<!DOCTYPE html>\n<html><head>"
+                "<meta charset=\"utf-8\"><title>Index of ");
+        p += html_escape(p, url);
+        p += sprintf(p, "%s</title></head>\n<body>\n<h1>Index of ", slash);
+        p += html_escape(p, url);
+        p += sprintf(p, "%s</h1>\n<table>\n<tr><th>Name</th>"
+                "<th>Last modified</th><th>Size</th></tr>\n", slash);
+        if (strcmp(url, "/") != 0)
+        {
+            len = url_len - (*slash == '\0');
+            while (len > 0 && url[len - 1] != '/')
+                len--;
+            memcpy(up, url, len);
+            up[len] = '\0';
+            p += sprintf(p, "<tr><td><a href=\"");
+            p += url_escape(p, up);
+            p += sprintf(p, "\">../</a></td><td></td><td></td></tr>\n");
+        }
+    }
+    for (i = 0; i < n; i++)
+    {
+        row = 6 * url_len + 12 * strlen(names[i]->d_name) + 256;
+        if ((size_t)(p - body) + row > room)
+        {
+            free(body);
+            return(NULL);
+        }
+        dir = S_ISDIR(sts[i].st_mode);
+        gmtime_r(&sts[i].st_mtime, &tm);
+        if (json)
+        {
+            strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", &tm);
+            p += sprintf(p, "%s{\"name\":\"", i > 0 ? "," : "");
+            p += log_escape(p, names[i]->d_name);
+            p += sprintf(p, "\",\"type\":\"%s\",",
+                    dir ? "directory" : "file");
+            if (!dir)
+                p += sprintf(p, "\"size\":%lld,",
+                        (long long)sts[i].st_size);
+            p += sprintf(p, "\"mtime\":\"%s\"}", when);
+            continue;
+        }
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M", &tm);
+        p += sprintf(p, "<tr><td><a href=\"");
+        p += url_escape(p, url);
+        p += sprintf(p, "%s", slash);
+        p += url_escape(p, names[i]->d_name);
+        p += sprintf(p, "%s\">", dir ? "/" : "");
+        p += html_escape(p, names[i]->d_name);
+        p += sprintf(p, "%s</a></td><td>%s</td><td align=\"right\">",
+                dir ? "/" : "", when);
+        if (dir)
+            p += sprintf(p, "-</td></tr>\n");
+        else
+            p += sprintf(p, "%lld</td></tr>\n", (long long)sts[i].st_size);
+    }
+    p += sprintf(p, "%s", json ? "]}\n" : "</table>\n</body></html>\n");
+    len = p - body;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.st = *st;
+    hdr.st.st_size = len;
+    hdr.type = listing_types[json];
+    hdr.length = len;
+    e = calloc(1, sizeof(*e));
+    if (e != NULL)
+    {
+        e->hdr_len = format_entity(head, sizeof(head), &hdr);
+        e->data = malloc(e->hdr_len + len);
+    }
+    if (e == NULL || e->data == NULL)
+    {
+        free(e);
+        free(body);
+        return(NULL);
+    }
+    memcpy(e->data, head, e->hdr_len);
+    memcpy(e->data + e->hdr_len, body, len);
+    free(body);
+    atomic_init(&e->refs, 1);
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = len;
+    e->mtime = st->st_mtim;
+    return(e);
+}
+
+/**********************************************************************/
+/* Format what a ring holds into the log thread's buffer and hand the
+ * slots back.  The buffer is written out whenever it fills up.
+ * Parameters: the ring
+ *             the buffer, LOG_BATCH bytes
+ *             in/out: how much of the buffer is in use
+ * Returns: the number of records taken off the ring */
+/**********************************************************************/
+size_t log_drain(struct log_ring *r, char *buf, size_t *len)
+{
+    static const char *froms[] = {
+        [FROM_NONE] = "-", [FROM_FILE] = "miss",
+        [FROM_CACHE] = "hit", [FROM_SNAPSHOT] = "snapshot",
+        [FROM_ZIP] = "zip", [FROM_LISTING] = "listing",
+    };
+    const struct log_record *rec;
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    size_t n = head - tail;
+    struct tm tm;
+    char *p;
+
+    for (; tail != head; tail++)
+    {
+        /* a record takes well under 4k even with every byte escaped */
+        if (*len > LOG_BATCH - 4096)
+        {
+            write_full(log_fd, buf, *len);
+            *len = 0;
+        }
+        rec = &r->recs[tail & (LOG_RING - 1)];
+        p = buf + *len;
+        p += strftime(p, 64, "{\"time\":\"%Y-%m-%dT%H:%M:%S",
+                gmtime_r(&rec->when.tv_sec, &tm));
+        p += sprintf(p, ".%03ldZ\",\"method\":\"", rec->when.tv_nsec / 1000000);
+        p += log_escape(p, rec->method);
+        p += sprintf(p, "\",\"path\":\"");
+        p += log_escape(p, rec->path);
+        p += sprintf(p, "\",\"status\":%d,\"bytes\":%lld,\"usec\":%llu,"
+                "\"range\":\"", rec->status, rec->bytes,
+                (unsigned long long)rec->usec);
+        p += log_escape(p, rec->range);
+        p += sprintf(p, "\",\"cache\":\"%s\"}\n", froms[rec->from]);
+        *len = p - buf;
+    }
+    atomic_store_explicit(&r->tail, tail, memory_order_release);
+    return(n);
+}
+
+/**********************************************************************/
+/* Copy a string into a JSON string literal: quotes, backslashes and
+ * anything outside printable ASCII are escaped.
+ * Parameters: where to put it, room for six times the string
+ *             the string
+ * Returns: the length of the output */
+/**********************************************************************/
+size_t log_escape(char *dst, const char *src)
+{
+    const unsigned char *p = (const unsigned char *)src;
+    char *d = dst;
+
+    for (; *p != '\0'; p++)
+    {
+        if (*p == '"' || *p == '\\')
+        {
+            *d++ = '\\';
+            *d++ = *p;
+        }
+        else if (*p < 0x20 || *p >= 0x7f)
+            d += sprintf(d, "\\u%04x", *p);
+        else
+            *d++ = *p;
+    }
+    return(d - dst);
+}
+
+/**********************************************************************/
+/* (Re)open the access log, for log_start() and after a SIGUSR2 from
+ * whoever rotated it.  If it cannot be opened, the old descriptor is
+ * kept.
+ * Parameter: the path of the log */
+/**********************************************************************/
+void log_open(const char *path)
+{
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        perror(path);
+        return;
+    }
+    if (log_fd != -1)
+        close(log_fd);
+    log_fd = fd;
+}
+
+/**********************************************************************/
+/* A thread with a log ring exits: mark the ring so the log thread
+ * recycles it once the records left in it are written.  Runs as the
+ * destructor of log_key.
+ * Parameter: the ring */
+/**********************************************************************/
+void log_retire(void *arg)
+{
+    struct log_ring *r = arg;
+
+    atomic_store_explicit(&r->dead, 1, memory_order_release);
+}
+
+/**********************************************************************/
+/* The calling thread's log ring, taken from the recycled ones or
+ * allocated, and put on log_rings the first time the thread logs.
+ * Returns: the ring, or NULL if it could not be allocated */
+/**********************************************************************/
+struct log_ring *log_self(void)
+{
+    struct log_ring *r = log_mine;
+
+    if (r != NULL)
+        return(r);
+    pthread_mutex_lock(&log_lock);
+    r = log_free;
+    if (r != NULL)
+        log_free = r->next;
+    else
+        r = malloc(sizeof(*r));
+    if (r != NULL)
+    {
+        atomic_init(&r->head, 0);
+        atomic_init(&r->tail, 0);
+        atomic_init(&r->dropped, 0);
+        atomic_init(&r->dead, 0);
+        r->reported = 0;
+        r->next = log_rings;
+        log_rings = r;
+    }
+    pthread_mutex_unlock(&log_lock);
+    if (r == NULL)
+        return(NULL);
+    pthread_setspecific(log_key, r);
+    log_mine = r;
+    return(r);
+}
+
+/**********************************************************************/
+/* Open the access log named with -l and start the thread that writes
+ * it.  Call after the signal mask is set up, and before any request is
+ * served.
+ * Parameter: the path of the log */
+/**********************************************************************/
+void log_start(const char *path)
+{
+    pthread_t newthread;
+
+    if (pthread_key_create(&log_key, log_retire) != 0)
+        error_die("pthread_key_create");
+    log_open(path);
+    if (log_fd == -1)
+        exit(1);
+    if (pthread_create(&newthread, NULL, (void *)log_thread,
+                (void *)path) != 0)
+        error_die("pthread_create");
+    pthread_detach(newthread);
+}
+
+/**********************************************************************/
+/* Wait until the log thread has written out what the rings held when
+ * this was called, for a second at most. */
+/**********************************************************************/
+void log_sync(void)
+{
+    static const struct timespec nap = { 0, 5000000 };    /* 5 ms */
+    uint64_t pass;
+    int i;
+
+    if (log_path == NULL)
+        return;
+    /* the pass under way may have drained the rings already */
+    pass = atomic_load(&log_passes);
+    for (i = 0; i < 200 && atomic_load(&log_passes) < pass + 2; i++)
+        nanosleep(&nap, NULL);
+}
+
+/**********************************************************************/
+/* Body of the log thread: drain every ring into one buffer and write
+ * it out, then nap for a moment if there was nothing to do.  Records
+ * dropped since the last pass are logged as a count.  Rings of threads
+ * that have exited go to log_free once drained.  The file is reopened
+ * when SIGUSR2 asks for it.
+ * Parameter: the path of the log */
+/**********************************************************************/
+void log_thread(void *arg)
+{
+    static char buf[LOG_BATCH];
+    static const struct timespec nap = { 0, 5000000 };    /* 5 ms */
+    struct log_ring *r, **pp;
+    const char *path = arg;
+    uint64_t dropped;
+    size_t len, n;
+    int dead;
+
+    while (1)
+    {
+        if (atomic_exchange(&log_reopen, 0))
+            log_open(path);
+        len = n = 0;
+        pthread_mutex_lock(&log_lock);
+        for (pp = &log_rings; (r = *pp) != NULL; )
+        {
+            /* read before draining: whatever a dead ring's thread
+             * pushed is then sure to be seen */
+            dead = atomic_load_explicit(&r->dead, memory_order_acquire);
+            n += log_drain(r, buf, &len);
+            dropped = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+            if (dropped != r->reported)
+            {
+                len += sprintf(buf + len, "{\"dropped\":%llu}\n",
+                        (unsigned long long)(dropped - r->reported));
+                atomic_fetch_add(&log_dropped, dropped - r->reported);
+                r->reported = dropped;
+            }
+            if (dead)
+            {
+                *pp = r->next;
+                r->next = log_free;
+                log_free = r;
+                continue;
+            }
+            pp = &r->next;
+        }
+        pthread_mutex_unlock(&log_lock);
+        if (len > 0 && write_full(log_fd, buf, len) == -1)
+            perror("access log");
+        atomic_fetch_add(&log_passes, 1);
+        if (n == 0)
+            nanosleep(&nap, NULL);
+    }
+}
+
+/**********************************************************************/
+/* The monotonic clock in microseconds, for latencies. */
+/**********************************************************************/
+uint64_t monotonic_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/**********************************************************************/
+/* Give a client a 404 not found status message. */
+/**********************************************************************/
+void not_found(int client)
+{
+    send_error(client, ERR_NOT_FOUND, 0);
+}
+
+/**********************************************************************/
+/* Pick the headers the server cares about out of one header line.
+ * The value is cut out of the line in place.
+ * Parameters: the request being built
+ *             the header line, as cut by split_line() */
+/**********************************************************************/
+void parse_header(struct request *req, char *line)
+{
+    char *value = strchr(line, ':');
+    char *end;
+
+    if (value == NULL)
+        return;
+    *value++ = '\0';
+    while (ISspace(*value))
+        value++;
+    end = value + strlen(value);
+    while (end > value && ISspace(end[-1]))
+        *--end = '\0';
+
+    if (strcasecmp(line, "Content-Length") == 0)
+        req->content_length = atoi(value);
+    else if (strcasecmp(line, "Accept-Encoding") == 0)
+        req->accept_encoding = value;
+    else if (strcasecmp(line, "If-None-Match") == 0)
+        req->if_none_match = value;
+    else if (strcasecmp(line, "If-Modified-Since") == 0)
+        req->if_modified_since = parse_http_date(value);
+    else if (strcasecmp(line, "If-Range") == 0)
+        req->if_range = value;
+    else if (strcasecmp(line, "Range") == 0)
+        req->range = value;
+    else if (strcasecmp(line, "Upgrade") == 0)
+        req->upgrade = value;
+    else if (strcasecmp(line, "HTTP2-Settings") == 0)
+        req->http2_settings = value;
+    else if (strcasecmp(line, "Connection") == 0)
+    {
+        if (strcasestr(value, "close"))
+            req->keep_alive = 0;
+        else if (strcasestr(value, "keep-alive"))
+            req->keep_alive = 1;
+    }
+}
+
+/**********************************************************************/
+/* Parse an HTTP date in the preferred IMF-fixdate format, such as
+ * "Sun, 06 Nov 1994 08:49:37 GMT".
+ * Parameter: the date, leading blanks allowed
+ * Returns: the time, or -1 if it does not parse */
+/**********************************************************************/
+time_t parse_http_date(const char *s)
+{
+    struct tm tm;
+
+    while (ISspace(*s))
+        s++;
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+        return(-1);
+    return(timegm(&tm));
+}
+
+/**********************************************************************/
+/* Work out which bytes of the file to send from the Range header and
+ * the length of the response body.  A header that does not parse, or
+ * asks for too many ranges, is ignored and the whole file is sent.
+ * Parameter: the request, with the stat of the file */
+/**********************************************************************/
+void parse_ranges(struct request *req)
+{
+    off_t size = req->st.st_size;
+    struct byterange r;
+    long long n;
+    const char *p = req->range;
+    char *end;
+    char buf[128];
+    int valid = 0;
+    int i;
+
+    req->nranges = 0;
+    req->length = size;
+    while (ISspace(*p))
+        p++;
+    if (strncasecmp(p, "bytes=", 6) != 0)
+        return;
+    p += 6;
+
+    while (*p != '\0' && *p != '\n' && *p != '\r')
+    {
+        while (ISspace(*p) || *p == ',')
+            p++;
+        if (*p == '\0' || *p == '\n' || *p == '\r')
+            break;
+        if (*p == '-')  /* suffix: the last N bytes */
+        {
+            n = strtoll(p + 1, &end, 10);
+            if (end == p + 1)
+                goto invalid;
+            r.first = n < size ? size - n : 0;
+            r.last = n > 0 ? size - 1 : -1;
+        }
+        else
+        {
+            r.first = strtoll(p, &end, 10);
+            if (end == p || *end != '-')
+                goto invalid;
+            p = end + 1;
+            r.last = strtoll(p, &end, 10);
+            if (end == p)
+                r.last = size - 1;
+            else if (r.last < r.first)
+                goto invalid;
+            if (r.last >= size)
+                r.last = size - 1;
+        }
+        p = end;
+        while (ISspace(*p))
+            p++;
+        if (*p != ',' && *p != '\0' && *p != '\n' && *p != '\r')
+            goto invalid;
+        valid = 1;
+        if (r.first >= size || r.first > r.last)
+            continue;   /* unsatisfiable on its own */
+        if (req->nranges == MAX_RANGES)
+            goto invalid;
+        req->ranges[req->nranges++] = r;
+    }
+
+    if (!valid)
+        goto invalid;
+    if (req->nranges == 0)
+    {
+        req->nranges = -1;
+        req->length = 0;
+        return;
+    }
+    if (req->nranges == 1)
+    {
+        req->length = req->ranges[0].last - req->ranges[0].first + 1;
+        return;
+    }
+    req->length = 0;
+    for (i = 0; i <= req->nranges; i++)
+    {
+        req->length += format_part(buf, sizeof(buf), req, i);
+        if (i < req->nranges)
+            req->length += req->ranges[i].last - req->ranges[i].first + 1;
+    }
+    return;
+
+invalid:
+    req->nranges = 0;
+    req->length = size;
+}
+
+/**********************************************************************/
+/* Parse a complete request head, as delimited by head_length().  The
+ * head is cut up in place: line ends and the separators between fields
+ * are overwritten with nulls and the request points into the buffer.
+ * Parameters: the request to fill in
+ *             the buffer holding the head and the length of the head
+ * Returns: 0 on success, -1 if the method is not implemented */
+/**********************************************************************/
+int parse_request(struct request *req, char *buf, size_t len)
+{
+    char *end = buf + len;
+    char *line = buf;
+    char *next;
+
+    next = split_line(line, end);
+    if (parse_request_line(req, line) < 0)
+        return(-1);
+    for (line = next; line < end; line = next)
+    {
+        next = split_line(line, end);
+        if (*line == '\0')
+            break;
+        parse_header(req, line);
+    }
+    return(0);
+}
+
+/**********************************************************************/
+/* Split the request line into method, url and protocol version, and
+ * the url into path and query string, all in place.
+ * Parameters: the request to fill in
+ *             the request line, as cut by split_line()
+ * Returns: 0 on success, -1 if the method is not implemented */
+/**********************************************************************/
+int parse_request_line(struct request *req, char *line)
+{
+    char *p = line;
+
+    memset(req, 0, sizeof(*req));
+    req->content_length = -1;
+    req->if_modified_since = -1;
+    req->range = req->accept_encoding = "";
+    req->if_none_match = req->if_range = "";
+    req->upgrade = "";
+
+    req->method = p;
+    while (*p != '\0' && !ISspace(*p))
+        p++;
+    if (*p != '\0')
+        *p++ = '\0';
+
+    if (strcasecmp(req->method, "GET") && strcasecmp(req->method, "POST"))
+        return(-1);
+
+    if (strcasecmp(req->method, "POST") == 0)
+        req->cgi = 1;
+
+    while (ISspace(*p))
+        p++;
+    req->url = p;
+    while (*p != '\0' && !ISspace(*p))
+        p++;
+    if (*p != '\0')
+        *p++ = '\0';
+
+    while (ISspace(*p))
+        p++;
+    req->version = strncasecmp(p, "HTTP/1.1", 8) ? 10 : 11;
+    req->keep_alive = (req->version >= 11);
+
+    if (strcasecmp(req->method, "GET") == 0)
+    {
+        req->query_string = req->url;
+        while ((*req->query_string != '?') && (*req->query_string != '\0'))
+            req->query_string++;
+        if (*req->query_string == '?')
+        {
+            *req->query_string = '\0';
+            req->query_string++;
+        }
+    }
+
+    return(0);
+}
+
+/**********************************************************************/
+/* Serve a precompressed sibling (foo.br or foo.gz next to foo) instead
+ * of the file itself when the client accepts that coding and the
+ * sibling is at least as new as the file.
+ * Parameter: the request, with the path, stat and file entry of the
+ *            file; path, stat and descriptor are switched over to the
+ *            sibling if one is picked */
+/**********************************************************************/
+void pick_encoding(struct request *req)
+{
+    const struct file_entry *f = req->file;
+    const struct stat *st;
+    size_t i;
+
+    for (i = 0; i < sizeof(codings) / sizeof(codings[0]); i++)
+    {
+        if (f->var_fd[i] == -1)
+            continue;
+        st = &f->var_st[i];
+        req->vary = 1;
+        if (req->encoding != NULL ||
+                !accepts_encoding(req->accept_encoding, codings[i][1]) ||
+                st->st_mtim.tv_sec < req->st.st_mtim.tv_sec ||
+                (st->st_mtim.tv_sec == req->st.st_mtim.tv_sec &&
+                 st->st_mtim.tv_nsec < req->st.st_mtim.tv_nsec))
+            continue;
+        req->encoding = codings[i][1];
+        req->st = *st;
+        req->fd = f->var_fd[i];
+        sprintf(req->path, "%s%s", f->path, codings[i][0]);
+        return;   /* the siblings that are left cannot change vary */
+    }
+}
+
+/**********************************************************************/
+/* Body of a pool worker: sleep until a socket has been queued, then
+ * serve it to completion and go back for the next one.
+ * Parameter: the shared socket queue */
+/**********************************************************************/
+void pool_worker(void *arg)
+{
+    struct sockq *q = arg;
+    int client;
+
+    while (1)
+    {
+        while (sem_wait(&q->items) == -1)
+            ;   /* EINTR */
+        client = sockq_pop(q);
+        accept_request((void *)(intptr_t)client);
+    }
+}
+
+/**********************************************************************/
+/* Look for a parameter in a query string: one of its &-separated
+ * parts equals it exactly, as "format=json" does in "?format=json&x".
+ * Parameters: the query string, or NULL
+ *             the parameter, name=value
+ * Returns: true if it is there */
+/**********************************************************************/
+int query_param(const char *query, const char *param)
+{
+    size_t len = strlen(param);
+    const char *p = query;
+
+    while (p != NULL && *p != '\0')
+    {
+        if (strncmp(p, param, len) == 0 && (p[len] == '&' || p[len] == '\0'))
+            return(1);
+        p = strchr(p, '&');
+        if (p != NULL)
+            p++;
+    }
+    return(0);
+}
+
+/**********************************************************************/
+/* Parse the argument of -r ("reqs[/bytes]", per client address) or -R
+ * ("bits:reqs[/bytes]", per network of that prefix length).
+ * Parameters: the limit to fill in
+ *             the argument
+ *             true for -R
+ * Returns: 0 on success, -1 if the argument makes no sense */
+/**********************************************************************/
+int rate_option(struct rate_limit *l, const char *arg, int prefix)
+{
+    char *end;
+
+    l->bits = 32;
+    if (prefix)
+    {
+        l->bits = strtol(arg, &end, 10);
+        if (*end != ':' || l->bits < 0 || l->bits > 32)
+            return(-1);
+        arg = end + 1;
+    }
+    l->reqs = strtoull(arg, &end, 10);
+    l->bytes = 0;
+    if (*end == '/')
+        l->bytes = strtoull(end + 1, &end, 10);
+    if (*end != '\0' || (l->reqs == 0 && l->bytes == 0))
+        return(-1);
+    return(0);
+}
+
+/**********************************************************************/
+/* Pace a send to a client: charge what its byte buckets hold of it
+ * against them, or tell how long to hold off when they are (nearly)
+ * empty.  Less than RATE_CHUNK bytes at a time is never let through,
+ * unless that is all there is to send, so a throttled client gets
+ * fewer, fuller segments rather than a trickle.
+ * Parameters: the client address, INADDR_ANY if not known
+ *             in/out: the bytes about to be sent, cut down to what
+ *             may go now
+ * Returns: 0 to go ahead, else the milliseconds to wait first */
+/**********************************************************************/
+uint64_t rate_pace(in_addr_t peer, size_t *len)
+{
+    struct rate_slot *slots[RATE_LIMITS];
+    const struct rate_limit *l;
+    uint64_t now, tat, next, room, wait = 0;
+    size_t want = *len < RATE_CHUNK ? *len : RATE_CHUNK;
+    int i;
+
+    if (peer == INADDR_ANY || *len == 0)
+        return(0);
+    now = monotonic_usec() * 1000;
+    for (i = 0; i < rate_count; i++)
+    {
+        l = &rate_limits[i];
+        slots[i] = NULL;
+        if (l->bytes == 0 || (slots[i] = rate_slot(l, peer, now)) == NULL)
+            continue;
+        tat = atomic_load_explicit(&slots[i]->bytes, memory_order_relaxed);
+        if (tat < now)
+            tat = now;
+        /* in microseconds, so the product cannot overflow */
+        room = tat < now + RATE_BURST ?
+            (now + RATE_BURST - tat) / 1000 * l->bytes / 1000000 : 0;
+        if (room < want)
+        {
+            next = (want - room) * 1000000000ULL / l->bytes;
+            if (next > wait)
+                wait = next;
+        }
+        else if (room < *len)
+            *len = room;
+    }
+    if (wait > 0)
+    {
+        atomic_fetch_add(&rate_paced, 1);
+        return(wait / 1000000 + 1);
+    }
+    for (i = 0; i < rate_count; i++)
+    {
+        if (slots[i] == NULL)
+            continue;
+        tat = atomic_load_explicit(&slots[i]->bytes, memory_order_relaxed);
+        do
+            next = (tat > now ? tat : now) +
+                *len * 1000000000ULL / rate_limits[i].bytes;
+        while (!atomic_compare_exchange_weak(&slots[i]->bytes, &tat, next));
+    }
+    return(0);
+}
+
+/**********************************************************************/
+/* Take a token from the request buckets of a client.
+ * Parameter: the client address, INADDR_ANY if not known
+ * Returns: 0 if the request may be served, -1 if it is over a limit */
+/**********************************************************************/
+int rate_request(in_addr_t peer)
+{
+    const struct rate_limit *l;
+    struct rate_slot *s;
+    uint64_t now, tat, next;
+
+    if (peer == INADDR_ANY)
+        return(0);
+    now = monotonic_usec() * 1000;
+    for (l = rate_limits; l < rate_limits + rate_count; l++)
+    {
+        if (l->reqs == 0 || (s = rate_slot(l, peer, now)) == NULL)
+            continue;
+        tat = atomic_load_explicit(&s->reqs, memory_order_relaxed);
+        do
+        {
+            next = (tat > now ? tat : now) + 1000000000ULL / l->reqs;
+            if (next > now + RATE_BURST)
+            {
+                atomic_fetch_add(&rate_limited, 1);
+                return(-1);
+            }
+        } while (!atomic_compare_exchange_weak(&s->reqs, &tat, next));
+    }
+    return(0);
+}
+
+/**********************************************************************/
+/* Find the slot holding the buckets of a client under a limit, taking
+ * one over if there is none.  Lookups race with each other and with
+ * evictions; the worst that comes of it is a key getting two slots for
+ * a while, or buckets that start out full again, which a limiter can
+ * live with.
+ * Parameters: the limit
+ *             the client address
+ *             the time now, ns
+ * Returns: the slot, or NULL if the slot chosen was taken meanwhile */
+/**********************************************************************/
+struct rate_slot *rate_slot(const struct rate_limit *l, in_addr_t peer,
+        uint64_t now)
+{
+    uint32_t addr = ntohl(peer);
+    uint64_t key, seen, used, oldest = 0, victim_key = 0;
+    struct rate_slot *s, *victim;
+    size_t h;
+    int i, tries;
+
+    if (l->bits < 32)
+        addr = l->bits > 0 ? addr & ~0u << (32 - l->bits) : 0;
+    key = (uint64_t)(l->bits + 1) << 32 | addr;
+    h = (key * 0x9e3779b97f4a7c15ULL) >> (64 - RATE_BITS);
+    for (tries = 0; tries < 2; tries++)
+    {
+        victim = NULL;
+        for (i = 0; i < RATE_PROBE; i++)
+        {
+            s = &rate_table[(h + i) & (RATE_SLOTS - 1)];
+            seen = atomic_load_explicit(&s->key, memory_order_acquire);
+            if (seen == key)
+            {
+                atomic_store_explicit(&s->used, now, memory_order_relaxed);
+                return(s);
+            }
+            used = seen == 0 ? 0 :
+                atomic_load_explicit(&s->used, memory_order_relaxed);
+            if (victim == NULL || used < oldest)
+            {
+                victim = s;
+                victim_key = seen;
+                oldest = used;
+            }
+        }
+        if (atomic_compare_exchange_strong(&victim->key, &victim_key, key))
+        {
+            atomic_store_explicit(&victim->reqs, 0, memory_order_relaxed);
+            atomic_store_explicit(&victim->bytes, 0, memory_order_relaxed);
+            atomic_store_explicit(&victim->used, now, memory_order_relaxed);
+            return(victim);
+        }
+    }
+    return(NULL);
+}
+
+/**********************************************************************/
+/* rate_pace() for the thread and pool models, whose threads can simply
+ * sleep until the client of the connection they serve may have more.
+ * Parameter: in/out: the bytes about to be sent, cut down to what may
+ *            go now */
+/**********************************************************************/
+void rate_wait(size_t *len)
+{
+    uint64_t ms;
+
+    while (rate_count > 0 && (ms = rate_pace(rate_peer, len)) > 0)
+        usleep(ms * 1000);
+}
+
+/**********************************************************************/
+/* Read exactly len bytes, whatever the descriptor hands out at a time.
+ * Parameters: the descriptor
+ *             the buffer and the number of bytes wanted
+ * Returns: 0 on success, -1 on error or end of file */
+/**********************************************************************/
+int read_full(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = read(fd, buf, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return(-1);
+        buf = (char *)buf + n;
+        len -= n;
+    }
+    return(0);
+}
+
+/**********************************************************************/
+/* Read from a blocking socket until a whole request head is buffered.
+ * Bytes already in the buffer (pipelined after the previous request)
+ * are used first.  An idle deadline turns into the deadline for the
+ * head once its first bytes are in.
+ * Parameters: the socket
+ *             the buffer and its size
+ *             in/out the number of bytes in the buffer
+ *             the deadline guarding the socket, or NULL
+ * Returns: the length of the head, 0 if the connection was closed or
+ *          timed out first, -1 if the head does not fit the buffer */
+/**********************************************************************/
+ssize_t recv_head(int sock, char *buf, size_t size, size_t *len,
+        struct guard *guard)
+{
+    size_t scan = 0;
+    size_t head;
+    ssize_t n;
+
+    if (*len > 0)   /* pipelined */
+        TRACE_MARK(TRACE_FIRST_BYTE);
+    while ((head = head_length(buf, *len, &scan)) == 0)
+    {
+        if (*len == size)
+            return(-1);
+        n = recv(sock, buf + *len, size - *len, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return(0);
+        *len += n;
+        TRACE_MARK(TRACE_FIRST_BYTE);
+        if (guard != NULL && guard->timing == TIMING_IDLE)
+            guard_arm(guard, TIMING_HEAD, request_timeout);
+    }
+    return(head);
+}
+
+/**********************************************************************/
+/* Drop what route_request() referenced for a request once its
+ * response is out.
+ * Parameter: the request */
+/**********************************************************************/
+void request_release(struct request *req)
+{
+    file_put(req->file);
+    req->file = NULL;
+    if (req->snap != NULL)
+        snap_put(req->snap);
+    req->snap = NULL;
+    req->snap_body = NULL;
+    if (req->zip != NULL)
+        cache_put(req->zip);
+    req->zip = NULL;
+    if (req->listing != NULL)
+        cache_put(req->listing);
+    req->listing = NULL;
+}
+
+/**********************************************************************/
+/* Tell the client its request line and headers are too long.
+ * Parameter: the client socket */
+/**********************************************************************/
+void request_too_large(int client)
+{
+    send_error(client, ERR_TOO_LARGE, 0);
+}
+
+/**********************************************************************/
+/* The status code of a file response, as format_entity() will put it.
+ * Parameter: the routed request
+ * Returns: the status code */
+/**********************************************************************/
+int response_status(const struct request *req)
+{
+    if (req->not_modified)
+        return(304);
+    if (req->fd == -1 && req->listing == NULL)
+        return(404);
+    if (req->nranges < 0)
+        return(416);
+    return(req->nranges > 0 ? 206 : 200);
+}
+
+/**********************************************************************/
+/* Hand the server over to a new copy of its binary, as described at
+ * RESTART_ENV, then drain and exit.  If the new server does not come
+ * up, it is stopped and this one carries on as before.  Runs in the
+ * signal thread.
+ * Parameter: the signals the thread takes, for restart_drain() */
+/**********************************************************************/
+void restart(sigset_t *set)
+{
+    extern char **environ;
+    char path[1024];
+    char count[32];
+    char **env;
+    struct pollfd pfd;
+    int pipefd[2];
+    pid_t pid;
+    char c;
+    int i, n;
+
+    if (restart_argv == NULL || atomic_load(&draining))
+        return;
+    if (restart_path(path, sizeof(path)) == -1)
+    {
+        fprintf(stderr, "httpd: cannot find %s to restart\n",
+                restart_argv[0]);
+        return;
+    }
+    for (n = 0; environ[n] != NULL; n++)
+        ;
+    env = malloc((n + 2) * sizeof(*env));
+    if (env == NULL || pipe2(pipefd, O_CLOEXEC) == -1)
+    {
+        perror("restart");
+        free(env);
+        return;
+    }
+    for (i = n = 0; environ[i] != NULL; i++)
+        if (strncmp(environ[i], RESTART_ENV "=", sizeof(RESTART_ENV)) != 0)
+            env[n++] = environ[i];
+    snprintf(count, sizeof(count), RESTART_ENV "=%d", nlisteners);
+    env[n++] = count;
+    env[n] = NULL;
+
+    pid = fork();
+    if (pid == 0)
+        restart_exec(path, restart_argv, env, pipefd[1]);
+    free(env);
+    close(pipefd[1]);
+    if (pid == -1)
+    {
+        perror("fork");
+        close(pipefd[0]);
+        return;
+    }
+    pfd.fd = pipefd[0];
+    pfd.events = POLLIN;
+    n = poll(&pfd, 1, RESTART_WAIT * 1000) == 1 ? read(pipefd[0], &c, 1) : 0;
+    close(pipefd[0]);
+    if (n != 1)
+    {
+        fprintf(stderr, "httpd: new server %d did not come up, carrying on\n",
+                (int)pid);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return;
+    }
+    fprintf(stderr, "httpd: handed over to %d, draining\n", (int)pid);
+    restart_drain(set);
+}
+
+/**********************************************************************/
+/* Stop every acceptor, then give the connections still open up to -D
+ * seconds to finish, and exit.  Acceptors are woken with SIGALRM every
+ * tick until they have all stopped, as one may only just be entering
+ * accept().  SIGTERM or SIGINT cut the wait short.
+ * Parameter: the signals the signal thread takes */
+/**********************************************************************/
+void restart_drain(sigset_t *set)
+{
+    static const struct timespec tick = { 0, WHEEL_TICK_MS * 1000000L };
+    uint64_t deadline = monotonic_usec() + (uint64_t)drain_timeout * 1000000;
+    uint64_t open;
+    int stopped;
+    int sig;
+    int i;
+
+    atomic_store(&draining, 1);
+    while (1)
+    {
+        pthread_mutex_lock(&acceptor_lock);
+        stopped = atomic_load(&acceptors_stopped) >= nacceptors;
+        for (i = 0; i < nacceptors && !stopped; i++)
+            pthread_kill(acceptors[i], SIGALRM);
+        pthread_mutex_unlock(&acceptor_lock);
+        sig = sigtimedwait(set, NULL, &tick);
+        if (sig == SIGTERM || sig == SIGINT)
+            break;
+        open = drain_count();
+        if (stopped && open == 0)
+            break;
+        if (monotonic_usec() >= deadline)
+        {
+            fprintf(stderr, "httpd: %llu connections cut off after %d"
+                    " seconds of draining\n", (unsigned long long)open,
+                    drain_timeout);
+            break;
+        }
+    }
+    log_sync();
+    fcgi_stop();
+    exit(0);
+}
+
+/**********************************************************************/
+/* Replace a freshly forked child with the new server.  The listening
+ * sockets are moved to descriptors 3 and up and the pipe right after
+ * them, out of the way first so none is overwritten, and everything
+ * else is closed.  Only async-signal-safe calls are made, as in
+ * cgi_exec().
+ * Parameters: the binary
+ *             its arguments
+ *             its environment, with RESTART_ENV
+ *             the write end of the pipe */
+/**********************************************************************/
+void restart_exec(const char *path, char **argv, char **env, int ready)
+{
+    struct sigaction sa;
+    sigset_t none;
+    int top = STDERR + 1 + nlisteners;
+    int i, fd;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
+    sigaction(SIGPIPE, &sa, NULL);
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    for (i = 0; i < nlisteners; i++)
+        listeners[i] = fcntl(listeners[i], F_DUPFD, top + 1);
+    ready = fcntl(ready, F_DUPFD, top + 1);
+    for (i = 0; i < nlisteners; i++)
+        dup2(listeners[i], STDERR + 1 + i);
+    dup2(ready, top);
+    if (syscall(SYS_close_range, top + 1, ~0U, 0) == -1)
+        for (fd = top + 1; fd < 1024; fd++)
+            close(fd);
+    execve(path, argv, env);
+    _exit(127);
+}
+
+/**********************************************************************/
+/* Find the binary to restart: the path the server was started by, or,
+ * if that has no slash, the first match for it along $PATH.  The
+ * working directory never changes, so a relative path still works.
+ * Parameters: the buffer for the path and its size
+ * Returns: 0, or -1 if it cannot be found */
+/**********************************************************************/
+int restart_path(char *buf, size_t size)
+{
+    const char *name = restart_argv[0];
+    const char *dir = getenv("PATH");
+    const char *end;
+    size_t len;
+
+    if (strchr(name, '/') != NULL)
+        return(snprintf(buf, size, "%s", name) < (int)size ? 0 : -1);
+    while (dir != NULL && *dir != '\0')
+    {
+        end = strchr(dir, ':');
+        len = end != NULL ? (size_t)(end - dir) : strlen(dir);
+        if ((size_t)snprintf(buf, size, "%.*s/%s", (int)len, dir, name) <
+                size && access(buf, X_OK) == 0)
+            return(0);
+        dir = end != NULL ? end + 1 : NULL;
+    }
+    return(-1);
+}
+
+/**********************************************************************/
+/* Map the url of a request onto the htdocs tree and decide whether it
+ * is a static file or a CGI program, or the /__stats page, unless the
+ * client is over its request rate (checked first, so a flood of
+ * requests costs no lookups).  The url is looked up in the snapshot
+ * image first, then resolved through the url cache.  For a file, also
+ * pick a precompressed variant, evaluate conditional headers and work
+ * out the byte ranges to send; for a directory without an index.html,
+ * pick the format of its listing.  The url is percent-decoded first;
+ * one with a ".." segment, which would leave htdocs, is not found.
+ * Parameter: the request; its path, st, file, fd, type, encoding and
+ *            range members are filled in.  The file entry is released
+ *            with request_release() once the response is out.
+ * Returns: one of the ROUTE_ constants */
+/**********************************************************************/
+int route_request(struct request *req)
+{
+    struct file_entry *f;
+
+    if (rate_count > 0 && rate_request(req->peer) == -1)
+        return(ROUTE_LIMITED);
+    if (strcmp(req->url, "/__stats") == 0)
+        return(ROUTE_STATS);
+    if (url_decode(req->url) == -1 || !url_safe(req->url))
+        return(ROUTE_NOT_FOUND);
+    if (req->cgi || !snap_route(req))
+    {
+        f = file_get(req->url);
+        if (f == NULL)
+            return(ROUTE_NOT_FOUND);
+        req->file = f;
+        req->fd = f->fd;
+        req->st = f->st;
+        strcpy(req->path, f->path);
+        if (f->cgi)
+            req->cgi = 1;
+        if (req->cgi)
+            return(ROUTE_CGI);
+        if (f->listing[0] != NULL)
+            listing_pick(req);
+        else
+        {
+            req->type = content_type(req->path);
+            pick_encoding(req);
+            if (req->encoding == NULL)
+                zip_pick(req);
+        }
+    }
+    TRACE_MARK(TRACE_RESOLVED);
+    check_conditions(req);
+    parse_ranges(req);
+    if (req->not_modified)
+    {
+        req->nranges = 0;
+        req->length = 0;
+    }
+    return(ROUTE_FILE);
+}
+
+/**********************************************************************/
+/* Serve connections from a single thread with an edge-triggered epoll
+ * loop.  Each connection is a struct conn that moves from CONN_READ to
+ * CONN_WRITE (and back, for keep-alive); the listening socket is
+ * registered with a NULL pointer.  Whenever a connection has to wait
+ * for its client, its timer goes on the loop's wheel, which is run
+ * every tick while any is armed.
+ * Parameter: the listening socket */
+/**********************************************************************/
+void run_epoll(int server_sock)
+{
+    struct epoll_event ev;
+    struct epoll_event events[64];
+    struct wheel wheel;
+    struct conn *c;
+    in_addr_t peer;
+    int client;
+    int stopped = 0;
+    int n, i;
+
+    wheel_init(&wheel);
+    conn_wheel = &wheel;
+    acceptor_add();
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1)
+        error_die("epoll_create1");
+    if (set_nonblocking(server_sock) == -1)
+        error_die("fcntl");
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_sock, &ev) == -1)
+        error_die("epoll_ctl");
+
+    while (1)
+    {
+        if (!stopped && atomic_load(&draining))
+        {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, server_sock, NULL);
+            acceptor_stop();
+            stopped = 1;
+        }
+        n = epoll_wait(epoll_fd, events, 64,
+                wheel.armed > 0 ? WHEEL_TICK_MS : -1);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            error_die("epoll_wait");
+        }
+        for (i = 0; i < n; i++)
+        {
+            c = events[i].data.ptr;
+            if (c == NULL)
+            {
+                while ((client = accept4(server_sock, NULL, NULL,
+                                SOCK_NONBLOCK)) != -1)
+                {
+                    if (ip_admit(client, &peer) == -1)
+                    {
+                        service_unavailable(client);
+                        linger_close(client);
+                        continue;
+                    }
+                    c = calloc(1, sizeof(*c));
+                    if (c == NULL)
+                    {
+                        ip_release(peer);
+                        close(client);
+                        continue;
+                    }
+                    c->fd = client;
+                    c->file = -1;
+                    c->state = CONN_READ;
+                    c->peer = peer;
+                    if (stats_self() != NULL)
+                        stat_add(&stats_mine->accepted, 1);
+                    conn_timer(c);
+                    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+                    ev.data.ptr = c;
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &ev) == -1)
+                    {
+                        perror("epoll_ctl");
+                        conn_close(c);
+                    }
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    perror("accept");
+                continue;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+                conn_close(c);
+            else if (c->state == CONN_READ)
+                conn_read(c);
+            else if (conn_write(c) == 1)
+                conn_read(c);
+        }
+        /* only once the events are handled: they may be for a
+         * connection that is about to expire */
+        wheel_run(&wheel, conn_expire);
+    }
+}
+
+/**********************************************************************/
+/* Serve connections with a fixed number of worker threads.  The accept
+ * loop only enqueues sockets; once the queue is full new clients get a
+ * 503 straight away instead of piling up behind the workers.
+ * Parameters: the listening socket
+ *             the number of worker threads
+ *             the capacity of the socket queue */
+/**********************************************************************/
+void run_pool(int server_sock, int workers, size_t queue_size)
+{
+    static struct sockq q;
+    int client_sock = -1;
+    pthread_t newthread;
+    pthread_attr_t attr;
+    int i;
+
+    if (sockq_init(&q, queue_size) == -1)
+        error_die("sockq_init");
+    pool_queue = &q;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 0; i < workers; i++)
+        if (pthread_create(&newthread, &attr, (void *)pool_worker, &q) != 0)
+            error_die("pthread_create");
+    pthread_attr_destroy(&attr);
+    acceptor_add();
+
+    while (1)
+    {
+        client_sock = accept(server_sock, NULL, NULL);
+        if (client_sock == -1)
+        {
+            if (errno == EINTR && atomic_load(&draining))
+            {
+                acceptor_stop();
+                while (1)
+                    pause();
+            }
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            error_die("accept");
+        }
+        if (sockq_push(&q, client_sock) == -1)
+        {
+            service_unavailable(client_sock);
+            linger_close(client_sock);
+        }
+    }
+}
+
+/**********************************************************************/
+/* Serve connections from one acceptor per CPU.  Every shard owns a
+ * SO_REUSEPORT listener on the same port, so the kernel spreads new
+ * connections across them, and runs its own event loop on a thread
+ * pinned to its CPU.  The calling thread becomes the first shard.
+ * Parameters: the already bound listener, used by the first shard
+ *             the port it is bound to
+ *             the listen backlog for the other listeners
+ *             the event loop, run_epoll or run_uring */
+/**********************************************************************/
+void run_shards(int server_sock, u_short port, int backlog,
+        void (*loop)(int))
+{
+    cpu_set_t allowed;
+    struct shard *shards;
+    pthread_t newthread;
+    pthread_attr_t attr;
+    int nshards, cpu, i;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+        error_die("sched_getaffinity");
+    nshards = CPU_COUNT(&allowed);
+    /* every listener handed over in a restart needs a shard, or what
+     * the kernel queues on it is never accepted */
+    if (nshards < 1 + inherit_end - inherit_next)
+        nshards = 1 + inherit_end - inherit_next;
+    shards = calloc(nshards, sizeof(*shards));
+    if (shards == NULL)
+        error_die("calloc");
+    for (cpu = 0, i = 0; i < nshards; cpu = (cpu + 1) % CPU_SETSIZE)
+    {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        shards[i].cpu = cpu;
+        shards[i].loop = loop;
+        shards[i].sock = i ? listen_take(&port) : server_sock;
+        if (shards[i].sock == -1)
+            shards[i].sock = startup(&port, backlog, 1);
+        i++;
+    }
+    printf("httpd: %d shards\n", nshards);
+    fflush(stdout);
+    listen_ready();
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 1; i < nshards; i++)
+        if (pthread_create(&newthread, &attr, (void *)shard_thread,
+                    &shards[i]) != 0)
+            error_die("pthread_create");
+    pthread_attr_destroy(&attr);
+    shard_thread(&shards[0]);
+}
+
+/**********************************************************************/
+/* The original serving model: accept in a loop and hand every client
+ * to its own detached thread running accept_request().
+ * Parameter: the listening socket */
+/**********************************************************************/
+void run_threads(int server_sock)
+{
+    int client_sock = -1;
+    struct sockaddr_in client_name;
+    socklen_t  client_name_len = sizeof(client_name);
+    pthread_t newthread;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    acceptor_add();
+    while (1)
+    {
+        client_sock = accept(server_sock,
+                (struct sockaddr *)&client_name,
+                &client_name_len);
+        if (client_sock == -1)
+        {
+            if (errno == EINTR && atomic_load(&draining))
+            {
+                acceptor_stop();
+                while (1)
+                    pause();
+            }
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            error_die("accept");
+        }
+        /* accept_request(&client_sock); */
+        if (pthread_create(&newthread , &attr, (void *)accept_request, (void *)(intptr_t)client_sock) != 0)
+        {
+            perror("pthread_create");
+            close(client_sock);
+        }
+    }
+}
+
+/**********************************************************************/
+/* Serve connections from an io_uring instead of readiness events: the
+ * ring accepts, receives the request head, reads file chunks and sends
+ * them, and every pass through the loop submits all queued operations
+ * and waits for completions with a single io_uring_enter().  A timeout
+ * operation wakes the loop every tick to run the wheel of connection
+ * deadlines.
+ * Parameter: the listening socket */
+/**********************************************************************/
+void run_uring(int server_sock)
+{
+    static const struct __kernel_timespec tick = {
+        0, WHEEL_TICK_MS * 1000000L
+    };
+    struct uring r;
+    struct wheel wheel;
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    uint64_t data;
+    int stopped = 0;
+    int res;
+    int i;
+
+    if (uring_init(&r, URING_ENTRIES) == -1)
+        error_die("io_uring_setup");
+    wheel_init(&wheel);
+    conn_wheel = &wheel;
+    conn_ring = &r;
+    acceptor_add();
+    uring_prep(&r, IORING_OP_TIMEOUT, -1, (void *)&tick, 1, 0, URING_TICK);
+    for (i = 0; i < URING_ACCEPTS; i++)
+        uring_prep(&r, IORING_OP_ACCEPT, server_sock, NULL, 0, 0,
+                URING_ACCEPT);
+
+    while (1)
+    {
+        /* no accept is armed again once draining is seen, so cancelling
+         * the ones in flight now stops them all */
+        if (!stopped && atomic_load(&draining))
+        {
+            for (i = 0; i < URING_ACCEPTS; i++)
+                uring_prep(&r, IORING_OP_ASYNC_CANCEL, -1,
+                        (void *)URING_ACCEPT, 0, 0, URING_CANCEL);
+            acceptor_stop();
+            stopped = 1;
+        }
+        if (uring_enter(&r, 1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            error_die("io_uring_enter");
+        }
+        head = *r.cq_head;
+        while (head != __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE))
+        {
+            cqe = &r.cqes[head & *r.cq_mask];
+            data = cqe->user_data;
+            res = cqe->res;
+            head++;
+            __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+            uring_complete(&r, server_sock, data, res);
+        }
+    }
+}
+
+/**********************************************************************/
+/* Send a pre-rendered error response with a single writev().
+ * Parameters: the client socket
+ *             one of the ERR_ constants
+ *             true if the connection stays open
+ * Returns: the number of bytes sent, or -1 on error */
+/**********************************************************************/
+int send_error(int client, int err, int keep_alive)
+{
+    const struct error_page *p = &error_pages[err];
+    struct iovec iov[3];
+
+    iov[0].iov_base = p->data;
+    iov[0].iov_len = p->head_len;
+    iov[1].iov_base = (char *)connection_line(keep_alive);
+    iov[1].iov_len = strlen(iov[1].iov_base);
+    iov[2].iov_base = p->data + p->head_len;
+    iov[2].iov_len = p->len - p->head_len;
+    if (send_iov(client, iov, 3) == -1)
+        return(-1);
+    return(p->len + strlen(connection_line(keep_alive)));
+}
+
+/**********************************************************************/
+/* Write out a set of iovecs completely, whatever the socket takes at
+ * a time, paced for a client over a -r/-R byte rate.
+ * Parameters: the socket
+ *             the iovecs, which are consumed
+ *             the number of iovecs
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int send_iov(int client, struct iovec *iov, int cnt)
+{
+    size_t len, cut;
+    ssize_t n;
+    int part;
+
+    while (cnt > 0)
+    {
+        len = iov_length(iov, cnt);
+        rate_wait(&len);
+        part = iov_clamp(iov, cnt, len, &cut);
+        n = writev(client, iov, part);
+        iov[part - 1].iov_len += cut;
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return(-1);
+        TRACE_MARK(TRACE_FIRST_SEND);
+        while (cnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return(0);
+}
+
+/**********************************************************************/
+/* Send the /__stats page.
+ * Parameters: the client socket
+ *             the request; its status is filled in
+ * Returns: the number of bytes sent, or -1 on error */
+/**********************************************************************/
+int send_stats(int client, struct request *req)
+{
+    char buf[8192];
+    struct iovec iov;
+    size_t len;
+
+    req->status = 200;
+    len = stats_response(buf, sizeof(buf), req);
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    return(send_iov(client, &iov, 1) == -1 ? -1 : (int)len);
+}
+
+/**********************************************************************/
+/* Send a regular file to the client.  Use headers, and report
+ * errors to client if they occur.  A 304 is just the headers.  Small
+ * files come out of the hot-file cache, variants compressed on the fly
+ * out of zip_table, and files in the snapshot image straight out of
+ * its mapping, with one writev().  Byte ranges go out straight from
+ * their file offsets, as a multipart/byteranges body if there are
+ * several.
+ * Parameters: the client socket descriptor
+ *             the request, with the path, stat and ranges of the file;
+ *              its from is filled in
+ * Returns: the number of bytes sent if the whole response was sent,
+ *          -1 otherwise */
+/**********************************************************************/
+off_t serve_file(int client, struct request *req)
+{
+    int resource;
+    off_t offset = req->base;
+    char buf[256];
+    const struct snap_body *b = req->snap_body;
+    struct cache_entry *e;
+    struct iovec iov[3];
+    off_t sent;
+    int hit;
+    int ret = 0;
+    int i, len;
+
+    if (req->not_modified)
+        return(headers(client, req));
+    if (req->nranges == 0 && b != NULL)
+    {
+        iov[0].iov_base = (char *)req->snap->base + b->hdr_off;
+        iov[0].iov_len = b->hdr_len;
+        iov[1].iov_base = (char *)cache_connection(req);
+        iov[1].iov_len = strlen(iov[1].iov_base);
+        iov[2].iov_base = (char *)req->snap->base + b->body_off;
+        iov[2].iov_len = b->size;
+        req->from = FROM_SNAPSHOT;
+        sent = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+        return(send_iov(client, iov, 3) == -1 ? -1 : sent);
+    }
+    if ((e = req->zip) != NULL || (e = req->listing) != NULL ||
+            (req->nranges == 0 && (e = cache_get(req, &hit)) != NULL))
+    {
+        req->from = e == req->zip ? FROM_ZIP : e == req->listing ?
+            FROM_LISTING : hit ? FROM_CACHE : FROM_FILE;
+        iov[0].iov_base = e->data;
+        iov[0].iov_len = e->hdr_len;
+        iov[1].iov_base = (char *)cache_connection(req);
+        iov[1].iov_len = strlen(iov[1].iov_base);
+        iov[2].iov_base = e->data + e->hdr_len;
+        iov[2].iov_len = e->size;
+        sent = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+        ret = send_iov(client, iov, 3);
+        if (e != req->zip && e != req->listing)
+            cache_put(e);
+        return(ret == -1 ? -1 : sent);
+    }
+
+    resource = req->fd;
+    if (resource == -1)
+    {
+        not_found(client);
+        return(-1);
+    }
+    req->from = FROM_FILE;
+    sent = headers(client, req) + req->length;
+    if (req->nranges == 0)
+        ret = cat(client, resource, &offset, req->st.st_size);
+    for (i = 0; i < req->nranges && ret == 0; i++)
+    {
+        if (req->nranges > 1)
+        {
+            len = format_part(buf, sizeof(buf), req, i);
+            send(client, buf, len, MSG_MORE);
+        }
+        offset = req->base + req->ranges[i].first;
+        ret = cat(client, resource, &offset,
+                req->ranges[i].last - req->ranges[i].first + 1);
+    }
+    if (req->nranges > 1 && ret == 0)
+    {
+        len = format_part(buf, sizeof(buf), req, req->nranges);
+        send(client, buf, len, 0);
+    }
+    return(ret == -1 ? -1 : sent);
+}
+
+/**********************************************************************/
+/* Tell the client the server is too busy to take the request. */
+/**********************************************************************/
+void service_unavailable(int client)
+{
+    send_error(client, ERR_UNAVAILABLE, 0);
+}
+
+/**********************************************************************/
+/* Put a descriptor into non-blocking mode.
+ * Parameter: the descriptor
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags == -1)
+        return(-1);
+    return(fcntl(fd, F_SETFL, flags | O_NONBLOCK));
+}
+
+/**********************************************************************/
+/* Body of a shard: pin the thread to the shard's CPU and run its event
+ * loop on the shard's own listener.
+ * Parameter: the struct shard */
+/**********************************************************************/
+void shard_thread(void *arg)
+{
+    struct shard *sh = arg;
+    cpu_set_t set;
+    int err;
+
+    CPU_ZERO(&set);
+    CPU_SET(sh->cpu, &set);
+    err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0)
+        fprintf(stderr, "httpd: cannot pin to cpu %d: %s\n", sh->cpu,
+                strerror(err));
+    sh->loop(sh->sock);
+}
+
+/**********************************************************************/
+/* Report the counters on request: SIGUSR1 prints the hot-file and url
+ * cache statistics to stderr, and writes out the request traces of a
+ * tracing build.  SIGQUIT hands the server over to a new copy of its
+ * binary, see restart().  SIGTERM and SIGINT stop the FastCGI workers
+ * before the server exits, as they would otherwise outlive it.  The
+ * signals are blocked in every other thread, so this thread takes them
+ * with sigwait() and may use stdio freely.
+ * Parameter: the set of signals to wait for */
+/**********************************************************************/
+void signal_thread(void *arg)
+{
+    sigset_t *set = arg;
+    int sig;
+
+    while (1)
+    {
+        if (sigwait(set, &sig) != 0)
+            continue;
+        if (sig == SIGUSR1)
+        {
+            pthread_mutex_lock(&cache_lock);
+            fprintf(stderr, "httpd: cache hits %llu misses %llu bytes %zu"
+                    " limit %zu\n", cache_hits, cache_misses, cache_bytes,
+                    cache_limit);
+            pthread_mutex_unlock(&cache_lock);
+            pthread_mutex_lock(&file_lock);
+            fprintf(stderr, "httpd: url cache hits %llu misses %llu"
+                    " entries %zu limit %zu\n", file_hits, file_misses,
+                    file_count, file_max);
+            pthread_mutex_unlock(&file_lock);
+#ifdef TRACE
+            trace_dump(trace_path);
+#endif
+        }
+        else if (sig == SIGHUP && snap_path != NULL)
+            snap_reload(snap_path);
+        else if (sig == SIGUSR2)
+            atomic_store(&log_reopen, 1);
+        else if (sig == SIGQUIT)
+            restart(set);
+        else if (sig == SIGTERM || sig == SIGINT)
+        {
+            fcgi_stop();
+            exit(0);
+        }
+    }
+}
+
+/**********************************************************************/
+/* Take a reference on the current snapshot image.  The pointer is
+ * checked again after the reference is taken: if the image was replaced
+ * meanwhile, the reference may have come too late to keep its mapping,
+ * so it is dropped and the new image tried.
+ * Returns: the image, to be released with snap_put(), or NULL if the
+ *          server does not run from one */
+/**********************************************************************/
+struct snapshot *snap_get(void)
+{
+    struct snapshot *s;
+
+    while ((s = atomic_load(&snap)) != NULL)
+    {
+        atomic_fetch_add(&s->refs, 1);
+        if (atomic_load(&snap) == s)
+            return(s);
+        snap_put(s);
+    }
+    return(NULL);
+}
+
+/**********************************************************************/
+/* Hash a key for the perfect hash of an image: FNV-1a from a seeded
+ * offset basis, finished with the MurmurHash3 mixer so that the bits a
+ * modulus looks at depend on every byte.
+ * Parameters: the key and its length
+ *             the seed
+ * Returns: the hash */
+/**********************************************************************/
+uint64_t snap_hash(const char *key, size_t len, uint64_t seed)
+{
+    uint64_t h = 14695981039346656037ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)key[i]) * 1099511628211ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return(h);
+}
+
+/**********************************************************************/
+/* Build the perfect hash over the urls of an image.  Urls are spread
+ * over buckets of about four; then, biggest bucket first, each bucket
+ * gets the first slot-hash seed that puts all its urls in free slots.
+ * If a bucket finds none, everything starts over with another bucket
+ * seed.
+ * Parameter: the builder, with all the keys; seed, nbuckets, nslots,
+ *            disp and slots are filled in
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int snap_index(struct snap_builder *b)
+{
+    size_t n = b->nkeys;
+    uint32_t nb = n / 4 + 1;
+    uint32_t ns = n + n / 8 + 1;
+    uint32_t *bucket = malloc((n + 1) * sizeof(*bucket));
+    uint32_t *members = malloc((n + 1) * sizeof(*members));
+    uint32_t *start = malloc((nb + 1) * sizeof(*start));
+    uint64_t *order = malloc(nb * sizeof(*order));
+    uint32_t slot[64];
+    uint32_t bk, cnt, d;
+    size_t i, j, k;
+    const char *url;
+    int ret = -1;
+
+    b->disp = calloc(nb, sizeof(*b->disp));
+    b->slots = malloc(ns * sizeof(*b->slots));
+    if (bucket == NULL || members == NULL || start == NULL ||
+            order == NULL || b->disp == NULL || b->slots == NULL)
+        goto out;
+    b->nbuckets = nb;
+    b->nslots = ns;
+
+    for (b->seed = 1; b->seed <= 64 && ret == -1; b->seed++)
+    {
+        memset(start, 0, (nb + 1) * sizeof(*start));
+        for (i = 0; i < n; i++)
+        {
+            url = b->keys[i].url;
+            bucket[i] = snap_hash(url, strlen(url), b->seed) % nb;
+            start[bucket[i] + 1]++;
+        }
+        for (i = 0; i < nb; i++)
+        {
+            order[i] = (uint64_t)start[i + 1] << 32 | i;
+            start[i + 1] += start[i];
+        }
+        for (i = 0; i < n; i++)
+            members[start[bucket[i]]++] = i;
+        for (i = nb; i > 0; i--)     /* back to where each bucket begins */
+            start[i] = start[i - 1];
+        start[0] = 0;
+        qsort(order, nb, sizeof(*order), snap_order);
+
+        for (i = 0; i < ns; i++)
+            b->slots[i] = -1;
+        for (i = 0; i < nb; i++)
+        {
+            bk = order[i] & 0xffffffff;
+            cnt = order[i] >> 32;
+            if (cnt == 0)
+                break;
+            if (cnt > sizeof(slot) / sizeof(slot[0]))
+                goto next_seed;
+            for (d = 1; d <= SNAP_MAX_DISP; d++)
+            {
+                for (j = 0; j < cnt; j++)
+                {
+                    url = b->keys[members[start[bk] + j]].url;
+                    slot[j] = snap_hash(url, strlen(url), d) % ns;
+                    if (b->slots[slot[j]] != -1)
+                        break;
+                    for (k = 0; k < j && slot[k] != slot[j]; k++)
+                        ;
+                    if (k < j)
+                        break;
+                }
+                if (j == cnt)
+                    break;
+            }
+            if (d > SNAP_MAX_DISP)
+                goto next_seed;
+            b->disp[bk] = d;
+            for (j = 0; j < cnt; j++)
+                b->slots[slot[j]] = members[start[bk] + j];
+        }
+        ret = 0;
+        break;
+next_seed:
+        ;
+    }
+
+out:
+    free(bucket);
+    free(members);
+    free(start);
+    free(order);
+    return(ret);
+}
+
+/**********************************************************************/
+/* Map a snapshot image and check that everything it points at lies
+ * inside it.
+ * Parameter: the path of the image
+ * Returns: the image with one reference, or NULL on error */
+/**********************************************************************/
+struct snapshot *snap_load(const char *path)
+{
+    struct snapshot *s;
+    const struct snap_header *h;
+    const struct snap_entry *e;
+    const struct snap_body *b;
+    struct stat st;
+    uint64_t size;
+    size_t i;
+    int j;
+    void *p;
+
+    s = calloc(1, sizeof(*s));
+    if (s == NULL)
+        return(NULL);
+    s->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (s->fd == -1 || fstat(s->fd, &st) == -1 ||
+            (size_t)st.st_size < sizeof(*h))
+        goto fail;
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, s->fd, 0);
+    if (p == MAP_FAILED)
+        goto fail;
+    s->base = p;
+    s->size = size = st.st_size;
+    s->hdr = h = p;
+    errno = EINVAL;
+    if (memcmp(h->magic, SNAP_MAGIC, sizeof(h->magic)) != 0 ||
+            h->size != size || h->nbuckets == 0 || h->nslots == 0 ||
+            h->disp_off % 4 != 0 || h->entries_off % 8 != 0 ||
+            h->disp_off > size ||
+            h->nbuckets > (size - h->disp_off) / sizeof(uint32_t) ||
+            h->entries_off > size ||
+            h->nslots > (size - h->entries_off) / sizeof(*e))
+        goto unmap;
+    s->disp = (const uint32_t *)(s->base + h->disp_off);
+    s->entries = (const struct snap_entry *)(s->base + h->entries_off);
+    for (i = 0; i < h->nslots; i++)
+    {
+        e = &s->entries[i];
+        if (e->url_off == 0)
+            continue;
+        if (e->url_off >= size || e->url_len > size - e->url_off ||
+                e->path_off >= size ||
+                memchr(s->base + e->path_off, '\0',
+                    size - e->path_off) == NULL)
+            goto unmap;
+        for (j = 0; j < SNAP_VARIANTS; j++)
+        {
+            b = &e->var[j];
+            if (b->hdr_len != 0 && (b->hdr_off > size ||
+                        b->hdr_len > size - b->hdr_off ||
+                        b->body_off > size || b->size > size - b->body_off))
+                goto unmap;
+        }
+        if (e->var[0].hdr_len == 0)
+            goto unmap;
+    }
+    atomic_init(&s->refs, 1);
+    atomic_init(&s->unmapped, 0);
+    return(s);
+
+unmap:
+    munmap(p, st.st_size);
+fail:
+    if (s->fd != -1)
+        close(s->fd);
+    free(s);
+    return(NULL);
+}
+
+/**********************************************************************/
+/* Find the entry of a url in a snapshot image: one probe of the
+ * perfect hash, then a comparison to tell a url that is not there.
+ * Parameters: the image
+ *             the url
+ * Returns: the entry, or NULL */
+/**********************************************************************/
+const struct snap_entry *snap_lookup(const struct snapshot *s,
+        const char *url)
+{
+    const struct snap_header *h = s->hdr;
+    const struct snap_entry *e;
+    size_t len = strlen(url);
+    uint32_t d;
+
+    d = s->disp[snap_hash(url, len, h->seed) % h->nbuckets];
+    e = &s->entries[snap_hash(url, len, d) % h->nslots];
+    if (e->url_off == 0 || e->url_len != len ||
+            memcmp(s->base + e->url_off, url, len) != 0)
+        return(NULL);
+    return(e);
+}
+
+/**********************************************************************/
+/* qsort() comparison putting the buckets of snap_index() in order of
+ * decreasing size (held in the upper half of each value). */
+/**********************************************************************/
+int snap_order(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return(x < y ? 1 : x > y ? -1 : 0);
+}
+
+/**********************************************************************/
+/* Pack everything under htdocs that would be served as a file into a
+ * snapshot image: the bodies with their rendered heads, then the urls,
+ * then the perfect hash and the entries.  The image is written next to
+ * its destination and renamed into place, so a running server sent a
+ * SIGHUP never sees half of it.  CGI programs are left out; they are
+ * still run from htdocs.
+ * Parameter: the path of the image
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int snap_pack(const char *out)
+{
+    static const char zero[8];
+    struct snap_builder b;
+    struct snap_header h;
+    struct snap_entry empty;
+    const struct snap_entry *e;
+    char tmp[512];
+    size_t i, len;
+    int ret = -1;
+
+    memset(&b, 0, sizeof(b));
+    memset(&empty, 0, sizeof(empty));
+    memset(&h, 0, sizeof(h));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", out);
+    b.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (b.fd == -1)
+        return(-1);
+    b.off = sizeof(h);
+    if (lseek(b.fd, b.off, SEEK_SET) == -1 ||
+            snap_pack_dir(&b, "htdocs", "/") == -1)
+        goto out;
+
+    for (i = 0; i < b.nkeys; i++)
+    {
+        b.keys[i].e.url_off = b.off;
+        b.keys[i].e.url_len = len = strlen(b.keys[i].url);
+        if (write_full(b.fd, b.keys[i].url, len + 1) == -1)
+            goto out;
+        b.off += len + 1;
+        b.keys[i].e.path_off = b.off;
+        len = strlen(b.keys[i].path);
+        if (write_full(b.fd, b.keys[i].path, len + 1) == -1)
+            goto out;
+        b.off += len + 1;
+    }
+    if (snap_index(&b) == -1)
+        goto out;
+
+    len = -b.off & 7;
+    if (write_full(b.fd, zero, len) == -1)
+        goto out;
+    b.off += len;
+    h.disp_off = b.off;
+    len = b.nbuckets * sizeof(*b.disp);
+    if (write_full(b.fd, b.disp, len) == -1)
+        goto out;
+    b.off += len;
+    len = -b.off & 7;
+    if (write_full(b.fd, zero, len) == -1)
+        goto out;
+    b.off += len;
+    h.entries_off = b.off;
+    for (i = 0; i < b.nslots; i++)
+    {
+        e = b.slots[i] == -1 ? &empty : &b.keys[b.slots[i]].e;
+        if (write_full(b.fd, e, sizeof(*e)) == -1)
+            goto out;
+        b.off += sizeof(*e);
+    }
+
+    memcpy(h.magic, SNAP_MAGIC, sizeof(h.magic));
+    h.size = b.off;
+    h.seed = b.seed;
+    h.nbuckets = b.nbuckets;
+    h.nslots = b.nslots;
+    if (pwrite(b.fd, &h, sizeof(h), 0) != sizeof(h) || fsync(b.fd) == -1 ||
+            rename(tmp, out) == -1)
+        goto out;
+    printf("httpd: packed %zu urls into %s, %llu bytes\n", b.nkeys, out,
+            (unsigned long long)b.off);
+    ret = 0;
+
+out:
+    if (ret == -1)
+        unlink(tmp);
+    close(b.fd);
+    for (i = 0; i < b.nkeys; i++)
+    {
+        free(b.keys[i].url);
+        free(b.keys[i].path);
+    }
+    free(b.keys);
+    free(b.disp);
+    free(b.slots);
+    return(ret);
+}
+
+/**********************************************************************/
+/* Pack a directory of htdocs and, recursively, its subdirectories.
+ * The directory's own urls, with and without the trailing slash, share
+ * the entry of its index.html, like file_resolve() does.  Symbolic
+ * links to directories are not followed.
+ * Parameters: the builder
+ *             the path of the directory
+ *             its url, ending with a slash
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int snap_pack_dir(struct snap_builder *b, const char *dir, const char *url)
+{
+    DIR *d;
+    struct dirent *de;
+    struct stat st, lst;
+    struct snap_key *k;
+    char path[512];
+    char sub[512];
+    size_t first = b->nkeys;
+    size_t i, len;
+    int ret = 0;
+
+    d = opendir(dir);
+    if (d == NULL)
+        return(-1);
+    while (ret == 0 && (de = readdir(d)) != NULL)
+    {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        /* urls the server would turn down as too long are left out */
+        if (snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >=
+                (int)sizeof(path) ||
+                snprintf(sub, sizeof(sub), "%s%s/", url, de->d_name) +
+                sizeof("htdocs/index.html") + 4 > sizeof(sub))
+            continue;
+        if (stat(path, &st) == -1 || lstat(path, &lst) == -1)
+            continue;
+        if (S_ISDIR(st.st_mode) && !S_ISLNK(lst.st_mode))
+            ret = snap_pack_dir(b, path, sub);
+        else if (S_ISREG(st.st_mode) &&
+                !(st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)))
+        {
+            sub[strlen(sub) - 1] = '\0';
+            ret = snap_pack_file(b, path, sub);
+        }
+    }
+    closedir(d);
+
+    snprintf(path, sizeof(path), "%s/index.html", dir);
+    for (i = first; i < b->nkeys && ret == 0; i++)
+    {
+        if (strcmp(b->keys[i].path, path) != 0)
+            continue;
+        len = strlen(url);
+        ret = snap_pack_file(b, NULL, url);
+        if (ret == 0 && len > 1)
+        {
+            strcpy(sub, url);
+            sub[len - 1] = '\0';
+            ret = snap_pack_file(b, NULL, sub);
+        }
+        if (ret == 0)
+            for (k = &b->keys[b->nkeys - (len > 1 ? 2 : 1)];
+                    k < b->keys + b->nkeys; k++)
+            {
+                k->e = b->keys[i].e;
+                k->path = strdup(path);
+                if (k->path == NULL)
+                    ret = -1;
+            }
+        break;
+    }
+    return(ret);
+}
+
+/**********************************************************************/
+/* Add a url to an image being packed and, for a file, write its
+ * bodies: the file and those of its precompressed siblings that are
+ * not older than it, each after its rendered response head.  Stale
+ * siblings still make the response vary, as in pick_encoding().
+ * Parameters: the builder
+ *             the path of the file, or NULL to add a url whose entry
+ *              and path the caller fills in
+ *             the url
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int snap_pack_file(struct snap_builder *b, const char *path,
+        const char *url)
+{
+    struct snap_key *k;
+    struct snap_body *v;
+    struct request req;
+    struct stat st[SNAP_VARIANTS];
+    int fd[SNAP_VARIANTS];
+    char name[512];
+    char buf[65536];
+    off_t got;
+    ssize_t n;
+    int vary = 0;
+    int ret = 0;
+    int i;
+
+    for (i = 0; i < SNAP_VARIANTS; i++)
+    {
+        fd[i] = -1;
+        if (path == NULL)
+            continue;
+        snprintf(name, sizeof(name), "%s%s", path,
+                i > 0 ? codings[i - 1][0] : "");
+        fd[i] = open(name, O_RDONLY | O_CLOEXEC);
+        if (fd[i] != -1 && (fstat(fd[i], &st[i]) == -1 ||
+                    !S_ISREG(st[i].st_mode)))
+        {
+            close(fd[i]);
+            fd[i] = -1;
+        }
+        if (i == 0 || fd[i] == -1)
+            continue;
+        vary = 1;
+        if (st[i].st_mtim.tv_sec < st[0].st_mtim.tv_sec ||
+                (st[i].st_mtim.tv_sec == st[0].st_mtim.tv_sec &&
+                 st[i].st_mtim.tv_nsec < st[0].st_mtim.tv_nsec))
+        {
+            close(fd[i]);
+            fd[i] = -1;
+        }
+    }
+    if (path != NULL && fd[0] == -1)
+        goto out;     /* gone since readdir() */
+
+    if (b->nkeys == b->cap)
+    {
+        b->cap = b->cap ? 2 * b->cap : 256;
+        k = realloc(b->keys, b->cap * sizeof(*k));
+        if (k == NULL)
+        {
+            ret = -1;
+            goto out;
+        }
+        b->keys = k;
+    }
+    k = &b->keys[b->nkeys++];
+    memset(k, 0, sizeof(*k));
+    k->url = strdup(url);
+    if (path != NULL)
+        k->path = strdup(path);
+    if (k->url == NULL || (path != NULL && k->path == NULL))
+    {
+        ret = -1;
+        goto out;
+    }
+    k->e.vary = vary;
+
+    for (i = 0; i < SNAP_VARIANTS && ret == 0; i++)
+    {
+        if (fd[i] == -1)
+            continue;
+        memset(&req, 0, sizeof(req));
+        req.st = st[i];
+        req.type = content_type(path);
+        req.encoding = i > 0 ? codings[i - 1][1] : NULL;
+        req.vary = vary;
+        req.length = st[i].st_size;
+        v = &k->e.var[i];
+        v->hdr_off = b->off;
+        v->hdr_len = format_entity(buf, sizeof(buf), &req);
+        if (write_full(b->fd, buf, v->hdr_len) == -1)
+            ret = -1;
+        b->off += v->hdr_len;
+        v->body_off = b->off;
+        v->size = st[i].st_size;
+        v->ino = st[i].st_ino;
+        v->mtime = st[i].st_mtim.tv_sec;
+        v->mtime_nsec = st[i].st_mtim.tv_nsec;
+        for (got = 0; got < st[i].st_size && ret == 0; got += n)
+        {
+            n = read(fd[i], buf, sizeof(buf));
+            if (n == -1 && errno == EINTR)
+                n = 0;
+            else if (n <= 0 || n > st[i].st_size - got ||
+                    write_full(b->fd, buf, n) == -1)
+                ret = -1;   /* the file changed under us */
+        }
+        b->off += st[i].st_size;
+    }
+
+out:
+    for (i = 0; i < SNAP_VARIANTS; i++)
+        if (fd[i] != -1)
+            close(fd[i]);
+    return(ret);
+}
+
+/**********************************************************************/
+/* Drop a reference on a snapshot image; the last one unmaps it.  A
+ * reference taken by snap_get() after the last one went is dropped
+ * again at once, so the mapping is only let go the first time.
+ * Parameter: the image */
+/**********************************************************************/
+void snap_put(struct snapshot *s)
+{
+    if (atomic_fetch_sub(&s->refs, 1) == 1 &&
+            atomic_exchange(&s->unmapped, 1) == 0)
+    {
+        munmap((void *)s->base, s->size);
+        close(s->fd);
+    }
+}
+
+/**********************************************************************/
+/* Map a snapshot image and make it the one requests are served from.
+ * Requests still using the previous image keep it mapped until they
+ * are done.
+ * Parameter: the path of the image
+ * Returns: 0 on success, -1 if the image could not be loaded */
+/**********************************************************************/
+int snap_reload(const char *path)
+{
+    struct snapshot *s, *old;
+
+    s = snap_load(path);
+    if (s == NULL)
+    {
+        fprintf(stderr, "httpd: snapshot %s: %s\n", path, strerror(errno));
+        return(-1);
+    }
+    old = atomic_exchange(&snap, s);
+    if (old != NULL)
+        snap_put(old);
+    fprintf(stderr, "httpd: serving snapshot %s, %zu bytes\n", path,
+            s->size);
+    return(0);
+}
+
+/**********************************************************************/
+/* Route a request to the snapshot image, if there is one and the url
+ * is in it: pick the variant the same way pick_encoding() does and set
+ * the request up to be sent from the image.
+ * Parameter: the request
+ * Returns: true if the request is served from the image */
+/**********************************************************************/
+int snap_route(struct request *req)
+{
+    struct snapshot *s;
+    const struct snap_entry *e;
+    const struct snap_body *b;
+    const char *path;
+    size_t i;
+
+    s = snap_get();
+    if (s == NULL)
+        return(0);
+    e = snap_lookup(s, req->url);
+    if (e == NULL)
+    {
+        snap_put(s);
+        return(0);
+    }
+    req->snap = s;
+    req->vary = e->vary;
+    path = s->base + e->path_off;
+    b = &e->var[0];
+    for (i = 0; i < sizeof(codings) / sizeof(codings[0]); i++)
+        if (e->var[i + 1].hdr_len != 0 &&
+                accepts_encoding(req->accept_encoding, codings[i][1]))
+        {
+            b = &e->var[i + 1];
+            req->encoding = codings[i][1];
+            break;
+        }
+    req->snap_body = b;
+    req->fd = s->fd;
+    req->base = b->body_off;
+    snprintf(req->path, sizeof(req->path), "%s%s", path,
+            req->encoding ? codings[i][0] : "");
+    req->type = content_type(path);
+    memset(&req->st, 0, sizeof(req->st));
+    req->st.st_mode = S_IFREG | 0444;
+    req->st.st_ino = b->ino;
+    req->st.st_size = b->size;
+    req->st.st_mtim.tv_sec = b->mtime;
+    req->st.st_mtim.tv_nsec = b->mtime_nsec;
+    return(1);
+}
+
+/**********************************************************************/
+/* Set up an empty socket queue.
+ * Parameters: the queue
+ *             the wanted capacity, rounded up to a power of two
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int sockq_init(struct sockq *q, size_t size)
+{
+    size_t cap = 2;
+    size_t i;
+
+    while (cap < size)
+        cap <<= 1;
+    q->cells = calloc(cap, sizeof(*q->cells));
+    if (q->cells == NULL)
+        return(-1);
+    for (i = 0; i < cap; i++)
+        atomic_init(&q->cells[i].seq, i);
+    q->mask = cap - 1;
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->dequeue_pos, 0);
+    return(sem_init(&q->items, 0, 0));
+}
+
+/**********************************************************************/
+/* Take a socket off the queue.  Only call this after a successful
+ * sem_wait() on the queue's semaphore, which guarantees a published
+ * cell is there for the taking.
+ * Parameter: the queue
+ * Returns: the socket */
+/**********************************************************************/
+int sockq_pop(struct sockq *q)
+{
+    struct sockq_cell *cell;
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    size_t seq;
+    intptr_t diff;
+
+    while (1)
+    {
+        cell = &q->cells[pos & q->mask];
+        seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos,
+                        &pos, pos + 1, memory_order_relaxed,
+                        memory_order_relaxed))
+                break;
+        }
+        else
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    }
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+    return(cell->fd);
+}
+
+/**********************************************************************/
+/* Put a socket on the queue without blocking.
+ * Parameters: the queue
+ *             the socket
+ * Returns: 0 on success, -1 if the queue is full */
+/**********************************************************************/
+int sockq_push(struct sockq *q, int fd)
+{
+    struct sockq_cell *cell;
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    size_t seq;
+    intptr_t diff;
+
+    while (1)
+    {
+        cell = &q->cells[pos & q->mask];
+        seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos,
+                        &pos, pos + 1, memory_order_relaxed,
+                        memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+            return(-1);
+        else
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    }
+    cell->fd = fd;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    sem_post(&q->items);
+    return(0);
+}
+
+/**********************************************************************/
+/* Terminate a line of a request head by overwriting its CRLF or LF.
+ * Parameters: the start of the line
+ *             the end of the buffer it is in
+ * Returns: the start of the next line, or end */
+/**********************************************************************/
+char *split_line(char *line, char *end)
+{
+    char *lf = memchr(line, '\n', end - line);
+
+    if (lf == NULL)
+        return(end);
+    if (lf > line && lf[-1] == '\r')
+        lf[-1] = '\0';
+    *lf = '\0';
+    return(lf + 1);
+}
+
+/**********************************************************************/
+/* This function starts the process of listening for web connections
+ * on a specified port.  If the port is 0, then dynamically allocate a
+ * port and modify the original port variable to reflect the actual
+ * port.
+ * Parameters: pointer to variable containing the port to connect on
+ *             the listen backlog
+ *             true to set SO_REUSEPORT so several sockets can share
+ *              the port
+ * Returns: the socket */
+/**********************************************************************/
+int startup(u_short *port, int backlog, int reuseport)
+{
+    int httpd = 0;
+    int on = 1;
+    struct sockaddr_in name;
+
+    httpd = socket(PF_INET, SOCK_STREAM, 0);
+    if (httpd == -1)
+        error_die("socket");
+    memset(&name, 0, sizeof(name));
+    name.sin_family = AF_INET;
+    name.sin_port = htons(*port);
+    name.sin_addr.s_addr = htonl(INADDR_ANY);
+    if ((setsockopt(httpd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))) < 0)  
+    {  
+        error_die("setsockopt failed");
+    }
+    if (reuseport &&
+            setsockopt(httpd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+        error_die("setsockopt SO_REUSEPORT");
+    if (bind(httpd, (struct sockaddr *)&name, sizeof(name)) < 0)
+        error_die("bind");
+    if (*port == 0)  /* if dynamically allocating a port */
+    {
+        socklen_t namelen = sizeof(name);
+        if (getsockname(httpd, (struct sockaddr *)&name, &namelen) == -1)
+            error_die("getsockname");
+        *port = ntohs(name.sin_port);
+    }
+    if (listen(httpd, backlog) < 0)
+        error_die("listen");
+    if (nlisteners < CPU_SETSIZE)
+        listeners[nlisteners++] = httpd;
+    return(httpd);
+}
+
+/**********************************************************************/
+/* Add to a counter of the calling thread's struct stats.  There is no
+ * other writer, so a relaxed load and store will do; readers may see
+ * the old value but never a torn one.
+ * Parameters: the counter
+ *             what to add */
+/**********************************************************************/
+void stat_add(_Atomic uint64_t *counter, uint64_t n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter,
+                memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/**********************************************************************/
+/* Tell which route class a request belongs to for the stats.
+ * Parameter: the routed request
+ * Returns: one of the STAT_ classes */
+/**********************************************************************/
+int stats_class(const struct request *req)
+{
+    size_t len = strlen(req->url);
+
+    if (req->cgi)
+        return(STAT_CGI);
+    if (strstr(req->url, "/dists/") != NULL)
+        return(STAT_DISTS);
+    if (len > 4 && strcmp(req->url + len - 4, ".deb") == 0)
+        return(STAT_DEB);
+    return(STAT_PAGE);
+}
+
+/**********************************************************************/
+/* Set up the stats before any thread serves a request: a thread's
+ * counters are folded into stats_retired when it exits. */
+/**********************************************************************/
+void stats_init(void)
+{
+    if (pthread_key_create(&stats_key, stats_retire) != 0)
+        error_die("pthread_key_create");
+}
+
+/**********************************************************************/
+/* Count a request whose response is out, or was cut short, in the
+ * calling thread's stats.
+ * Parameter: the request, with its start, status and sent */
+/**********************************************************************/
+void stats_record(const struct request *req)
+{
+    struct stats *s = stats_self();
+    uint64_t usec = monotonic_usec() - req->start;
+    int i;
+
+    if (s == NULL)
+        return;
+    for (i = 0; i < STAT_CODES - 1 && stat_codes[i] != req->status; i++)
+        ;
+    stat_add(&s->requests, 1);
+    stat_add(&s->bytes, req->sent);
+    hist_add(&s->hists[stats_class(req)], usec);
+    hist_add(&s->hists[STAT_CLASSES + i], usec);
+}
+
+/**********************************************************************/
+/* Render the /__stats page, headers and all.
+ * Parameters: the buffer and its size, at least 8192
+ *             the request; format=json in the query string selects JSON
+ * Returns: the length of the response */
+/**********************************************************************/
+size_t stats_response(char *buf, size_t size, const struct request *req)
+{
+    char body[7168];
+    int json = query_param(req->query_string, "format=json");
+    size_t len;
+    int n;
+
+    len = format_stats(body, sizeof(body), json);
+    n = snprintf(buf, size, "HTTP/1.1 200 OK\r\n" SERVER_STRING
+            "Content-Type: %s\r\n"
+            "Content-Length: %zu\r\n"
+            "Cache-Control: no-store\r\n"
+            "%s",
+            json ? "application/json" : "text/plain; charset=utf-8", len,
+            connection_line(req->keep_alive));
+    if (n < 0 || (size_t)n + len > size)
+        return(0);
+    memcpy(buf + n, body, len);
+    return(n + len);
+}
+
+/**********************************************************************/
+/* Fold the stats of an exiting thread into stats_retired, so that
+ * nothing it counted is lost.  Runs as the destructor of stats_key.
+ * Parameter: the thread's struct stats */
+/**********************************************************************/
+void stats_retire(void *arg)
+{
+    struct stats *s = arg;
+    struct stats **pp;
+    struct hist *h, *r;
+    uint64_t max;
+    int i, j;
+
+    pthread_mutex_lock(&stats_lock);
+    for (pp = &stats_list; *pp != s; pp = &(*pp)->next)
+        ;
+    *pp = s->next;
+    stat_add(&stats_retired.accepted, s->accepted);
+    stat_add(&stats_retired.closed, s->closed);
+    stat_add(&stats_retired.requests, s->requests);
+    stat_add(&stats_retired.bytes, s->bytes);
+    for (i = 0; i < STAT_SERIES; i++)
+    {
+        h = &s->hists[i];
+        r = &stats_retired.hists[i];
+        for (j = 0; j < HIST_BUCKETS; j++)
+            if (h->buckets[j] != 0)
+                stat_add(&r->buckets[j], h->buckets[j]);
+        stat_add(&r->sum, h->sum);
+        max = atomic_load(&h->max);
+        if (max > atomic_load(&r->max))
+            atomic_store(&r->max, max);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    free(s);
+}
+
+/**********************************************************************/
+/* The calling thread's struct stats, created and put on stats_list the
+ * first time the thread counts something.
+ * Returns: the stats, or NULL if they could not be allocated */
+/**********************************************************************/
+struct stats *stats_self(void)
+{
+    struct stats *s = stats_mine;
+
+    if (s != NULL)
+        return(s);
+    s = calloc(1, sizeof(*s));
+    if (s == NULL)
+        return(NULL);
+    pthread_mutex_lock(&stats_lock);
+    s->next = stats_list->next;     /* stats_retired stays first */
+    stats_list->next = s;
+    pthread_mutex_unlock(&stats_lock);
+    pthread_setspecific(stats_key, s);
+    stats_mine = s;
+    return(s);
+}
+
+/**********************************************************************/
+/* Render the line (or JSON member) of one latency histogram.  Call
+ * with stats_lock held.
+ * Parameters: the buffer and its size
+ *             what goes before the label: the series' group in text,
+ *              "" or "," in JSON
+ *             the label, such as "deb" or "404"
+ *             the histogram, an index into the hists of struct stats
+ *             true for JSON
+ * Returns: the length of the output */
+/**********************************************************************/
+size_t stats_series(char *buf, size_t size, const char *prefix,
+        const char *label, int series, int json)
+{
+    struct hist_total t;
+    int n;
+
+    stats_total(series, &t);
+    n = snprintf(buf, size, json ? "%s\"%s\":{\"count\":%llu,\"mean\":%llu,"
+            "\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}" :
+            "%s %s %llu %llu %llu %llu %llu %llu\n",
+            prefix, label, (unsigned long long)t.count,
+            (unsigned long long)(t.count ? t.sum / t.count : 0),
+            (unsigned long long)hist_percentile(&t, 0.5),
+            (unsigned long long)hist_percentile(&t, 0.99),
+            (unsigned long long)hist_percentile(&t, 0.999),
+            (unsigned long long)t.max);
+    if (n < 0)
+        return(0);
+    return((size_t)n < size ? (size_t)n : size - 1);
+}
+
+/**********************************************************************/
+/* Add up one latency histogram over all threads.  Call with
+ * stats_lock held.
+ * Parameters: the histogram, an index into the hists of struct stats
+ *             where to put the total */
+/**********************************************************************/
+void stats_total(int series, struct hist_total *t)
+{
+    const struct stats *s;
+    const struct hist *h;
+    uint64_t v;
+    int i;
+
+    memset(t, 0, sizeof(*t));
+    for (s = stats_list; s != NULL; s = s->next)
+    {
+        h = &s->hists[series];
+        for (i = 0; i < HIST_BUCKETS; i++)
+        {
+            v = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+            t->buckets[i] += v;
+            t->count += v;
+        }
+        t->sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+        v = atomic_load_explicit(&h->max, memory_order_relaxed);
+        if (v > t->max)
+            t->max = v;
+    }
+}
+
+/**********************************************************************/
+/* Arm a timer, or move it if it is armed already.
+ * Parameters: the wheel
+ *             the timer
+ *             the milliseconds until it fires, rounded up to ticks */
+/**********************************************************************/
+void timer_arm(struct wheel *w, struct timer *t, uint64_t ms)
+{
+    struct timer *slot;
+    uint64_t ticks = (ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+
+    timer_cancel(w, t);
+    /* from the clock, not from w->now: a loop with nothing armed
+     * sleeps without running its wheel */
+    t->expires = wheel_tick() + (ticks > 0 ? ticks : 1);
+    slot = &w->slots[t->expires & (WHEEL_SLOTS - 1)];
+    t->prev = slot->prev;
+    t->next = slot;
+    slot->prev->next = t;
+    slot->prev = t;
+    w->armed++;
+}
+
+/**********************************************************************/
+/* Disarm a timer, if it is armed.
+ * Parameters: the wheel it is on
+ *             the timer */
+/**********************************************************************/
+void timer_cancel(struct wheel *w, struct timer *t)
+{
+    if (t->next == NULL)
+        return;
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+    w->armed--;
+}
+
+#ifdef TRACE
+/**********************************************************************/
+/* Start on the next request of a blocking connection: trace it if it
+ * is one of the sampled ones, from now on.  The phases of any request
+ * begun before and never finished are forgotten. */
+/**********************************************************************/
+void trace_begin(void)
+{
+    trace_cur = NULL;
+    if (trace_every == 0 || atomic_fetch_add_explicit(&trace_count, 1,
+                memory_order_relaxed) % trace_every != 0)
+        return;
+    memset(trace_rec.at, 0, sizeof(trace_rec.at));
+    trace_cur = &trace_rec;
+    trace_mark(TRACE_ACCEPT);
+}
+
+/**********************************************************************/
+/* Write the records in trace_ring out as Chrome trace_event JSON, for
+ * SIGUSR1.  Each request becomes a complete event from its first byte
+ * to its last send, with its phases as nested events, preceded by the
+ * wait for that first byte.  Records that are being overwritten are
+ * skipped.
+ * Parameter: the path of the file to write */
+/**********************************************************************/
+void trace_dump(const char *path)
+{
+    static struct trace_record rec;
+    static const char event[] = ",\n{\"name\":\"%s\",\"cat\":\"%s\","
+        "\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%llu.%03u,"
+        "\"dur\":%llu.%03u";
+    char name[sizeof(rec.method) * 6 + sizeof(rec.path) * 6 + 2];
+    struct trace_slot *slot;
+    uint64_t seq, end, s, from;
+    int pid = getpid();
+    size_t len;
+    FILE *fp;
+    int n = 0;
+    int p;
+
+    fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        perror(path);
+        return;
+    }
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"args\":{\"name\":\"httpd\"}}", pid);
+    end = atomic_load(&trace_next);
+    for (seq = end > TRACE_RING ? end - TRACE_RING : 0; seq < end; seq++)
+    {
+        slot = &trace_ring[seq & (TRACE_RING - 1)];
+        s = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        rec = slot->rec;
+        atomic_thread_fence(memory_order_acquire);
+        if (s != seq + 1 ||
+                atomic_load_explicit(&slot->seq, memory_order_relaxed) != s)
+            continue;
+        from = rec.at[TRACE_FIRST_BYTE];
+        fprintf(fp, event, trace_names[TRACE_FIRST_BYTE], "wait", pid,
+                rec.tid, (unsigned long long)rec.at[TRACE_ACCEPT] / 1000,
+                (unsigned)(rec.at[TRACE_ACCEPT] % 1000),
+                (unsigned long long)(from - rec.at[TRACE_ACCEPT]) / 1000,
+                (unsigned)((from - rec.at[TRACE_ACCEPT]) % 1000));
+        fputc('}', fp);
+        len = log_escape(name, rec.method);
+        name[len++] = ' ';
+        name[len + log_escape(name + len, rec.path)] = '\0';
+        fprintf(fp, event, name, "request", pid, rec.tid,
+                (unsigned long long)from / 1000, (unsigned)(from % 1000),
+                (unsigned long long)(rec.at[TRACE_LAST_SEND] - from) / 1000,
+                (unsigned)((rec.at[TRACE_LAST_SEND] - from) % 1000));
+        fprintf(fp, ",\"args\":{\"status\":%d,\"bytes\":%lld}}",
+                rec.status, rec.bytes);
+        for (p = TRACE_PARSED; p <= TRACE_LAST_SEND; p++)
+        {
+            if (rec.at[p] == 0)
+                continue;
+            fprintf(fp, event, trace_names[p], "phase", pid, rec.tid,
+                    (unsigned long long)from / 1000, (unsigned)(from % 1000),
+                    (unsigned long long)(rec.at[p] - from) / 1000,
+                    (unsigned)((rec.at[p] - from) % 1000));
+            fputc('}', fp);
+            from = rec.at[p];
+        }
+        n++;
+    }
+    fprintf(fp, "\n]}\n");
+    if (fclose(fp) == EOF)
+        perror(path);
+    else
+        fprintf(stderr, "httpd: %d request traces written to %s\n", n, path);
+}
+
+/**********************************************************************/
+/* Finish the trace of a request whose response is out (or was cut
+ * short) and put it into trace_ring in place of the oldest record.
+ * Parameter: the request, with its status and sent */
+/**********************************************************************/
+void trace_end(const struct request *req)
+{
+    struct trace_record *rec = trace_cur;
+    struct trace_slot *slot;
+    uint64_t seq;
+
+    if (rec->tid == 0)
+        rec->tid = syscall(SYS_gettid);
+    rec->status = req->status;
+    rec->bytes = req->sent;
+    snprintf(rec->method, sizeof(rec->method), "%s", req->method);
+    snprintf(rec->path, sizeof(rec->path), "%s", req->url);
+    seq = atomic_fetch_add_explicit(&trace_next, 1, memory_order_relaxed);
+    slot = &trace_ring[seq & (TRACE_RING - 1)];
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->rec = *rec;
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_release);
+    trace_cur = NULL;
+}
+
+/**********************************************************************/
+/* Note the time a traced request reaches a phase, unless it has been
+ * there before: only the first byte and the first send count.
+ * Parameter: one of the TRACE_ phases */
+/**********************************************************************/
+void trace_mark(int phase)
+{
+    struct timespec ts;
+
+    if (trace_cur->at[phase] != 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    trace_cur->at[phase] = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+/**********************************************************************/
+/* Inform the client that the requested web method has not been
+ * implemented.
+ * Parameter: the client socket */
+/**********************************************************************/
+void unimplemented(int client)
+{
+    send_error(client, ERR_UNIMPLEMENTED, 0);
+}
+
+/**********************************************************************/
+/* Act on one completion from the ring and queue the next operation of
+ * the connection it belongs to.
+ * Parameters: the ring
+ *             the listening socket
+ *             the user_data of the completion
+ *             its result: a byte count or descriptor, or -errno */
+/**********************************************************************/
+void uring_complete(struct uring *r, int server_sock, uint64_t data, int res)
+{
+    static const struct __kernel_timespec tick = {
+        0, WHEEL_TICK_MS * 1000000L
+    };
+    struct conn *c = (struct conn *)(uintptr_t)(data & ~(uint64_t)URING_OPMASK);
+    in_addr_t peer;
+
+    switch (data & URING_OPMASK)
+    {
+        case URING_ACCEPT:
+            if (!atomic_load(&draining))
+                uring_prep(r, IORING_OP_ACCEPT, server_sock, NULL, 0, 0,
+                        URING_ACCEPT);
+            if (res == -ECANCELED)
+                return;
+            if (res < 0)
+            {
+                errno = -res;
+                perror("accept");
+                return;
+            }
+            if (ip_admit(res, &peer) == -1)
+            {
+                service_unavailable(res);
+                linger_close(res);
+                return;
+            }
+            c = calloc(1, sizeof(*c));
+            if (c == NULL)
+            {
+                ip_release(peer);
+                close(res);
+                return;
+            }
+            c->fd = res;
+            c->file = -1;
+            c->state = CONN_READ;
+            c->peer = peer;
+            if (stats_self() != NULL)
+                stat_add(&stats_mine->accepted, 1);
+            uring_request(r, c);
+            return;
+        case URING_CANCEL:
+            return;
+        case URING_TICK:
+            uring_prep(r, IORING_OP_TIMEOUT, -1, (void *)&tick, 1, 0,
+                    URING_TICK);
+            wheel_run(conn_wheel, uring_expire);
+            return;
+        case URING_RECV:
+            if (res <= 0)
+                break;
+            c->rlen += res;
+            uring_request(r, c);
+            return;
+        case URING_SEND:
+        case URING_WRITEV:
+            if (res <= 0)
+                break;
+            c->woff += res;
+            c->req.sent += res;
+            conn_timer(c);
+            uring_send(r, c);
+            return;
+        case URING_READ:
+            if (res <= 0)
+                break;
+            c->offset += res;
+            c->wlen = res;
+            c->woff = 0;
+            uring_send(r, c);
+            return;
+    }
+    conn_close(c);
+}
+
+/**********************************************************************/
+/* Submit everything queued on the ring, optionally waiting for at
+ * least that many completions.
+ * Parameters: the ring
+ *             the number of completions to wait for
+ * Returns: what io_uring_enter() returns */
+/**********************************************************************/
+int uring_enter(struct uring *r, unsigned wait)
+{
+    int ret;
+
+    ret = syscall(__NR_io_uring_enter, r->fd, r->pending, wait,
+            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret >= 0)
+        r->pending -= ret < (int)r->pending ? (unsigned)ret : r->pending;
+    return(ret);
+}
+
+/**********************************************************************/
+/* The timer of an io_uring connection fired.  Its operation in flight
+ * fails once the socket is shut down, and that closes the connection.
+ * A connection holding a paced send back has none; it sends now.
+ * Parameter: the timer, the first member of the struct conn */
+/**********************************************************************/
+void uring_expire(struct timer *t)
+{
+    struct conn *c = (struct conn *)t;
+
+    if (c->timing == TIMING_PACE)
+    {
+        c->timing = TIMING_NONE;
+        conn_timer(c);
+        uring_send(conn_ring, c);
+        return;
+    }
+    atomic_fetch_add(&conn_timeouts, 1);
+    shutdown(c->fd, SHUT_RDWR);
+}
+
+/**********************************************************************/
+/* Create an io_uring and map its rings.
+ * Parameters: the ring to set up
+ *             the number of submission queue entries
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int uring_init(struct uring *r, unsigned entries)
 {
-    int client = (intptr_t)arg;
-    char buf[1024];
-    size_t numchars;
-    char method[255];
-    char url[255];
-    char path[512];
-    size_t i, j;
-    struct stat st;
-    int cgi = 0;      /* becomes true if server decides this is a CGI
-                       * program */
-    char *query_string = NULL;
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    char *sq, *cq;
 
-    numchars = get_line(client, buf, sizeof(buf));
-    i = 0; j = 0;
-    while (!ISspace(buf[i]) && (i < sizeof(method) - 1))
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd == -1)
+        return(-1);
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        return(-1);
+    cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
     {
-        method[i] = buf[i];
-        i++;
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            return(-1);
     }
-    j=i;
-    method[i] = '\0';
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+            IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        return(-1);
+
+    r->sq_entries = p.sq_entries;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return(0);
+}
+
+/**********************************************************************/
+/* Queue one operation on the ring.  Nothing reaches the kernel until
+ * the next uring_enter(), unless the submission queue is full.
+ * Parameters: the ring
+ *             the IORING_OP_ opcode
+ *             the descriptor to operate on
+ *             the buffer and its length, for reads, recvs and sends
+ *             the file offset, for reads
+ *             the user_data handed back with the completion */
+/**********************************************************************/
+void uring_prep(struct uring *r, int op, int fd, void *buf, unsigned len,
+        off_t offset, uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail = *r->sq_tail;
+    unsigned index;
+
+    while (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) ==
+            r->sq_entries)
+        if (uring_enter(r, 0) == -1 && errno != EINTR)
+            error_die("io_uring_enter");
 
-    if (strcasecmp(method, "GET") && strcasecmp(method, "POST"))
+    index = tail & *r->sq_mask;
+    sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = data;
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->pending++;
+}
+
+/**********************************************************************/
+/* Move a connection that is waiting for a request head along: receive
+ * more of it, or, once it is complete (possibly already buffered by
+ * pipelining), queue the response.
+ * Parameters: the ring
+ *             the connection */
+/**********************************************************************/
+void uring_request(struct uring *r, struct conn *c)
+{
+    if (!conn_head_done(c))
     {
-        unimplemented(client);
+        if (c->rlen == sizeof(c->rbuf))
+        {
+            request_too_large(c->fd);
+            conn_close(c);
+            return;
+        }
+        conn_timer(c);
+        uring_prep(r, IORING_OP_RECV, c->fd, c->rbuf + c->rlen,
+                sizeof(c->rbuf) - c->rlen, 0, (uintptr_t)c | URING_RECV);
         return;
     }
+    switch (conn_prepare(c))
+    {
+        case ROUTE_FILE:
+            conn_timer(c);
+            uring_send(r, c);
+            return;
+        case ROUTE_CGI:
+            timer_cancel(conn_wheel, &c->timer);
+            conn_start_cgi(c);
+            return;
+        case ROUTE_H2:
+            timer_cancel(conn_wheel, &c->timer);
+            conn_start_h2(c);
+            return;
+    }
+    conn_close(c);
+}
 
-    if (strcasecmp(method, "POST") == 0)
-        cgi = 1;
+/**********************************************************************/
+/* Queue the next operation of a connection writing its response: a
+ * send of what is left in wbuf, a read of the next chunk of the file
+ * into it, a writev() of a cached or snapshot response, or, once it is
+ * all out, whatever comes after the response.  Sends are cut short or
+ * put off for a client over a -r/-R byte rate.
+ * Parameters: the ring
+ *             the connection */
+/**********************************************************************/
+void uring_send(struct uring *r, struct conn *c)
+{
+    size_t len, cut;
+    int cnt;
 
-    i = 0;
-    while (ISspace(buf[j]) && (j < numchars))
-        j++;
-    while (!ISspace(buf[j]) && (i < sizeof(url) - 1) && (j < numchars))
+    if (c->vec && (cnt = conn_iov(c)) > 0)
+    {
+        len = iov_length(c->iov, cnt);
+        if (conn_pace(c, &len))
+            return;
+        uring_prep(r, IORING_OP_WRITEV, c->fd, c->iov,
+                iov_clamp(c->iov, cnt, len, &cut), 0,
+                (uintptr_t)c | URING_WRITEV);
+        return;
+    }
+    if (!c->vec && c->woff == c->wlen && c->file != -1 &&
+            c->offset < c->end)
+    {
+        uring_prep(r, IORING_OP_READ, c->file, c->wbuf,
+                c->end - c->offset < (off_t)sizeof(c->wbuf) ?
+                c->end - c->offset : (off_t)sizeof(c->wbuf),
+                c->offset, (uintptr_t)c | URING_READ);
+        return;
+    }
+    if (!c->vec && (c->woff < c->wlen || conn_next_part(c)))
     {
-        url[i] = buf[j];
-        i++; j++;
+        len = c->wlen - c->woff;
+        if (conn_pace(c, &len))
+            return;
+        uring_prep(r, IORING_OP_SEND, c->fd, c->wbuf + c->woff, len, 0,
+                (uintptr_t)c | URING_SEND);
+        return;
     }
-    url[i] = '\0';
+    if (conn_finish(c) == 1)
+        uring_request(r, c);
+}
+
+/**********************************************************************/
+/* Undo the percent-encoding of a url, in place.
+ * Parameter: the url, without its query string
+ * Returns: 0, or -1 if an escape is malformed or stands for a NUL */
+/**********************************************************************/
+int url_decode(char *url)
+{
+    char *d = url;
+    char *p;
+    char hex[3] = "";
 
-    if (strcasecmp(method, "GET") == 0)
+    for (p = url; *p != '\0'; p++)
     {
-        query_string = url;
-        while ((*query_string != '?') && (*query_string != '\0'))
-            query_string++;
-        if (*query_string == '?')
+        if (*p != '%')
         {
-            cgi = 1;
-            *query_string = '\0';
-            query_string++;
+            *d++ = *p;
+            continue;
         }
+        if (!isxdigit((unsigned char)p[1]) || !isxdigit((unsigned char)p[2]))
+            return(-1);
+        hex[0] = p[1];
+        hex[1] = p[2];
+        if ((*d++ = strtol(hex, NULL, 16)) == '\0')
+            return(-1);
+        p += 2;
     }
+    *d = '\0';
+    return(0);
+}
 
-    sprintf(path, "htdocs%s", url);
-    if (path[strlen(path) - 1] == '/')
-        strcat(path, "index.html");
-    if (stat(path, &st) == -1) {
-        while ((numchars > 0) && strcmp("\n", buf))  /* read & discard headers */
-            numchars = get_line(client, buf, sizeof(buf));
-        not_found(client);
-    }
-    else
+/**********************************************************************/
+/* Percent-encode a path for a link: everything but letters, digits,
+ * "-._~" and slashes is escaped, which leaves nothing that needs
+ * escaping in HTML either.
+ * Parameters: where to put it, room for three times the string
+ *             the path
+ * Returns: the length of the output */
+/**********************************************************************/
+size_t url_escape(char *dst, const char *src)
+{
+    const unsigned char *p = (const unsigned char *)src;
+    char *d = dst;
+
+    for (; *p != '\0'; p++)
     {
-        if ((st.st_mode & S_IFMT) == S_IFDIR)
-            strcat(path, "/index.html");
-        if ((st.st_mode & S_IXUSR) ||
-                (st.st_mode & S_IXGRP) ||
-                (st.st_mode & S_IXOTH)    )
-            cgi = 1;
-        if (!cgi)
-            serve_file(client, path);
+        if (isalnum(*p) || strchr("-._~/", *p) != NULL)
+            *d++ = *p;
         else
-            execute_cgi(client, path, method, query_string);
+            d += sprintf(d, "%%%02X", *p);
     }
-
-    close(client);
+    return(d - dst);
 }
 
 /**********************************************************************/
-/* Inform the client that a request it has made has a problem.
- * Parameters: client socket */
+/* Check that a url stays inside htdocs once it is pasted after
+ * "htdocs": it starts with a slash and has no ".." path segment.
+ * Parameter: the url, without its query string
+ * Returns: true if it may be looked up */
 /**********************************************************************/
-void bad_request(int client)
+int url_safe(const char *url)
 {
-    char buf[1024];
+    const char *p = url;
 
-    sprintf(buf, "HTTP/1.0 400 BAD REQUEST\r\n");
-    send(client, buf, sizeof(buf), 0);
-    sprintf(buf, "Content-type: text/html\r\n");
-    send(client, buf, sizeof(buf), 0);
-    sprintf(buf, "\r\n");
-    send(client, buf, sizeof(buf), 0);
-    sprintf(buf, "<P>Your browser sent a bad request, ");
-    send(client, buf, sizeof(buf), 0);
-    sprintf(buf, "such as a POST without a Content-Length.\r\n");
-    send(client, buf, sizeof(buf), 0);
+    if (url[0] != '/')
+        return(0);
+    while ((p = strstr(p, "..")) != NULL)
+    {
+        if (p[-1] == '/' && (p[2] == '/' || p[2] == '\0'))
+            return(0);
+        p += 2;
+    }
+    return(1);
 }
 
 /**********************************************************************/
-/* Put the entire contents of a file out on a socket.  This function
- * is named after the UNIX "cat" command, because it might have been
- * easier just to do something like pipe, fork, and exec("cat").
- * Parameters: the client socket descriptor
- *             FILE pointer for the file to cat */
+/* Make sure a directory is watched for the url cache.
+ * Parameter: the path of the directory
+ * Returns: its watch, or NULL if it cannot be watched (it does not
+ *          exist, or there is no inotify) */
 /**********************************************************************/
-void cat(int client, FILE *resource)
+struct dir_watch *watch_dir(const char *path)
 {
-    char buf[1024];
+    struct dir_watch *d;
+    int wd;
 
-    fgets(buf, sizeof(buf), resource);
-    while (!feof(resource))
+    if (inotify_fd == -1)
+        return(NULL);
+    /* watching a directory twice just returns the same descriptor */
+    wd = inotify_add_watch(inotify_fd, path, IN_MODIFY | IN_ATTRIB |
+            IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+            IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    if (wd == -1)
+        return(NULL);
+    pthread_mutex_lock(&watch_lock);
+    for (d = watches; d != NULL; d = d->next)
+        if (d->wd == wd)
+            break;
+    if (d == NULL && (d = calloc(1, sizeof(*d))) != NULL)
     {
-        send(client, buf, strlen(buf), 0);
-        fgets(buf, sizeof(buf), resource);
+        d->wd = wd;
+        d->path = strdup(path);
+        atomic_init(&d->gen, 0);
+        d->next = watches;
+        watches = d;
     }
+    pthread_mutex_unlock(&watch_lock);
+    return(d);
 }
 
 /**********************************************************************/
-/* Inform the client that a CGI script could not be executed.
- * Parameter: the client socket descriptor. */
+/* Read inotify events and invalidate the url cache entries they
+ * concern by bumping the generation of the directory.  Changes that
+ * may move whole subtrees (directories created, deleted or renamed, a
+ * watched directory going away, or an event queue overflow) bump the
+ * global generation and so invalidate everything.
+ * Parameter: unused */
 /**********************************************************************/
-void cannot_execute(int client)
+void watch_thread(void *arg)
 {
-    char buf[1024];
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    struct dir_watch *d;
+    ssize_t n;
+    char *p;
 
-    sprintf(buf, "HTTP/1.0 500 Internal Server Error\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "Content-type: text/html\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "<P>Error prohibited CGI execution.\r\n");
-    send(client, buf, strlen(buf), 0);
+    (void)arg;
+    while (1)
+    {
+        n = read(inotify_fd, buf, sizeof(buf));
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            perror("inotify");
+            return;
+        }
+        for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len)
+        {
+            ev = (const struct inotify_event *)p;
+            if (ev->mask & (IN_ISDIR | IN_DELETE_SELF | IN_MOVE_SELF |
+                        IN_IGNORED | IN_Q_OVERFLOW))
+                atomic_fetch_add(&file_gen, 1);
+            pthread_mutex_lock(&watch_lock);
+            for (d = watches; d != NULL; d = d->next)
+                if (d->wd == ev->wd)
+                    break;
+            if (d != NULL)
+            {
+                atomic_fetch_add(&d->gen, 1);
+                if (ev->mask & IN_IGNORED)
+                    d->wd = -1;   /* the number may be handed out again */
+            }
+            pthread_mutex_unlock(&watch_lock);
+        }
+    }
 }
 
 /**********************************************************************/
-/* Print out an error message with perror() (for system errors; based
- * on value of errno, which indicates system call errors) and exit the
- * program indicating an error. */
+/* Set up an empty timer wheel.
+ * Parameter: the wheel */
 /**********************************************************************/
-void error_die(const char *sc)
+void wheel_init(struct wheel *w)
 {
-    perror(sc);
-    exit(1);
+    int i;
+
+    w->now = wheel_tick();
+    w->armed = 0;
+    for (i = 0; i < WHEEL_SLOTS; i++)
+        w->slots[i].prev = w->slots[i].next = &w->slots[i];
 }
 
 /**********************************************************************/
-/* Execute a CGI script.  Will need to set environment variables as
- * appropriate.
- * Parameters: client socket descriptor
- *             path to the CGI script */
+/* Fire the timers that are due: walk the slots of the ticks passed
+ * since the last run (a lap at most, after a long stall).  A timer is
+ * disarmed before it fires, and the callback may free it.
+ * Parameters: the wheel
+ *             what to do with an expired timer */
 /**********************************************************************/
-void execute_cgi(int client, const char *path,
-        const char *method, const char *query_string)
+void wheel_run(struct wheel *w, void (*fire)(struct timer *))
 {
-    char buf[1024];
-    int cgi_output[2];
-    int cgi_input[2];
-    pid_t pid;
-    int status;
-    int i;
-    char c;
-    int numchars = 1;
-    int content_length = -1;
+    uint64_t now = wheel_tick();
+    uint64_t tick;
+    struct timer *slot, *t, *next;
 
-    buf[0] = 'A'; buf[1] = '\0';
-    if (strcasecmp(method, "GET") == 0)
-        while ((numchars > 0) && strcmp("\n", buf))  /* read & discard headers */
-            numchars = get_line(client, buf, sizeof(buf));
-    else if (strcasecmp(method, "POST") == 0) /*POST*/
+    if (now - w->now > WHEEL_SLOTS)
+        w->now = now - WHEEL_SLOTS;
+    for (tick = w->now + 1; tick <= now; tick++)
     {
-        numchars = get_line(client, buf, sizeof(buf));
-        while ((numchars > 0) && strcmp("\n", buf))
+        slot = &w->slots[tick & (WHEEL_SLOTS - 1)];
+        for (t = slot->next; t != slot; t = next)
         {
-            buf[15] = '\0';
-            if (strcasecmp(buf, "Content-Length:") == 0)
-                content_length = atoi(&(buf[16]));
-            numchars = get_line(client, buf, sizeof(buf));
-        }
-        if (content_length == -1) {
-            bad_request(client);
-            return;
+            next = t->next;
+            if (t->expires <= now)
+            {
+                timer_cancel(w, t);
+                fire(t);
+            }
         }
     }
-    else/*HEAD or other*/
-    {
-    }
+    w->now = now;
+}
 
+/**********************************************************************/
+/* The monotonic clock in wheel ticks. */
+/**********************************************************************/
+uint64_t wheel_tick(void)
+{
+    return(monotonic_usec() / (WHEEL_TICK_MS * 1000));
+}
 
-    if (pipe(cgi_output) < 0) {
-        cannot_execute(client);
-        return;
-    }
-    if (pipe(cgi_input) < 0) {
-        cannot_execute(client);
-        return;
-    }
+/**********************************************************************/
+/* Write exactly len bytes, however many the descriptor takes at a time.
+ * Parameters: the descriptor
+ *             the bytes and their number
+ * Returns: 0 on success, -1 on error */
+/**********************************************************************/
+int write_full(int fd, const void *buf, size_t len)
+{
+    ssize_t n;
 
-    if ( (pid = fork()) < 0 ) {
-        cannot_execute(client);
-        return;
-    }
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    send(client, buf, strlen(buf), 0);
-    if (pid == 0)  /* child: CGI script */
+    while (len > 0)
     {
-        char meth_env[255];
-        char query_env[255];
-        char length_env[255];
+        n = write(fd, buf, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return(-1);
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+    return(0);
+}
 
-        dup2(cgi_output[1], STDOUT);
-        dup2(cgi_input[0], STDIN);
-        close(cgi_output[0]);
-        close(cgi_input[1]);
-        sprintf(meth_env, "REQUEST_METHOD=%s", method);
-        putenv(meth_env);
-        if (strcasecmp(method, "GET") == 0) {
-            sprintf(query_env, "QUERY_STRING=%s", query_string);
-            putenv(query_env);
-        }
-        else {   /* POST */
-            sprintf(length_env, "CONTENT_LENGTH=%d", content_length);
-            putenv(length_env);
-        }
-        exit(0);
-    } else {    /* parent */
-        close(cgi_output[1]);
-        close(cgi_input[0]);
-        if (strcasecmp(method, "POST") == 0)
-            for (i = 0; i < content_length; i++) {
-                recv(client, &c, 1, 0);
-                write(cgi_input[1], &c, 1);
-            }
-        while (read(cgi_output[0], &c, 1) > 0)
-            send(client, &c, 1, 0);
+/**********************************************************************/
+/* Take a variant out of zip_table and its LRU list and drop the
+ * table's reference to it.  Call with zip_lock held.
+ * Parameter: the entry */
+/**********************************************************************/
+void zip_evict(struct cache_entry *e)
+{
+    struct cache_entry **pp;
 
-        close(cgi_output[0]);
-        close(cgi_input[1]);
-        waitpid(pid, &status, 0);
-    }
+    for (pp = &zip_table[e->hash]; *pp != e; pp = &(*pp)->hnext)
+        ;
+    *pp = e->hnext;
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    e->prev = e->next = NULL;     /* tells a worker not to fill it in */
+    zip_bytes -= sizeof(*e) + e->hdr_len + e->size;
+    cache_put(e);
 }
 
 /**********************************************************************/
-/* Get a line from a socket, whether the line ends in a newline,
- * carriage return, or a CRLF combination.  Terminates the string read
- * with a null character.  If no newline indicator is found before the
- * end of the buffer, the string is terminated with a null.  If any of
- * the above three line terminators is read, the last character of the
- * string will be a linefeed and the string will be terminated with a
- * null character.
- * Parameters: the socket descriptor
- *             the buffer to save the data in
- *             the size of the buffer
- * Returns: the number of bytes stored (excluding null) */
+/* Look up the variant of a file in a coding.  On a miss a pending
+ * entry goes into the table and a job onto the queue of the zip
+ * workers, so the file is compressed once however many requests ask
+ * for it meanwhile; they are all answered with the file as it is.
+ * Parameters: the request, with the path, stat, type and descriptor of
+ *             the file
+ *             the coding, "gzip" or "deflate"
+ * Returns: a referenced entry, to be released with cache_put(), or
+ *          NULL if there is no usable variant (yet) */
 /**********************************************************************/
-int get_line(int sock, char *buf, int size)
+struct cache_entry *zip_get(const struct request *req, const char *coding)
 {
-    int i = 0;
-    char c = '\0';
-    int n;
+    struct cache_entry *e;
+    struct zip_job *job;
+    unsigned h = 2166136261u;   /* FNV-1a */
+    const char *p;
+
+    for (p = req->path; *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    h = (h ^ (unsigned char)*coding) % ZIP_BUCKETS;
 
-    while ((i < size - 1) && (c != '\n'))
+    pthread_mutex_lock(&zip_lock);
+    for (e = zip_table[h]; e != NULL; e = e->hnext)
+        if (e->coding == coding && strcmp(e->path, req->path) == 0)
+            break;
+    if (e != NULL && (e->ino != req->st.st_ino ||
+                e->dev != req->st.st_dev ||
+                e->src_size != req->st.st_size ||
+                e->mtime.tv_sec != req->st.st_mtim.tv_sec ||
+                e->mtime.tv_nsec != req->st.st_mtim.tv_nsec))
     {
-        n = recv(sock, &c, 1, 0);
-        /* DEBUG printf("%02X\n", c); */
-        if (n > 0)
+        zip_evict(e);
+        e = NULL;
+    }
+    if (e != NULL)
+    {
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+        e->next = zip_lru.next;
+        e->prev = &zip_lru;
+        zip_lru.next->prev = e;
+        zip_lru.next = e;
+        if (e->state == ZIP_READY)
+            atomic_fetch_add(&e->refs, 1);
+        else
+            e = NULL;
+        pthread_mutex_unlock(&zip_lock);
+        return(e);
+    }
+    if (zip_queued >= ZIP_QUEUE ||
+            (e = calloc(1, sizeof(*e))) == NULL ||
+            (job = calloc(1, sizeof(*job))) == NULL ||
+            (e->path = strdup(req->path)) == NULL ||
+            (job->fd = dup(req->fd)) == -1)
+    {
+        pthread_mutex_unlock(&zip_lock);
+        if (e != NULL)
         {
-            if (c == '\r')
-            {
-                n = recv(sock, &c, 1, MSG_PEEK);
-                /* DEBUG printf("%02X\n", c); */
-                if ((n > 0) && (c == '\n'))
-                    recv(sock, &c, 1, 0);
-                else
-                    c = '\n';
-            }
-            buf[i] = c;
-            i++;
+            free(e->path);
+            free(e);
+            free(job);
         }
-        else
-            c = '\n';
+        return(NULL);
     }
-    buf[i] = '\0';
+    e->coding = coding;
+    e->state = ZIP_PENDING;
+    e->dev = req->st.st_dev;
+    e->ino = req->st.st_ino;
+    e->src_size = req->st.st_size;
+    e->mtime = req->st.st_mtim;
+    e->hash = h;
+    e->hnext = zip_table[h];
+    zip_table[h] = e;
+    e->next = zip_lru.next;
+    e->prev = &zip_lru;
+    zip_lru.next->prev = e;
+    zip_lru.next = e;
+    atomic_init(&e->refs, 2);   /* the table's and the job's */
+    zip_bytes += sizeof(*e);
+    while (zip_bytes > zip_limit && zip_lru.prev != e)
+        zip_evict(zip_lru.prev);
 
-    return(i);
+    job->e = e;
+    job->type = req->type;
+    job->st = req->st;
+    *zip_tail = job;
+    zip_tail = &job->next;
+    zip_queued++;
+    pthread_cond_signal(&zip_wake);
+    pthread_mutex_unlock(&zip_lock);
+    return(NULL);
 }
 
 /**********************************************************************/
-/* Return the informational HTTP headers about a file. */
-/* Parameters: the socket to print the headers on
- *             the name of the file */
+/* Compress a file for a job and render the headers of the variant.
+ * Parameters: the job
+ *             out: the headers followed by the compressed body, to be
+ *             freed by the caller
+ *             out: the length of the headers
+ *             out: the length of the body
+ * Returns: 0 on success, -1 if the file changed, could not be read or
+ *          does not get smaller */
 /**********************************************************************/
-void headers(int client, const char *filename)
+int zip_make(struct zip_job *job, char **data, size_t *hdr_len,
+        size_t *size)
 {
-    char buf[1024];
-    (void)filename;  /* could use filename to determine file type */
+    struct cache_entry *e = job->e;
+    struct request hdr;
+    struct timespec t0, t1;
+    struct stat st;
+    z_stream z;
+    char head[1024];
+    char *in = NULL, *out = NULL;
+    size_t got = 0;
+    ssize_t n;
+    int ret = -1;
+
+    if (fstat(job->fd, &st) == -1 || st.st_size != e->src_size ||
+            st.st_mtim.tv_sec != e->mtime.tv_sec ||
+            st.st_mtim.tv_nsec != e->mtime.tv_nsec ||
+            (in = malloc(st.st_size)) == NULL)
+        return(-1);
+    while (got < (size_t)st.st_size)
+    {
+        n = pread(job->fd, in + got, st.st_size - got, got);
+        if (n <= 0)
+            goto out;
+        got += n;
+    }
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+    memset(&z, 0, sizeof(z));
+    /* windowBits 15 + 16 asks for the gzip wrapper, plain 15 for the
+     * zlib one that HTTP calls "deflate" */
+    if (deflateInit2(&z, ZIP_LEVEL, Z_DEFLATED,
+                strcmp(e->coding, "gzip") == 0 ? 15 + 16 : 15, 8,
+                Z_DEFAULT_STRATEGY) != Z_OK)
+        goto out;
+    out = malloc(deflateBound(&z, got));
+    if (out != NULL)
+    {
+        z.next_in = (Bytef *)in;
+        z.avail_in = got;
+        z.next_out = (Bytef *)out;
+        z.avail_out = deflateBound(&z, got);
+        if (deflate(&z, Z_FINISH) == Z_STREAM_END && z.total_out < got)
+            ret = 0;
+    }
+    deflateEnd(&z);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+    atomic_fetch_add(&zip_cpu, (t1.tv_sec - t0.tv_sec) * 1000000000ULL +
+            t1.tv_nsec - t0.tv_nsec);
+    atomic_fetch_add(&zip_in, got);
+    atomic_fetch_add(&zip_out, z.total_out);
+    if (ret == -1)
+        goto out;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.st = st;
+    hdr.type = job->type;
+    hdr.encoding = e->coding;
+    hdr.vary = 1;
+    hdr.length = z.total_out;
+    hdr.zip = e;
+    *hdr_len = format_entity(head, sizeof(head), &hdr);
+    *size = z.total_out;
+    *data = malloc(*hdr_len + *size);
+    if (*data == NULL)
+        ret = -1;
+    else
+    {
+        memcpy(*data, head, *hdr_len);
+        memcpy(*data + *hdr_len, out, *size);
+        atomic_fetch_add(&zip_files, 1);
+    }
 
-    strcpy(buf, "HTTP/1.0 200 OK\r\n");
-    send(client, buf, strlen(buf), 0);
-    strcpy(buf, SERVER_STRING);
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "Content-Type: text/html\r\n");
-    send(client, buf, strlen(buf), 0);
-    strcpy(buf, "\r\n");
-    send(client, buf, strlen(buf), 0);
+out:
+    free(in);
+    free(out);
+    return(ret);
 }
 
 /**********************************************************************/
-/* Give a client a 404 not found status message. */
+/* Choose on-the-fly compression for a file that has no precompressed
+ * sibling, if its type compresses well and the client takes gzip or
+ * deflate.  Responses of such files vary by Accept-Encoding either way.
+ * Byte ranges are left to the file as it is.
+ * Parameter: the request, after pick_encoding(); zip and encoding are
+ *            set if a variant is ready to send */
 /**********************************************************************/
-void not_found(int client)
+void zip_pick(struct request *req)
 {
-    char buf[1024];
+    const char *coding;
 
-    sprintf(buf, "HTTP/1.0 404 NOT FOUND\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, SERVER_STRING);
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "Content-Type: text/html\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "<HTML><TITLE>Not Found</TITLE>\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "<BODY><P>The server could not fulfill\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "your request because the resource specified\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "is unavailable or nonexistent.\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "</BODY></HTML>\r\n");
-    send(client, buf, strlen(buf), 0);
+    if (zip_limit == 0 || req->st.st_size < ZIP_MIN ||
+            req->st.st_size > ZIP_MAX || !zip_type(req->type))
+        return;
+    req->vary = 1;
+    if (req->range[0] != '\0')
+        return;
+    if (accepts_encoding(req->accept_encoding, "gzip"))
+        coding = "gzip";
+    else if (accepts_encoding(req->accept_encoding, "deflate"))
+        coding = "deflate";
+    else
+        return;
+    req->zip = zip_get(req, coding);
+    if (req->zip != NULL)
+    {
+        req->encoding = coding;
+        atomic_fetch_add(&zip_hits, 1);
+    }
 }
 
 /**********************************************************************/
-/* Send a regular file to the client.  Use headers, and report
- * errors to client if they occur.
- * Parameters: a pointer to a file structure produced from the socket
- *              file descriptor
- *             the name of the file to serve */
+/* Start the -Z threads that compress files for zip_get(), or turn
+ * compression off if there are to be none. */
 /**********************************************************************/
-void serve_file(int client, const char *filename)
+void zip_start(void)
 {
-    FILE *resource = NULL;
-    int numchars = 1;
-    char buf[1024];
-
-    buf[0] = 'A'; buf[1] = '\0';
-    while ((numchars > 0) && strcmp("\n", buf))  /* read & discard headers */
-        numchars = get_line(client, buf, sizeof(buf));
+    pthread_t newthread;
+    int i;
 
-    resource = fopen(filename, "r");
-    if (resource == NULL)
-        not_found(client);
-    else
+    if (zip_workers < 1)
+        zip_limit = 0;
+    for (i = 0; i < zip_workers && zip_limit > 0; i++)
     {
-        headers(client, filename);
-        cat(client, resource);
+        if (pthread_create(&newthread, NULL, (void *)zip_thread, NULL) != 0)
+            error_die("pthread_create");
+        pthread_detach(newthread);
     }
-    fclose(resource);
 }
 
 /**********************************************************************/
-/* This function starts the process of listening for web connections
- * on a specified port.  If the port is 0, then dynamically allocate a
- * port and modify the original port variable to reflect the actual
- * port.
- * Parameters: pointer to variable containing the port to connect on
- * Returns: the socket */
+/* A compression worker: take jobs off the queue, compress the file and
+ * fill the variant in, unless it was evicted in the meantime.
+ * Parameter: unused */
 /**********************************************************************/
-int startup(u_short *port)
+void zip_thread(void *arg)
 {
-    int httpd = 0;
-    int on = 1;
-    struct sockaddr_in name;
+    struct zip_job *job;
+    struct cache_entry *e;
+    size_t hdr_len = 0, size = 0;
+    char *data;
+    int ret;
 
-    httpd = socket(PF_INET, SOCK_STREAM, 0);
-    if (httpd == -1)
-        error_die("socket");
-    memset(&name, 0, sizeof(name));
-    name.sin_family = AF_INET;
-    name.sin_port = htons(*port);
-    name.sin_addr.s_addr = htonl(INADDR_ANY);
-    if ((setsockopt(httpd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))) < 0)  
-    {  
-        error_die("setsockopt failed");
-    }
-    if (bind(httpd, (struct sockaddr *)&name, sizeof(name)) < 0)
-        error_die("bind");
-    if (*port == 0)  /* if dynamically allocating a port */
+    (void)arg;
+    while (1)
     {
-        socklen_t namelen = sizeof(name);
-        if (getsockname(httpd, (struct sockaddr *)&name, &namelen) == -1)
-            error_die("getsockname");
-        *port = ntohs(name.sin_port);
+        pthread_mutex_lock(&zip_lock);
+        while (zip_jobs == NULL)
+            pthread_cond_wait(&zip_wake, &zip_lock);
+        job = zip_jobs;
+        zip_jobs = job->next;
+        if (zip_jobs == NULL)
+            zip_tail = &zip_jobs;
+        zip_queued--;
+        e = job->e;
+        ret = e->prev != NULL ? 0 : -1;   /* evicted while it waited */
+        pthread_mutex_unlock(&zip_lock);
+
+        data = NULL;
+        if (ret == 0)
+            ret = zip_make(job, &data, &hdr_len, &size);
+        pthread_mutex_lock(&zip_lock);
+        if (e->prev == NULL)
+            free(data);
+        else if (ret == -1)
+            e->state = ZIP_USELESS;
+        else
+        {
+            e->data = data;
+            e->hdr_len = hdr_len;
+            e->size = size;
+            e->state = ZIP_READY;
+            zip_bytes += hdr_len + size;
+            while (zip_bytes > zip_limit && zip_lru.prev != &zip_lru)
+                zip_evict(zip_lru.prev);
+        }
+        pthread_mutex_unlock(&zip_lock);
+        cache_put(e);
+        close(job->fd);
+        free(job);
     }
-    if (listen(httpd, 5) < 0)
-        error_die("listen");
-    return(httpd);
 }
 
 /**********************************************************************/
-/* Inform the client that the requested web method has not been
- * implemented.
- * Parameter: the client socket */
+/* Tell whether files of a Content-Type are worth compressing.
+ * Parameter: the type
+ * Returns: true for text and the structured text formats */
 /**********************************************************************/
-void unimplemented(int client)
+int zip_type(const char *type)
 {
-    char buf[1024];
+    return(strncmp(type, "text/", 5) == 0 ||
+            strcmp(type, "application/javascript") == 0 ||
+            strcmp(type, "application/json") == 0 ||
+            strcmp(type, "application/xml") == 0 ||
+            strcmp(type, "image/svg+xml") == 0);
+}
+
+#ifdef PARSE_BENCH
+/**********************************************************************/
+/* Microbenchmark of the request parser, built by "make parsebench" in
+ * place of the server.  Times head_length() plus parse_request() on an
+ * apt-style request held in memory, then the same with the head
+ * delivered through a socketpair and read by recv_head(), which is what
+ * a request costs before route_request() gets to it.
+ * Usage: parsebench [iterations] */
+/**********************************************************************/
 
-    sprintf(buf, "HTTP/1.0 501 Method Not Implemented\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, SERVER_STRING);
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "Content-Type: text/html\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "<HTML><HEAD><TITLE>Method Not Implemented\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "</TITLE></HEAD>\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "<BODY><P>HTTP request method not supported.\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "</BODY></HTML>\r\n");
-    send(client, buf, strlen(buf), 0);
+int main(int argc, char *argv[])
+{
+    static const char sample[] =
+        "GET /debian/dists/stable/main/binary-amd64/Packages.gz HTTP/1.1\r\n"
+        "Host: dpkg123.github.io\r\n"
+        "User-Agent: Debian APT-HTTP/1.3 (2.6.1)\r\n"
+        "Accept: text/*\r\n"
+        "Cache-Control: max-age=0\r\n"
+        "If-Modified-Since: Sat, 17 Oct 2026 07:06:58 GMT\r\n"
+        "If-None-Match: \"ce801b-493e0-18df3f56a87bc6c9\"\r\n"
+        "Range: bytes=1024-\r\n"
+        "If-Range: Sat, 17 Oct 2026 07:06:58 GMT\r\n"
+        "Accept-Encoding: gzip, br\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n";
+    char buf[HEAD_MAX];
+    struct request req;
+    long iterations = 1000000;
+    struct timespec t0, t1;
+    size_t len, scan;
+    long i;
+    int sv[2];
+
+    if (argc > 1)
+        iterations = atol(argv[1]);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < iterations; i++)
+    {
+        memcpy(buf, sample, sizeof(sample) - 1);
+        scan = 0;
+        len = head_length(buf, sizeof(sample) - 1, &scan);
+        if (len == 0 || parse_request(&req, buf, len) < 0)
+            error_die("parse_request");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("parse: %ld requests of %zu bytes, %.1f ns/request\n",
+            iterations, sizeof(sample) - 1,
+            ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) /
+            iterations);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+        error_die("socketpair");
+    iterations /= 10;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < iterations; i++)
+    {
+        if (write(sv[0], sample, sizeof(sample) - 1) == -1)
+            error_die("write");
+        len = 0;
+        if (recv_head(sv[1], buf, sizeof(buf), &len, NULL) <= 0 ||
+                parse_request(&req, buf, len) < 0)
+            error_die("recv_head");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("recv+parse: %ld requests, %.1f ns/request\n", iterations,
+            ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) /
+            iterations);
+    close(sv[0]);
+    close(sv[1]);
+
+    return(0);
 }
 
+#else
+/**********************************************************************/
+/* Usage: httpd [-p port] [-b backlog] [-m thread|epoll|pool|shard|uring]
+ *              [-w workers] [-q size] [-k seconds] [-t seconds]
+ *              [-T seconds] [-i connections] [-n requests] [-c bytes]
+ *              [-f workers] [-s entries] [-P image] [-S image] [-l file]
+ *              [-D seconds]
+ *   -p  port to listen on (default 4000, 0 picks a free one)
+ *   -b  listen backlog (default SOMAXCONN)
+ *   -m  connection model: "thread" spawns a thread per connection (the
+ *       default), "epoll" serves everything from one event loop, "pool"
+ *       hands sockets to a fixed set of worker threads, "shard" runs one
+ *       SO_REUSEPORT listener and epoll loop per CPU, "uring" the same
+ *       with an io_uring per CPU
+ *   -w  number of pool workers (default 32)
+ *   -q  pool queue capacity; clients beyond it get a 503 (default 256)
+ *   -k  keep-alive idle timeout in seconds (default 5)
+ *   -t  seconds a client gets to send a whole request head, from its
+ *       first byte or the connection (default 10)
+ *   -T  seconds a request body read or a response send may stall
+ *       (default 30)
+ *   -i  connections open at once per client address; more get a 503,
+ *       0 lifts the cap (default 64)
+ *   -r  limit each client address to so many requests per second and,
+ *       after a slash, bytes per second, with a second's worth of
+ *       burst: requests beyond that get a 429, responses are paced
+ *   -R  the same for each network of the given prefix length, as in
+ *       "-R 24:200/50000000"; may be combined with -r
+ *   -n  requests served per connection before closing it (default 100);
+ *       with -m thread or pool a kept-alive client holds its thread
+ *   -c  size of the hot-file cache in bytes, 0 disables it (default
+ *       32 MB); files over 1 MB are never cached.  Send SIGUSR1 for
+ *       its hit and miss counters
+ *   -z  bytes of gzip/deflate variants kept for text files that have no
+ *       precompressed sibling, 0 turns compression off (default 16 MB).
+ *       The first request for a file gets it as it is while a worker
+ *       compresses it; /__stats shows the ratio and the CPU time spent
+ *   -Z  compression worker threads (default 2)
+ *   -f  run executables named *.fcgi as FastCGI responders with this
+ *       many warm worker processes each, instead of forking a CGI
+ *       process per request (default 0: plain CGI)
+ *   -s  entries of the url cache, which keeps resolved paths, their stat
+ *       and open descriptors and is invalidated through inotify; 0
+ *       disables it (default 8192, at most a quarter of the descriptor
+ *       limit)
+ *   -P  pack htdocs into a snapshot image, then exit unless -S is given
+ *       too (so "-P site.img -S site.img" packs at startup)
+ *   -S  serve from a snapshot image: the urls in it are answered from a
+ *       read-only mapping, anything else (CGI, files added since) from
+ *       htdocs.  Send SIGHUP to switch to the image now at that path
+ *   -l  append an access log to this file, one JSON object per request
+ *       (time, method, path, status, bytes, usec, range, cache), written
+ *       in batches by a thread of its own.  Send SIGUSR2 after rotating
+ *       it to have it reopened; records dropped because logging fell
+ *       behind are counted in the log and on /__stats
+ *   -D  after a restart, seconds the old server keeps serving the
+ *       connections it has before it cuts them off (default 300).  Send
+ *       SIGQUIT to restart: the binary is started again by the same
+ *       path and arguments and takes over the listening sockets, so a
+ *       new build is deployed without refusing or cutting off anyone;
+ *       if it does not come up, the old server carries on
+ *   -x  built with -DTRACE (make httpd-trace): trace one request in
+ *       this many served by -m thread or pool, 0 for none (default
+ *       100).  Each gets the time it reached each phase, from waiting
+ *       for its first byte through parsing, resolving and opening the
+ *       file to its first and last send; the latest 4096 are kept
+ *   -X  built with -DTRACE: where SIGUSR1 writes the kept traces, as
+ *       Chrome trace_event JSON to open in Perfetto (default
+ *       httpd-trace.json)
+ * GET /__stats returns request, byte and connection counters, the
+ * accept queue depth and latency percentiles by route class and status
+ * code, as text or, with ?format=json, as JSON.
+ * A directory without an index.html gets a listing of its files, with
+ * sizes and modification times, and subdirectories: HTML or, with
+ * ?format=json, JSON.  It is rendered once and kept with the url cache
+ * entry until something in the directory changes.
+ * Clients may speak HTTP/2 without TLS (h2c), starting with the prior
+ * knowledge preface or an Upgrade: h2c request, in any -m model: the
+ * connection gets a thread of its own that multiplexes up to 100
+ * streams.  CGI programs are only run over HTTP/1.x; -n counts streams
+ * and -k, -T bound the idle time and stalls of the connection. */
 /**********************************************************************/
 
-int main(void)
+int main(int argc, char *argv[])
 {
     int server_sock = -1;
     u_short port = 4000;
-    int client_sock = -1;
-    struct sockaddr_in client_name;
-    socklen_t  client_name_len = sizeof(client_name);
+    int mode = MODE_THREAD;
+    int workers = 32;
+    size_t queue_size = 256;
+    int backlog = SOMAXCONN;
+    static sigset_t signals;
     pthread_t newthread;
+    const char *pack_path = NULL;
+    struct sigaction sa;
+    int opt;
 
-    server_sock = startup(&port);
-    printf("httpd running on port %d\n", port);
+    while ((opt = getopt(argc, argv,
+                    "p:b:m:w:q:k:t:T:i:r:R:n:c:z:Z:f:s:S:P:l:D:"
+                    TRACE_OPTS)) != -1)
+    {
+        switch (opt)
+        {
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'b':
+                backlog = atoi(optarg);
+                break;
+            case 'm':
+                if (strcmp(optarg, "thread") == 0)
+                    mode = MODE_THREAD;
+                else if (strcmp(optarg, "epoll") == 0)
+                    mode = MODE_EPOLL;
+                else if (strcmp(optarg, "pool") == 0)
+                    mode = MODE_POOL;
+                else if (strcmp(optarg, "shard") == 0)
+                    mode = MODE_SHARD;
+                else if (strcmp(optarg, "uring") == 0)
+                    mode = MODE_URING;
+                else
+                {
+                    fprintf(stderr, "httpd: unknown mode %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 'q':
+                queue_size = atoi(optarg);
+                break;
+            case 'k':
+                keepalive_timeout = atoi(optarg);
+                break;
+            case 't':
+                request_timeout = atoi(optarg);
+                break;
+            case 'T':
+                io_timeout = atoi(optarg);
+                break;
+            case 'i':
+                ip_max = atoi(optarg);
+                break;
+            case 'r':
+            case 'R':
+                if (rate_count == RATE_LIMITS ||
+                        rate_option(&rate_limits[rate_count], optarg,
+                            opt == 'R') == -1)
+                {
+                    fprintf(stderr, "httpd: bad rate limit %s\n", optarg);
+                    exit(1);
+                }
+                rate_count++;
+                break;
+            case 'n':
+                keepalive_max = atoi(optarg);
+                break;
+            case 'c':
+                cache_limit = strtoull(optarg, NULL, 10);
+                break;
+            case 'z':
+                zip_limit = strtoull(optarg, NULL, 10);
+                break;
+            case 'Z':
+                zip_workers = atoi(optarg);
+                break;
+            case 's':
+                file_max = strtoull(optarg, NULL, 10);
+                break;
+            case 'S':
+                snap_path = optarg;
+                break;
+            case 'P':
+                pack_path = optarg;
+                break;
+            case 'l':
+                log_path = optarg;
+                break;
+            case 'D':
+                drain_timeout = atoi(optarg);
+                break;
+#ifdef TRACE
+            case 'x':
+                trace_every = atoi(optarg);
+                break;
+            case 'X':
+                trace_path = optarg;
+                break;
+#endif
+            case 'f':
+                fcgi_workers = atoi(optarg);
+                if (fcgi_workers < 0 || fcgi_workers > FCGI_MAX_WORKERS)
+                    fcgi_workers = FCGI_MAX_WORKERS;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-p port] [-b backlog]"
+                        " [-m thread|epoll|pool|shard|uring] [-w workers]"
+                        " [-q size] [-k seconds] [-t seconds] [-T seconds]"
+                        " [-i connections] [-r reqs[/bytes]]"
+                        " [-R bits:reqs[/bytes]] [-n requests] [-c bytes]"
+                        " [-z bytes] [-Z workers]"
+                        " [-f workers] [-s entries] [-P image]"
+                        " [-S image] [-l file] [-D seconds]" TRACE_USAGE
+                        "\n",
+                        argv[0]);
+                exit(1);
+        }
+    }
 
-    while (1)
+    if (pack_path != NULL)
     {
-        client_sock = accept(server_sock,
-                (struct sockaddr *)&client_name,
-                &client_name_len);
-        if (client_sock == -1)
-            error_die("accept");
-        /* accept_request(&client_sock); */
-        if (pthread_create(&newthread , NULL, (void *)accept_request, (void *)(intptr_t)client_sock) != 0)
-            perror("pthread_create");
+        if (snap_pack(pack_path) == -1)
+            error_die("snap_pack");
+        if (snap_path == NULL)
+            exit(0);
     }
 
+    restart_argv = argv;
+    listen_inherit();
+    signal(SIGPIPE, SIG_IGN);
+    /* no SA_RESTART: the signal is there to interrupt accept() */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = drain_wake;
+    sigaction(SIGALRM, &sa, NULL);
+    error_pages_init();
+    stats_init();
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR2);
+    sigaddset(&signals, SIGQUIT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    if (pthread_create(&newthread, NULL, (void *)signal_thread, &signals) != 0)
+        error_die("pthread_create");
+    pthread_detach(newthread);
+    file_cache_init();
+    if (snap_path != NULL && snap_reload(snap_path) == -1)
+        exit(1);
+    if (log_path != NULL)
+        log_start(log_path);
+    if (mode == MODE_THREAD || mode == MODE_POOL)
+        guard_start();
+    if (zip_limit > 0)
+        zip_start();
+    linger_start();
+    server_sock = listen_take(&port);
+    if (server_sock == -1)
+        server_sock = startup(&port, backlog,
+                mode == MODE_SHARD || mode == MODE_URING);
+    printf("httpd running on port %d\n", port);
+    fflush(stdout);
+    if (mode != MODE_SHARD && mode != MODE_URING)
+        listen_ready();     /* run_shards() does once it has them all */
+
+    if (mode == MODE_EPOLL)
+        run_epoll(server_sock);
+    else if (mode == MODE_POOL)
+        run_pool(server_sock, workers, queue_size);
+    else if (mode == MODE_SHARD)
+        run_shards(server_sock, port, backlog, run_epoll);
+    else if (mode == MODE_URING)
+        run_shards(server_sock, port, backlog, run_uring);
+    else
+        run_threads(server_sock);
+
     close(server_sock);
 
     return(0);
 }
+#endif
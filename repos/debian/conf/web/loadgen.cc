@@ -0,0 +1,730 @@
+/* loadgen: HTTP load generator and benchmark scenarios for httpd.
+ *
+ * Usage: loadgen [-h host] [-p port] [-t threads] [-c connections]
+ *                [-d depth] [-k 0|1] [-s seconds] [-w seconds]
+ *                [-n requests] [-r root] [-u prefix] [-R bytes]
+ *                [-o file] [-C file] scenario
+ *   -h  server address (127.0.0.1)         -p  server port (4000)
+ *   -t  client threads, each with an epoll loop of its own (1)
+ *   -c  connections, spread over the threads (32)
+ *   -d  requests pipelined per connection (1)
+ *   -k  0 to send every request on a new connection (1)
+ *   -s  seconds measured (10)              -w  seconds of warm-up first (1)
+ *   -n  stop after this many requests instead of after -s seconds
+ *   -r  the site tree on disk (../..)      -u  its url prefix (/debian)
+ *   -R  bytes per range in the deb scenario (262144)
+ *   -o  also append the result line to this file
+ *   -C  compare with the last result for the scenario in this file
+ *
+ * Scenarios, built from the tree given with -r:
+ *   blog  the front page and every asset it links on the same site
+ *   apt   "apt update" revalidation: conditional GETs of everything in
+ *         dists/stable with the ETag and Last-Modified first seen
+ *   deb   the .deb files in pool fetched in -R byte ranges, shuffled
+ *         so that the connections pull different packages at once
+ *   404   a flood of urls that do not exist
+ *
+ * The result goes to stdout as one line of JSON: requests per second,
+ * bytes per second, latency percentiles in microseconds and counts by
+ * status, plus "unexpected" for answers other than the scenario's
+ * (a 304 in apt, a 206 in deb...).  Lines from runs before and after
+ * a change are meant to be kept in one file and compared with -C. */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 4000;
+    int threads = 1;
+    int connections = 32;
+    int depth = 1;
+    bool keepalive = true;
+    double seconds = 10;
+    double warmup = 1;
+    long long limit = 0;
+    std::string root = "../..";
+    std::string prefix = "/debian";
+    long long range = 262144;
+    std::string out, compare, scenario;
+};
+
+struct Request {
+    std::string text;
+    int expect;             /* the status a healthy server answers */
+};
+
+struct Conn {
+    int fd = -1;
+    bool connected = false;
+    std::string out;
+    size_t outoff = 0;
+    std::string in;
+    std::deque<uint64_t> pending;   /* send times of unanswered requests */
+    std::deque<int> expect;
+    size_t next = 0;                /* the next request of the scenario */
+    size_t first = 0;               /* the first unanswered one */
+    int used = 0;                   /* requests sent on this connection */
+};
+
+struct Result {
+    uint64_t requests = 0, errors = 0, unexpected = 0, bytes = 0;
+    uint64_t connects = 0;
+    std::map<int, uint64_t> status;
+    std::vector<uint32_t> latency;
+};
+
+static Options opt;
+static std::vector<Request> requests;
+static sockaddr_in server;
+static std::atomic<long long> issued{0};
+static uint64_t t_measure, t_end;
+
+/**********************************************************************/
+/* The monotonic clock in nanoseconds. */
+/**********************************************************************/
+static uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**********************************************************************/
+/* Print an error message and exit. */
+/**********************************************************************/
+[[noreturn]] static void die(const std::string &msg)
+{
+    fprintf(stderr, "loadgen: %s\n", msg.c_str());
+    exit(1);
+}
+
+/**********************************************************************/
+/* The value of a header in a response head, if present.
+ * Parameters: the head, through the blank line
+ *             the header name
+ *             where to put the value
+ * Returns: whether the header is there */
+/**********************************************************************/
+static bool header(const std::string &head, const char *name,
+                   std::string *value)
+{
+    size_t len = strlen(name);
+    size_t p = head.find("\r\n");
+
+    while (p != std::string::npos && p + 2 < head.size()) {
+        p += 2;
+        if (head.compare(p, 2, "\r\n") == 0)
+            break;
+        if (strncasecmp(head.c_str() + p, name, len) == 0 &&
+            head[p + len] == ':') {
+            size_t v = head.find_first_not_of(" \t", p + len + 1);
+            size_t e = head.find("\r\n", p);
+            *value = head.substr(v, e - v);
+            return true;
+        }
+        p = head.find("\r\n", p);
+    }
+    return false;
+}
+
+/**********************************************************************/
+/* Find where the first response in a buffer ends.
+ * Parameters: the buffer
+ *             whether the connection is at end of file, which ends a
+ *             body without a length
+ *             out: the status code
+ *             out: whether the server will close the connection
+ * Returns: the length of the response, 0 if it is not all there yet,
+ *          -1 if it cannot be parsed */
+/**********************************************************************/
+static long parse_response(const std::string &in, bool eof, int *status,
+                           bool *close)
+{
+    size_t head = in.find("\r\n\r\n");
+    std::string v;
+
+    if (head == std::string::npos)
+        return eof && !in.empty() ? -1 : 0;
+    head += 4;
+    if (in.compare(0, 5, "HTTP/") != 0 || in.size() < 12)
+        return -1;
+    *status = atoi(in.c_str() + 9);
+    std::string h = in.substr(0, head);
+    *close = in.compare(0, 8, "HTTP/1.0") == 0;
+    if (header(h, "Connection", &v))
+        *close = strcasecmp(v.c_str(), "close") == 0 ||
+                 (*close && strcasecmp(v.c_str(), "keep-alive") != 0);
+    if (*status == 304 || *status == 204 || *status / 100 == 1)
+        return head;
+    if (header(h, "Content-Length", &v)) {
+        size_t total = head + strtoull(v.c_str(), nullptr, 10);
+        return in.size() >= total ? (long)total : 0;
+    }
+    if (header(h, "Transfer-Encoding", &v) &&
+        strcasecmp(v.c_str(), "chunked") == 0) {
+        size_t p = head;
+        while (true) {
+            size_t e = in.find("\r\n", p);
+            if (e == std::string::npos)
+                return 0;
+            size_t n = strtoull(in.c_str() + p, nullptr, 16);
+            if (n == 0) {
+                /* no trailers: the last chunk is followed by CRLF */
+                return in.size() >= e + 4 ? (long)(e + 4) : 0;
+            }
+            p = e + 2 + n + 2;
+            if (p > in.size())
+                return 0;
+        }
+    }
+    *close = true;
+    return eof ? (long)in.size() : 0;
+}
+
+/**********************************************************************/
+/* Fetch a url with a blocking connection, to set a scenario up.
+ * Parameters: the request, without the blank line
+ *             out: the response head
+ * Returns: the body */
+/**********************************************************************/
+static std::string fetch(const std::string &req, std::string *head)
+{
+    std::string in, msg = req + "Connection: close\r\n\r\n";
+    char buf[65536];
+    int status;
+    bool close;
+    long len;
+    ssize_t n;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd == -1 || connect(fd, (sockaddr *)&server, sizeof(server)) == -1)
+        die("connect: " + std::string(strerror(errno)));
+    if (write(fd, msg.data(), msg.size()) != (ssize_t)msg.size())
+        die("write: " + std::string(strerror(errno)));
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        in.append(buf, n);
+    ::close(fd);
+    if ((len = parse_response(in, true, &status, &close)) <= 0)
+        die("bad response to " + req.substr(0, req.find('\r')));
+    size_t h = in.find("\r\n\r\n") + 4;
+    *head = in.substr(0, h);
+    return in.substr(h, len - h);
+}
+
+/**********************************************************************/
+/* A GET request for a url, without the blank line at its end. */
+/**********************************************************************/
+static std::string get(const std::string &url)
+{
+    return "GET " + url + " HTTP/1.1\r\nHost: " + opt.host + "\r\n";
+}
+
+/**********************************************************************/
+/* Close the request head, asking to keep the connection or not. */
+/**********************************************************************/
+static std::string finish(const std::string &req)
+{
+    return req + (opt.keepalive ? "\r\n" : "Connection: close\r\n\r\n");
+}
+
+/**********************************************************************/
+/* The front page and the assets it links on the same site, as a
+ * browser with an empty cache would load them. */
+/**********************************************************************/
+static void scenario_blog()
+{
+    std::string page = opt.prefix + "/", head;
+    std::string body = fetch(get(page), &head);
+    const std::string attrs[] = { "src=\"", "href=\"", "src='", "href='" };
+
+    requests.push_back({ finish(get(page) + "Accept-Encoding: gzip\r\n"),
+                         200 });
+    for (const std::string &a : attrs) {
+        for (size_t p = body.find(a); p != std::string::npos;
+             p = body.find(a, p)) {
+            p += a.size();
+            std::string url = body.substr(p, body.find(a.back(), p) - p);
+            if (url.empty() || url.compare(0, 2, "//") == 0 ||
+                url.find(':') != std::string::npos || url[0] == '#')
+                continue;
+            if (url[0] != '/')
+                url = page + url;
+            requests.push_back({ finish(get(url) +
+                                        "Accept-Encoding: gzip\r\n"), 200 });
+        }
+    }
+    fprintf(stderr, "blog: %s and %zu assets\n", page.c_str(),
+            requests.size() - 1);
+}
+
+/**********************************************************************/
+/* Everything apt update reads from dists/stable, requested again with
+ * the validators of a first fetch. */
+/**********************************************************************/
+static void scenario_apt()
+{
+    fs::path dists = fs::path(opt.root) / "dists" / "stable";
+    std::vector<std::string> urls;
+    std::string head, v;
+
+    for (const auto &e : fs::recursive_directory_iterator(dists))
+        if (e.is_regular_file())
+            urls.push_back(opt.prefix + "/dists/stable/" +
+                           e.path().lexically_relative(dists).string());
+    std::sort(urls.begin(), urls.end());
+    for (const std::string &url : urls) {
+        std::string req = get(url);
+        fetch(req, &head);
+        if (header(head, "ETag", &v))
+            req += "If-None-Match: " + v + "\r\n";
+        if (header(head, "Last-Modified", &v))
+            req += "If-Modified-Since: " + v + "\r\n";
+        requests.push_back({ finish(req),
+                             req.find("If-") != std::string::npos ? 304
+                                                                  : 200 });
+    }
+    fprintf(stderr, "apt: %zu index files\n", requests.size());
+}
+
+/**********************************************************************/
+/* The packages of the pool in byte ranges, shuffled. */
+/**********************************************************************/
+static void scenario_deb()
+{
+    fs::path pool = fs::path(opt.root) / "pool";
+    std::mt19937 rng(1);
+    size_t files = 0;
+
+    for (const auto &e : fs::recursive_directory_iterator(pool)) {
+        if (!e.is_regular_file() || e.path().extension() != ".deb")
+            continue;
+        std::string url = opt.prefix + "/pool/" +
+                          e.path().lexically_relative(pool).string();
+        long long size = e.file_size();
+        for (long long a = 0; a < size; a += opt.range) {
+            long long b = std::min(a + opt.range, size) - 1;
+            requests.push_back({ finish(get(url) + "Range: bytes=" +
+                                        std::to_string(a) + "-" +
+                                        std::to_string(b) + "\r\n"),
+                                 206 });
+        }
+        files++;
+    }
+    std::shuffle(requests.begin(), requests.end(), rng);
+    fprintf(stderr, "deb: %zu ranges of %zu packages\n", requests.size(),
+            files);
+}
+
+/**********************************************************************/
+/* Urls that are not there: missing packages and indices, and the
+ * usual probes. */
+/**********************************************************************/
+static void scenario_404()
+{
+    const char *shapes[] = {
+        "/pool/main/x/missing-%u_1.0_amd64.deb",
+        "/dists/stable/main/binary-%x/Packages.xz",
+        "/nope/%u/",
+        "/wp-login.php?%u",
+    };
+    std::mt19937 rng(1);
+    char url[128];
+
+    for (int i = 0; i < 1024; i++) {
+        snprintf(url, sizeof(url), shapes[i % 4], (unsigned)rng());
+        requests.push_back({ finish(get(opt.prefix + url)), 404 });
+    }
+    fprintf(stderr, "404: %zu urls\n", requests.size());
+}
+
+/**********************************************************************/
+/* Open a connection to the server, without waiting for it. */
+/**********************************************************************/
+static void conn_open(int ep, Conn &c, uint32_t id, Result &r)
+{
+    struct epoll_event ev;
+    int one = 1;
+
+    c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c.fd == -1)
+        die("socket: " + std::string(strerror(errno)));
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c.fd, (sockaddr *)&server, sizeof(server)) == -1 &&
+        errno != EINPROGRESS)
+        die("connect: " + std::string(strerror(errno)));
+    c.connected = false;
+    c.out.clear();
+    c.outoff = 0;
+    c.in.clear();
+    c.pending.clear();
+    c.expect.clear();
+    c.used = 0;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.u32 = id;
+    epoll_ctl(ep, EPOLL_CTL_ADD, c.fd, &ev);
+    r.connects++;
+}
+
+/**********************************************************************/
+/* Drop a connection and open the next one.  Requests still unanswered
+ * on it are sent again if the server said it would close, and are
+ * counted as errors if not.
+ * Parameter: whether the server announced the close */
+/**********************************************************************/
+static void conn_reopen(int ep, Conn &c, uint32_t id, Result &r,
+                        bool announced)
+{
+    uint64_t t = now_ns();
+
+    if (announced) {
+        c.next = c.first;
+        if (opt.limit > 0)
+            issued -= c.pending.size();
+    } else if (t >= t_measure && t < t_end)
+        r.errors += c.pending.size();
+    close(c.fd);
+    conn_open(ep, c, id, r);
+}
+
+/**********************************************************************/
+/* Queue requests on a connection up to the pipeline depth, and write
+ * what is queued until the socket is full.
+ * Returns: false if the connection failed */
+/**********************************************************************/
+static bool conn_send(Conn &c)
+{
+    int depth = opt.keepalive ? opt.depth : 1;
+    ssize_t n;
+
+    while ((int)c.pending.size() < depth && (opt.keepalive || c.used == 0)) {
+        if (opt.limit > 0 && issued.fetch_add(1) >= opt.limit)
+            break;
+        if (opt.limit == 0 && now_ns() >= t_end)
+            break;
+        const Request &q = requests[c.next];
+        if (c.pending.empty())
+            c.first = c.next;
+        c.next = (c.next + 1) % requests.size();
+        c.out += q.text;
+        c.pending.push_back(now_ns());
+        c.expect.push_back(q.expect);
+        c.used++;
+    }
+    while (c.outoff < c.out.size()) {
+        n = write(c.fd, c.out.data() + c.outoff, c.out.size() - c.outoff);
+        if (n == -1)
+            return errno == EAGAIN;
+        c.outoff += n;
+    }
+    c.out.clear();
+    c.outoff = 0;
+    return true;
+}
+
+/**********************************************************************/
+/* Read what the server sent and account for every complete response,
+ * including those that arrived before a reset.
+ * Returns: 1 to carry on, 0 if the server closed the connection as
+ *          announced in a response, -1 on error or unexpected close */
+/**********************************************************************/
+static int conn_recv(Conn &c, Result &r)
+{
+    char buf[65536];
+    bool eof = false, reset = false, close = false;
+    ssize_t n;
+    int status;
+    long len;
+
+    while ((n = read(c.fd, buf, sizeof(buf))) > 0)
+        c.in.append(buf, n);
+    if (n == 0)
+        eof = true;
+    else if (errno == ECONNRESET)
+        reset = true;
+    else if (errno != EAGAIN)
+        return -1;
+    while (!c.pending.empty() &&
+           (len = parse_response(c.in, eof, &status, &close)) != 0) {
+        if (len == -1)
+            return -1;
+        uint64_t t = now_ns();
+        if (t >= t_measure && t < t_end) {
+            r.requests++;
+            r.bytes += len;
+            r.status[status]++;
+            if (status != c.expect.front())
+                r.unexpected++;
+            r.latency.push_back((t - c.pending.front()) / 1000);
+        }
+        c.pending.pop_front();
+        c.expect.pop_front();
+        c.first = (c.first + 1) % requests.size();
+        c.in.erase(0, len);
+        if (close)
+            return 0;
+    }
+    return eof || reset ? -1 : 1;
+}
+
+/**********************************************************************/
+/* One client thread: an epoll loop over its share of the connections.
+ * The connections start at points spread evenly over the scenario.
+ * Parameters: the number of the first of them, over all threads
+ *             how many connections
+ *             where to put the counts */
+/**********************************************************************/
+static void client(int first, int nconns, Result *r)
+{
+    std::vector<Conn> conns(nconns);
+    struct epoll_event evs[256];
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    uint64_t t;
+
+    if (ep == -1)
+        die("epoll_create1: " + std::string(strerror(errno)));
+    for (int i = 0; i < nconns; i++) {
+        conns[i].next = (size_t)(first + i) * requests.size() /
+                        opt.connections;
+        conn_open(ep, conns[i], i, *r);
+    }
+    while ((t = now_ns()) < t_end || opt.limit > 0) {
+        if (opt.limit > 0 && issued.load() >= opt.limit &&
+            std::all_of(conns.begin(), conns.end(),
+                        [](const Conn &c) { return c.pending.empty(); }))
+            break;
+        int n = epoll_wait(ep, evs, 256, 100);
+        for (int i = 0; i < n; i++) {
+            uint32_t id = evs[i].data.u32;
+            Conn &c = conns[id];
+            if (!c.connected) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0) {
+                    if (now_ns() >= t_measure)
+                        r->errors++;
+                    conn_reopen(ep, c, id, *r, false);
+                    continue;
+                }
+                if (!(evs[i].events & EPOLLOUT))
+                    continue;
+                c.connected = true;
+            }
+            if (evs[i].events & EPOLLIN) {
+                int ok = conn_recv(c, *r);
+                if (ok != 1) {
+                    conn_reopen(ep, c, id, *r, ok == 0);
+                    continue;
+                }
+            }
+            if (!conn_send(c))
+                conn_reopen(ep, c, id, *r, false);
+        }
+    }
+    for (Conn &c : conns)
+        close(c.fd);
+    close(ep);
+}
+
+/**********************************************************************/
+/* A number from a result line, by key.
+ * Returns: the number, or -1 if it is not there */
+/**********************************************************************/
+static double json_number(const std::string &line, const std::string &key)
+{
+    size_t p = line.find("\"" + key + "\":");
+
+    return p == std::string::npos ? -1
+                                  : strtod(line.c_str() + p + key.size() + 3,
+                                           nullptr);
+}
+
+/**********************************************************************/
+/* Print how a result compares with the last one for the same scenario
+ * in a file of earlier results. */
+/**********************************************************************/
+static void compare(const std::string &file, const std::string &line)
+{
+    std::ifstream in(file);
+    std::string l, last, tag = "\"scenario\":\"" + opt.scenario + "\"";
+    const char *keys[] = { "rps", "mb_per_s", "p50", "p99", "p999" };
+
+    while (std::getline(in, l))
+        if (l.find(tag) != std::string::npos)
+            last = l;
+    if (last.empty()) {
+        fprintf(stderr, "no earlier %s result in %s\n", opt.scenario.c_str(),
+                file.c_str());
+        return;
+    }
+    for (const char *k : keys) {
+        double a = json_number(last, k), b = json_number(line, k);
+        fprintf(stderr, "%-9s %12.1f -> %12.1f  %+6.1f%%\n", k, a, b,
+                a > 0 ? (b - a) * 100 / a : 0.0);
+    }
+}
+
+/**********************************************************************/
+/* The result as one line of JSON. */
+/**********************************************************************/
+static std::string report(Result &r, double secs)
+{
+    std::vector<uint32_t> &l = r.latency;
+    char buf[1024];
+    std::string s;
+    auto pct = [&](double p) {
+        return l.empty() ? 0u : l[std::min(l.size() - 1,
+                                           (size_t)(p * l.size()))];
+    };
+    double mean = 0;
+
+    std::sort(l.begin(), l.end());
+    for (uint32_t v : l)
+        mean += v;
+    if (!l.empty())
+        mean /= l.size();
+    snprintf(buf, sizeof(buf),
+             "{\"scenario\":\"%s\",\"host\":\"%s\",\"port\":%d,"
+             "\"threads\":%d,\"connections\":%d,\"depth\":%d,"
+             "\"keepalive\":%s,\"seconds\":%.3f,\"requests\":%llu,"
+             "\"errors\":%llu,\"unexpected\":%llu,\"connects\":%llu,"
+             "\"rps\":%.1f,\"bytes\":%llu,\"mb_per_s\":%.2f,\"status\":{",
+             opt.scenario.c_str(), opt.host.c_str(), opt.port, opt.threads,
+             opt.connections, opt.depth, opt.keepalive ? "true" : "false",
+             secs, (unsigned long long)r.requests,
+             (unsigned long long)r.errors, (unsigned long long)r.unexpected,
+             (unsigned long long)r.connects, r.requests / secs,
+             (unsigned long long)r.bytes, r.bytes / secs / 1e6);
+    s = buf;
+    for (auto it = r.status.begin(); it != r.status.end(); ++it)
+        s += (it == r.status.begin() ? "\"" : ",\"") +
+             std::to_string(it->first) + "\":" + std::to_string(it->second);
+    snprintf(buf, sizeof(buf),
+             "},\"latency_us\":{\"mean\":%.1f,\"p50\":%u,\"p90\":%u,"
+             "\"p99\":%u,\"p999\":%u,\"max\":%u}}",
+             mean, pct(0.5), pct(0.9), pct(0.99), pct(0.999),
+             l.empty() ? 0u : l.back());
+    return s + buf;
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+
+    while ((c = getopt(argc, argv, "h:p:t:c:d:k:s:w:n:r:u:R:o:C:")) != -1) {
+        switch (c) {
+        case 'h': opt.host = optarg; break;
+        case 'p': opt.port = atoi(optarg); break;
+        case 't': opt.threads = std::max(1, atoi(optarg)); break;
+        case 'c': opt.connections = std::max(1, atoi(optarg)); break;
+        case 'd': opt.depth = std::max(1, atoi(optarg)); break;
+        case 'k': opt.keepalive = atoi(optarg) != 0; break;
+        case 's': opt.seconds = atof(optarg); break;
+        case 'w': opt.warmup = atof(optarg); break;
+        case 'n': opt.limit = atoll(optarg); break;
+        case 'r': opt.root = optarg; break;
+        case 'u': opt.prefix = optarg; break;
+        case 'R': opt.range = std::max(1LL, atoll(optarg)); break;
+        case 'o': opt.out = optarg; break;
+        case 'C': opt.compare = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-h host] [-p port] [-t threads]"
+                    " [-c connections] [-d depth] [-k 0|1] [-s seconds]"
+                    " [-w seconds] [-n requests] [-r root] [-u prefix]"
+                    " [-R bytes] [-o file] [-C file] blog|apt|deb|404\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1)
+        die("which scenario: blog, apt, deb or 404?");
+    opt.scenario = argv[optind];
+    opt.threads = std::min(opt.threads, opt.connections);
+    server.sin_family = AF_INET;
+    server.sin_port = htons(opt.port);
+    if (inet_pton(AF_INET, opt.host.c_str(), &server.sin_addr) != 1)
+        die("bad address " + opt.host);
+
+    try {
+        if (opt.scenario == "blog")
+            scenario_blog();
+        else if (opt.scenario == "apt")
+            scenario_apt();
+        else if (opt.scenario == "deb")
+            scenario_deb();
+        else if (opt.scenario == "404")
+            scenario_404();
+        else
+            die("no scenario " + opt.scenario);
+    } catch (const fs::filesystem_error &e) {
+        die(e.what());
+    }
+    if (requests.empty())
+        die("nothing to request in " + opt.root);
+
+    std::vector<Result> results(opt.threads);
+    std::vector<std::thread> threads;
+    uint64_t start = now_ns();
+
+    /* -n counts every request, with no warm-up and no time limit */
+    t_measure = opt.limit > 0 ? 0 : start + opt.warmup * 1e9;
+    t_end = opt.limit > 0 ? UINT64_MAX : t_measure + opt.seconds * 1e9;
+    for (int i = 0, first = 0; i < opt.threads; i++) {
+        int n = opt.connections / opt.threads +
+                (i < opt.connections % opt.threads);
+        threads.emplace_back(client, first, n, &results[i]);
+        first += n;
+    }
+    for (std::thread &t : threads)
+        t.join();
+
+    Result total;
+    double secs = opt.limit > 0 ? (now_ns() - start) / 1e9 : opt.seconds;
+    for (Result &r : results) {
+        total.requests += r.requests;
+        total.errors += r.errors;
+        total.unexpected += r.unexpected;
+        total.bytes += r.bytes;
+        total.connects += r.connects;
+        for (auto &s : r.status)
+            total.status[s.first] += s.second;
+        total.latency.insert(total.latency.end(), r.latency.begin(),
+                             r.latency.end());
+    }
+    std::string line = report(total, secs);
+    printf("%s\n", line.c_str());
+    if (!opt.compare.empty())
+        compare(opt.compare, line);
+    if (!opt.out.empty()) {
+        std::ofstream f(opt.out, std::ios::app);
+        f << line << "\n";
+    }
+    return total.errors > 0 ? 2 : 0;
+}